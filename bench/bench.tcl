@@ -0,0 +1,221 @@
+# Copyright Jerily LTD. All Rights Reserved.
+# SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+# SPDX-License-Identifier: MIT.
+
+# Renders the templates of bench/www, and synthetic ones of growing size, under each configuration:
+#
+#   tcl      - templates compiled to tcl and loaded from the cache directory (cache 1)
+#   c        - templates compiled to c and loaded from the cache directory (cache 1)
+#   uncached - templates compiled to tcl procs in memory on first use (cache 0)
+#
+# Every configuration runs in a process of its own, as the compiled templates are loaded into
+# the process and the RSS is that of the process. For every configuration and template a line
+# is written with a dict of results: renders per second, p50 and p99 latency in microseconds,
+# bytes of output, the bytes that the allocator of tcl holds after the renders and at most (with
+# a TCL_MEM_DEBUG build of tcl), and the RSS and peak RSS in kilobytes (where /proc is available).
+# A field that cannot be measured is left out. The lines are sorted, so that the results of two
+# runs can be compared with diff.
+#
+# Usage: tclsh bench.tcl ?-configs {tcl c uncached}? ?-renders 200? ?-sizes {10 100 500}?
+#                        ?-workdir dir? ?-output file?
+
+package require thtml
+
+source [file join [file dirname [file normalize [info script]]] generate.tcl]
+
+namespace eval ::thtml::bench {
+    variable benchdir [file dirname [file normalize [info script]]]
+    variable configs {tcl c uncached}
+}
+
+proc ::thtml::bench::templates {sizes} {
+    set rows {}
+    for {set i 0} {$i < 200} {incr i} {
+        set row {}
+        for {set j 0} {$j < 10} {incr j} {
+            lappend row "cell <${i},${j}> & co"
+        }
+        lappend rows $row
+    }
+
+    set items {}
+    for {set i 0} {$i < 500} {incr i} {
+        lappend items [dict create \
+            name "item ${i}" \
+            kind [lindex {book music toy food} [expr { $i % 4 }]] \
+            price [expr { $i * 13 % 250 }] \
+            stock [expr { $i % 4 ? $i : 0 }] \
+            qty [expr { $i % 10 }] \
+            featured [expr { $i % 5 == 0 }]]
+    }
+
+    set words {}
+    for {set i 0} {$i < 200} {incr i} {
+        lappend words "word-${i}-x"
+    }
+
+    set templates [dict create \
+        table.thtml [dict create title "Large table" rows $rows] \
+        tree.thtml [dict create title "Include tree" user {name "Jane & John" email jj@example.com}] \
+        conditionals.thtml [dict create items $items] \
+        commands.thtml [dict create words $words]]
+
+    foreach size $sizes {
+        dict set templates generated_${size}.thtml [generate_data]
+    }
+    return $templates
+}
+
+# a copy of bench/www with the synthetic templates, for every configuration
+proc ::thtml::bench::prepare_rootdir {workdir config sizes} {
+    variable benchdir
+
+    set rootdir [file join $workdir $config]
+    file delete -force $rootdir
+    file mkdir $rootdir
+    file copy [file join $benchdir www] [file join $rootdir www]
+
+    foreach size $sizes {
+        set fp [open [file join $rootdir www generated_${size}.thtml] w]
+        puts -nonewline $fp [generate_template $size]
+        close $fp
+    }
+    return $rootdir
+}
+
+# returns the fields of /proc/self/status as a dict of the result name and the kilobytes, the
+# ones that are not there are left out
+proc ::thtml::bench::status_kb {fields} {
+    if { [catch {
+        set fp [open /proc/self/status]
+        set status [read $fp]
+        close $fp
+    }] } {
+        return
+    }
+    set result {}
+    dict for {name field} $fields {
+        if { [regexp -line "^${field}:\\s+(\\d+)" $status -> kb] } {
+            dict set result $name $kb
+        }
+    }
+    return $result
+}
+
+# returns the counters of memory info as a dict of the result name and the bytes, the memory
+# command only exists in a TCL_MEM_DEBUG build of tcl
+proc ::thtml::bench::allocated_bytes {counters} {
+    if { [catch { memory info } info] } {
+        return
+    }
+    set result {}
+    dict for {name counter} $counters {
+        if { [regexp -line "^${counter}\\s+(\\d+)" $info -> bytes] } {
+            dict set result $name $bytes
+        }
+    }
+    return $result
+}
+
+proc ::thtml::bench::measure {config filename data renders} {
+    # warm up, in uncached mode the first render compiles the template
+    set html [::thtml::renderfile $filename $data]
+    for {set i 0} {$i < 10} {incr i} {
+        ::thtml::renderfile $filename $data
+    }
+
+    set times {}
+    set start [clock microseconds]
+    for {set i 0} {$i < $renders} {incr i} {
+        set t [clock microseconds]
+        ::thtml::renderfile $filename $data
+        lappend times [expr { [clock microseconds] - $t }]
+    }
+    set elapsed [expr { max([clock microseconds] - $start, 1) }]
+
+    set times [lsort -integer $times]
+    set n [llength $times]
+    return [list \
+        config $config \
+        template [file rootname $filename] \
+        renders_per_sec [format %.1f [expr { $renders * 1e6 / $elapsed }]] \
+        p50_us [lindex $times [expr { ($n - 1) / 2 }]] \
+        p99_us [lindex $times [expr { int(ceil($n * 0.99)) - 1 }]] \
+        output_bytes [string length [encoding convertto utf-8 $html]] \
+        {*}[allocated_bytes {allocated_bytes {current bytes allocated} peak_allocated_bytes {maximum bytes allocated}}] \
+        {*}[status_kb {rss_kb VmRSS peak_rss_kb VmHWM}]]
+}
+
+# runs in the child process of a configuration
+proc ::thtml::bench::run {config rootdir renders sizes results_file} {
+    switch -- $config {
+        tcl - c {
+            ::thtml::init [dict create cache 1 rootdir $rootdir target_lang $config]
+            ::thtml::build::compiledir [file join $rootdir www] $config
+            ::thtml::load_compiled_templates
+        }
+        uncached {
+            ::thtml::init [dict create cache 0 rootdir $rootdir target_lang tcl]
+        }
+    }
+
+    set results {}
+    dict for {filename data} [templates $sizes] {
+        lappend results [measure $config $filename $data $renders]
+    }
+
+    set fp [open $results_file w]
+    puts $fp [join $results \n]
+    close $fp
+}
+
+proc ::thtml::bench::main {argv} {
+    variable configs
+
+    set options [dict create -configs $configs -renders 200 -sizes {10 100 500} \
+        -workdir [file join [pwd] bench-work] -output {}]
+    if { [lindex $argv 0] eq {-run} } {
+        lassign $argv - config rootdir renders sizes results_file
+        run $config $rootdir $renders $sizes $results_file
+        return
+    }
+    if { [llength $argv] % 2 != 0 } {
+        error "usage: [file tail [info script]] ?-configs list? ?-renders n? ?-sizes list? ?-workdir dir? ?-output file?"
+    }
+    foreach {option value} $argv {
+        if { ![dict exists $options $option] } {
+            error "unknown option \"${option}\", must be one of: [join [dict keys $options] {, }]"
+        }
+        dict set options $option $value
+    }
+    foreach config [dict get $options -configs] {
+        if { $config ni $configs } {
+            error "unknown configuration \"${config}\", must be one of: [join $configs {, }]"
+        }
+    }
+
+    set workdir [file normalize [dict get $options -workdir]]
+    set sizes [dict get $options -sizes]
+    set results {}
+    foreach config [dict get $options -configs] {
+        set rootdir [prepare_rootdir $workdir $config $sizes]
+        set results_file [file join $workdir ${config}.results]
+        # whatever the templates print while they are compiled goes to stderr
+        exec [info nameofexecutable] [info script] -run $config $rootdir [dict get $options -renders] $sizes $results_file \
+            >@ stderr 2>@ stderr
+        set fp [open $results_file]
+        lappend results {*}[split [string trim [read $fp]] \n]
+        close $fp
+    }
+
+    set output [join [lsort $results] \n]
+    if { [dict get $options -output] eq {} } {
+        puts $output
+    } else {
+        set fp [open [dict get $options -output] w]
+        puts $fp $output
+        close $fp
+    }
+}
+
+::thtml::bench::main $argv
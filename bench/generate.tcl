@@ -0,0 +1,50 @@
+# Copyright Jerily LTD. All Rights Reserved.
+# SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+# SPDX-License-Identifier: MIT.
+
+# Synthetic templates for measuring how rendering scales with the size of a template. A
+# template of size n has n sections, each with text, a conditional and a loop over the items
+# of the data, so the work per render grows linearly with n.
+#
+# Usage: tclsh generate.tcl <size> ?<filepath>?
+
+namespace eval ::thtml::bench {}
+
+proc ::thtml::bench::generate_template {size} {
+    set template "<html>\n<head>\n    <title>\${title}</title>\n</head>\n<body>\n"
+    for {set i 0} {$i < $size} {incr i} {
+        append template "<div class=\"section-${i}\">\n"
+        append template "    <h2>\${title} ${i}</h2>\n"
+        append template "    <tpl if=\"\${count} > [expr { $i % 5 }]\"><p>more than [expr { $i % 5 }]</p></tpl>\n"
+        append template "    <tpl foreach=\"item\" in=\"\${items}\">"
+        append template "<span class=\"\${item.kind}\">\${item.name}</span>"
+        append template "<tpl if=\"\${item.value} % [expr { $i % 3 + 2 }] == 0\"> even</tpl>"
+        append template "</tpl>\n"
+        append template "</div>\n"
+    }
+    append template "</body>\n</html>\n"
+    return $template
+}
+
+proc ::thtml::bench::generate_data {} {
+    set items {}
+    for {set i 0} {$i < 10} {incr i} {
+        lappend items [dict create kind [lindex {a b c} [expr { $i % 3 }]] name "item <${i}>" value $i]
+    }
+    return [dict create title "Generated & synthetic" count 3 items $items]
+}
+
+if { [info exists argv0] && [file normalize $argv0] eq [file normalize [info script]] } {
+    if { [llength $argv] < 1 || [llength $argv] > 2 } {
+        puts "Usage: [file tail [info script]] <size> ?<filepath>?"
+        exit 1
+    }
+    set template [::thtml::bench::generate_template [lindex $argv 0]]
+    if { [llength $argv] == 2 } {
+        set fp [open [lindex $argv 1] w]
+        puts -nonewline $fp $template
+        close $fp
+    } else {
+        puts -nonewline $template
+    }
+}
@@ -16,8 +16,5 @@ set rootdir [lindex $argv 1]
 set dir [lindex $argv 2]
 
 ::thtml::init [dict create build 1 cache 1 rootdir $rootdir target_lang $target_lang debug 1]
-set cachedir [::thtml::get_cachedir]
-file delete -force $cachedir
-file mkdir $cachedir
-
+# the cache directory is kept, templates whose files did not change are not compiled again
 puts [::thtml::build::compiledir $dir $target_lang]
\ No newline at end of file
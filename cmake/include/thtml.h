@@ -57,6 +57,10 @@ typedef int Tcl_Size;
 # define TCL_SIZE_MODIFIER ""
 #endif
 
+#include "thtml_escape.h"
+#include "thtml_fragment.h"
+#include "thtml_stats.h"
+
 #define SetResult(str) Tcl_ResetResult(__interp__); \
                      Tcl_SetStringObj(Tcl_GetObjResult(__interp__), (str), -1)
 
@@ -76,6 +80,33 @@ typedef int Tcl_Size;
 #endif
 
 
+// upper bound for presizing the output buffer of a template, in bytes
+#ifndef THTML_BUFFER_SIZE_CAP
+#define THTML_BUFFER_SIZE_CAP (4 * 1024 * 1024)
+#endif
+
+typedef struct {
+    Tcl_Obj **literals;
+    // running estimate of the output size, it follows increases immediately and decays slowly
+    Tcl_Size size_estimate;
+} __thtml_template_t;
+
+// bytes that a streaming render collects before it writes them to its sink
+#ifndef THTML_STREAM_CHUNK_SIZE
+#define THTML_STREAM_CHUNK_SIZE 16384
+#endif
+
+// The output of a render. A buffered render returns it as its result, a streaming one writes
+// it to its sink, a channel or a command prefix that gets every chunk as its last argument,
+// whenever THTML_STREAM_CHUNK_SIZE bytes have been collected and at every <tpl flush/>.
+// Includes get the output as the Tcl_DString it starts with.
+typedef struct {
+    Tcl_DString ds;
+    // NULL for a buffered render
+    Tcl_Obj *sink;
+    Tcl_Channel channel;
+} __thtml_output_t;
+
 #define UWIDE_MAX ((Tcl_WideUInt)-1)
 #define WIDE_MAX ((Tcl_WideInt)(UWIDE_MAX >> 1))
 #define WIDE_MIN ((Tcl_WideInt)((Tcl_WideUInt)WIDE_MAX+1))
@@ -85,6 +116,64 @@ typedef int Tcl_Size;
 #define GENERAL_ARITHMETIC_ERROR ((Tcl_Obj *) -3)
 #define OUT_OF_MEMORY ((Tcl_Obj *) -4)
 
+// Template data is looked up in layers: an include gets a layer with its arguments
+// on top of the layer of its caller, and the root layer holds the data given to render.
+// The dict of a layer is created or copied only when a val writes to it.
+typedef struct __thtml_scope_s {
+    Tcl_Obj *dict;
+    struct __thtml_scope_s *parent;
+} __thtml_scope_t;
+
+// The code of a directory is built as a translation unit per template and a runtime one that
+// defines THTML_RUNTIME before including this file. The helpers below are compiled only in the
+// runtime unit, the templates see their declarations and the inline ones.
+
+int __thtml_string_compare__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_streq__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_strneq__(Tcl_Obj *a, Tcl_Obj *b);
+int __thtml_compare_two_numbers__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_gt__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_gte__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_lt__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_lte__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_eq__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_ne__(Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_not__(Tcl_Obj *a);
+Tcl_Obj *__thtml_add__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_sub__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_mult__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_div__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_mod__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_lshift__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_rshift__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_bitor__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_bitxor__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_bitand__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_expon__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b);
+Tcl_Obj *__thtml_bitnot__(Tcl_Obj *a);
+Tcl_Obj *__thtml_uminus__(Tcl_Obj *a);
+int __thtml_scope_set__(Tcl_Interp *interp, __thtml_scope_t *scope, Tcl_Size keyc, Tcl_Obj *const keyv[], Tcl_Obj *value_ptr);
+int __thtml_scope_merge__(Tcl_Interp *interp, __thtml_scope_t *scope, Tcl_Obj *source_ptr);
+Tcl_Obj *__thtml_scope_flatten__(Tcl_Interp *interp, __thtml_scope_t *scope);
+Tcl_Obj **__thtml_new_literals__(Tcl_Interp *interp, const char *name, const char *const strings[],
+                                 const Tcl_Size lengths[], Tcl_Size size);
+__thtml_template_t *__thtml_new_templates__(Tcl_Interp *interp, const char *name, Tcl_Size size);
+int __thtml_size_estimate_cmd__(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int __thtml_output_init__(Tcl_Interp *interp, __thtml_output_t *output, Tcl_Obj *sink_ptr);
+int __thtml_output_flush__(Tcl_Interp *interp, Tcl_DString *dsPtr, int flush_channel);
+int __thtml_fragment_get__(Tcl_Interp *interp, const char *key, Tcl_DString *dsPtr);
+void __thtml_fragment_put__(Tcl_Interp *interp, const char *key, const char *bytes, Tcl_Size length, Tcl_WideInt ttl);
+int __thtml_eval_objv__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+int __thtml_lindex__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+int __thtml_lrange__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+int __thtml_llength__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+int __thtml_string_index__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+int __thtml_string_length__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+int __thtml_string_toupper__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+int __thtml_dict_get__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]);
+
+#ifdef THTML_RUNTIME
+
 enum MathInstruction {
     INST_BITOR,
     INST_BITXOR,
@@ -451,28 +540,6 @@ Tcl_Obj *__thtml_ne__(Tcl_Obj *a, Tcl_Obj *b) {
     return Tcl_NewBooleanObj(__thtml_compare_two_numbers__(a, b) != 0);
 }
 
-Tcl_Obj *__thtml_and__(Tcl_Obj *a, Tcl_Obj *b) {
-    int a_val, b_val;
-    if (Tcl_GetBooleanFromObj(NULL, a, &a_val) != TCL_OK) {
-        return 0;
-    }
-    if (Tcl_GetBooleanFromObj(NULL, b, &b_val) != TCL_OK) {
-        return 0;
-    }
-    return Tcl_NewBooleanObj(a_val && b_val);
-}
-
-Tcl_Obj *__thtml_or__(Tcl_Obj *a, Tcl_Obj *b) {
-    int a_val, b_val;
-    if (Tcl_GetBooleanFromObj(NULL, a, &a_val) != TCL_OK) {
-        return 0;
-    }
-    if (Tcl_GetBooleanFromObj(NULL, b, &b_val) != TCL_OK) {
-        return 0;
-    }
-    return Tcl_NewBooleanObj(a_val || b_val);
-}
-
 Tcl_Obj *__thtml_not__(Tcl_Obj *a) {
     int a_val;
     if (Tcl_GetBooleanFromObj(NULL, a, &a_val) != TCL_OK) {
@@ -695,7 +762,7 @@ static Tcl_Obj *__thtml_binary_math_op__(Tcl_Interp *interp, int opcode, Tcl_Obj
                     if (!((w1 > 0 ? w1 : ~w1)
                           & -(((Tcl_WideUInt) 1)
                             << (CHAR_BIT * sizeof(Tcl_WideInt) - 1 - shift)))) {
-                        Tcl_NewWideIntObj((Tcl_WideUInt) w1 << shift);
+                        return Tcl_NewWideIntObj((Tcl_WideUInt) w1 << shift);
                     }
                 }
             } else {
@@ -1170,28 +1237,760 @@ Tcl_Obj *__thtml_uminus__(Tcl_Obj *a) {
     return __thtml_unary_math_op(INST_UMINUS, a);
 }
 
-Tcl_Obj *__thtml_ternary__(Tcl_Interp *interp, Tcl_Obj *a, Tcl_Obj *b, Tcl_Obj *c) {
-    int a_val;
-    if (Tcl_GetBooleanFromObj(interp, a, &a_val) != TCL_OK) {
-        return GENERAL_ARITHMETIC_ERROR;
+#endif // THTML_RUNTIME
+
+// Compiled expressions keep numbers and booleans as C values, an int for booleans and the
+// struct below for numbers, and box them into a Tcl_Obj only where one is needed. The inline
+// helpers do the common cases, the rest (overflows, shifts, exponents) go to the helpers above.
+// There is no room for a bignum, an integer result past 64 bits is an error.
+typedef struct {
+    // TCL_NUMBER_INT or TCL_NUMBER_DOUBLE
+    int type;
+    Tcl_WideInt w;
+    double d;
+} __thtml_num_t;
+
+static inline __thtml_num_t __thtml_num_int__(Tcl_WideInt w) {
+    __thtml_num_t num = {TCL_NUMBER_INT, w, 0.0};
+    return num;
+}
+
+static inline __thtml_num_t __thtml_num_double__(double d) {
+    __thtml_num_t num = {TCL_NUMBER_DOUBLE, 0, d};
+    return num;
+}
+
+static inline double __thtml_num_to_double__(__thtml_num_t num) {
+    return num.type == TCL_NUMBER_INT ? (double) num.w : num.d;
+}
+
+static inline int __thtml_num_bool__(__thtml_num_t num) {
+    return num.type == TCL_NUMBER_INT ? num.w != 0 : num.d != 0.0;
+}
+
+// the caller owns a reference to the returned object
+static inline Tcl_Obj *__thtml_num_obj__(__thtml_num_t num) {
+    return num.type == TCL_NUMBER_INT ? Tcl_NewWideIntObj(num.w) : Tcl_NewDoubleObj(num.d);
+}
+
+static inline int __thtml_num_from_obj__(Tcl_Interp *interp, Tcl_Obj *obj_ptr, __thtml_num_t *num) {
+    void *ptr;
+    int type;
+    if (TCL_OK != Tcl_GetNumberFromObj(interp, obj_ptr, &ptr, &type)) {
+        return TCL_ERROR;
+    }
+    switch (type) {
+        case TCL_NUMBER_INT:
+            *num = __thtml_num_int__(*((const Tcl_WideInt *) ptr));
+            return TCL_OK;
+        case TCL_NUMBER_DOUBLE:
+            *num = __thtml_num_double__(*((const double *) ptr));
+            return TCL_OK;
+        case TCL_NUMBER_NAN:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("can't use non-numeric floating-point value as operand", -1));
+            return TCL_ERROR;
+        default:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("integer value too large to represent", -1));
+            return TCL_ERROR;
+    }
+}
+
+// takes over the result of a math helper above
+static inline int __thtml_num_from_result__(Tcl_Interp *interp, Tcl_Obj *result_ptr, __thtml_num_t *num) {
+    if (result_ptr == DIVIDED_BY_ZERO) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("divide by zero", -1));
+        return TCL_ERROR;
+    }
+    if (result_ptr == EXPONENT_OF_ZERO) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("exponentiation of zero by negative power", -1));
+        return TCL_ERROR;
+    }
+    if (result_ptr == NULL || result_ptr == GENERAL_ARITHMETIC_ERROR || result_ptr == OUT_OF_MEMORY) {
+        // the shifts leave a message of their own
+        if (Tcl_GetCharLength(Tcl_GetObjResult(interp)) == 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("math error: integer overflow or invalid operand", -1));
+        }
+        return TCL_ERROR;
     }
-    return a_val ? b : c;
+    Tcl_IncrRefCount(result_ptr);
+    int code = __thtml_num_from_obj__(interp, result_ptr, num);
+    Tcl_DecrRefCount(result_ptr);
+    return code;
+}
+
+static inline int __thtml_num_boxed__(Tcl_Interp *interp, Tcl_Obj *(*op)(Tcl_Interp *, Tcl_Obj *, Tcl_Obj *),
+                                      __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    Tcl_Obj *a_ptr = __thtml_num_obj__(a);
+    Tcl_Obj *b_ptr = __thtml_num_obj__(b);
+    Tcl_IncrRefCount(a_ptr);
+    Tcl_IncrRefCount(b_ptr);
+    Tcl_ResetResult(interp);
+    int code = __thtml_num_from_result__(interp, op(interp, a_ptr, b_ptr), result);
+    Tcl_DecrRefCount(a_ptr);
+    Tcl_DecrRefCount(b_ptr);
+    return code;
 }
 
-int __thtml_dict_merge__(Tcl_Interp *interp, Tcl_Obj *target_obj, Tcl_Obj *source_obj) {
-    Tcl_Obj *key_obj = NULL, *value_obj = NULL;
-    int i, done;
+static inline int __thtml_num_add__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        Tcl_WideInt w = (Tcl_WideInt) ((Tcl_WideUInt) a.w + (Tcl_WideUInt) b.w);
+        if (!(((a.w ^ w) < 0) && ((a.w ^ b.w) >= 0))) {
+            *result = __thtml_num_int__(w);
+            return TCL_OK;
+        }
+        return __thtml_num_boxed__(interp, __thtml_add__, a, b, result);
+    }
+    *result = __thtml_num_double__(__thtml_num_to_double__(a) + __thtml_num_to_double__(b));
+    return TCL_OK;
+}
+
+static inline int __thtml_num_sub__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        Tcl_WideInt w = (Tcl_WideInt) ((Tcl_WideUInt) a.w - (Tcl_WideUInt) b.w);
+        if (!(((a.w ^ w) < 0) && ((a.w ^ ~b.w) >= 0))) {
+            *result = __thtml_num_int__(w);
+            return TCL_OK;
+        }
+        return __thtml_num_boxed__(interp, __thtml_sub__, a, b, result);
+    }
+    *result = __thtml_num_double__(__thtml_num_to_double__(a) - __thtml_num_to_double__(b));
+    return TCL_OK;
+}
+
+static inline int __thtml_num_mult__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        if (a.w >= INT_MIN && a.w <= INT_MAX && b.w >= INT_MIN && b.w <= INT_MAX) {
+            *result = __thtml_num_int__(a.w * b.w);
+            return TCL_OK;
+        }
+        return __thtml_num_boxed__(interp, __thtml_mult__, a, b, result);
+    }
+    *result = __thtml_num_double__(__thtml_num_to_double__(a) * __thtml_num_to_double__(b));
+    return TCL_OK;
+}
+
+// integer division rounds towards negative infinity, as in the expr command
+static inline int __thtml_num_div__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        if (b.w != 0 && !(a.w == WIDE_MIN && b.w == -1)) {
+            Tcl_WideInt w = a.w / b.w;
+            if (w * b.w != a.w && ((a.w < 0) != (b.w < 0))) {
+                w--;
+            }
+            *result = __thtml_num_int__(w);
+            return TCL_OK;
+        }
+        return __thtml_num_boxed__(interp, __thtml_div__, a, b, result);
+    }
+    *result = __thtml_num_double__(__thtml_num_to_double__(a) / __thtml_num_to_double__(b));
+    return TCL_OK;
+}
+
+// the remainder has the sign of the divisor
+static inline int __thtml_num_mod__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT && b.w != 0 && b.w != -1) {
+        Tcl_WideInt w = a.w % b.w;
+        if (w != 0 && ((w < 0) != (b.w < 0))) {
+            w += b.w;
+        }
+        *result = __thtml_num_int__(w);
+        return TCL_OK;
+    }
+    return __thtml_num_boxed__(interp, __thtml_mod__, a, b, result);
+}
+
+static inline int __thtml_num_bitand__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        *result = __thtml_num_int__(a.w & b.w);
+        return TCL_OK;
+    }
+    return __thtml_num_boxed__(interp, __thtml_bitand__, a, b, result);
+}
+
+static inline int __thtml_num_bitor__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        *result = __thtml_num_int__(a.w | b.w);
+        return TCL_OK;
+    }
+    return __thtml_num_boxed__(interp, __thtml_bitor__, a, b, result);
+}
+
+static inline int __thtml_num_bitxor__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        *result = __thtml_num_int__(a.w ^ b.w);
+        return TCL_OK;
+    }
+    return __thtml_num_boxed__(interp, __thtml_bitxor__, a, b, result);
+}
+
+static inline int __thtml_num_lshift__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT && b.w >= 0 && b.w < 63 &&
+        !((a.w > 0 ? a.w : ~a.w) & -(((Tcl_WideUInt) 1) << (62 - b.w)))) {
+        *result = __thtml_num_int__((Tcl_WideInt) ((Tcl_WideUInt) a.w << b.w));
+        return TCL_OK;
+    }
+    return __thtml_num_boxed__(interp, __thtml_lshift__, a, b, result);
+}
+
+static inline int __thtml_num_rshift__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT && b.w >= 0) {
+        *result = __thtml_num_int__(b.w < 64 ? a.w >> b.w : (a.w < 0 ? -1 : 0));
+        return TCL_OK;
+    }
+    return __thtml_num_boxed__(interp, __thtml_rshift__, a, b, result);
+}
+
+static inline int __thtml_num_expon__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t b, __thtml_num_t *result) {
+    return __thtml_num_boxed__(interp, __thtml_expon__, a, b, result);
+}
+
+static inline int __thtml_num_uminus__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_DOUBLE) {
+        *result = __thtml_num_double__(-a.d);
+        return TCL_OK;
+    }
+    if (a.w != WIDE_MIN) {
+        *result = __thtml_num_int__(-a.w);
+        return TCL_OK;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("math error: integer overflow or invalid operand", -1));
+    return TCL_ERROR;
+}
+
+static inline int __thtml_num_bitnot__(Tcl_Interp *interp, __thtml_num_t a, __thtml_num_t *result) {
+    if (a.type == TCL_NUMBER_INT) {
+        *result = __thtml_num_int__(~a.w);
+        return TCL_OK;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("can't use floating-point value as operand of \"~\"", -1));
+    return TCL_ERROR;
+}
+
+// -1, 0 or 1, an integer and a double are compared as in __thtml_compare_two_numbers__
+static inline int __thtml_num_compare__(__thtml_num_t a, __thtml_num_t b) {
+    if (a.type == TCL_NUMBER_INT && b.type == TCL_NUMBER_INT) {
+        return a.w < b.w ? -1 : a.w > b.w;
+    }
+    if (a.type == TCL_NUMBER_DOUBLE && b.type == TCL_NUMBER_DOUBLE) {
+        return a.d < b.d ? -1 : a.d > b.d;
+    }
+    Tcl_WideInt w = a.type == TCL_NUMBER_INT ? a.w : b.w;
+    double d = a.type == TCL_NUMBER_INT ? b.d : a.d;
+    double tmp;
+    int compare;
+    if (w == (Tcl_WideInt) (double) w || modf(d, &tmp) != 0.0) {
+        compare = (double) w < d ? -1 : (double) w > d;
+    } else if (d < (double) WIDE_MIN) {
+        compare = 1;
+    } else if (d > (double) WIDE_MAX) {
+        compare = -1;
+    } else {
+        compare = w < (Tcl_WideInt) d ? -1 : w > (Tcl_WideInt) d;
+    }
+    return a.type == TCL_NUMBER_INT ? compare : -compare;
+}
+
+// the in and ni operators
+static inline int __thtml_list_contains__(Tcl_Interp *interp, Tcl_Obj *value_ptr, Tcl_Obj *list_ptr, int *found) {
+    Tcl_Size objc;
+    Tcl_Obj **objv;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, list_ptr, &objc, &objv)) {
+        return TCL_ERROR;
+    }
+    *found = 0;
+    for (Tcl_Size i = 0; i < objc && !*found; i++) {
+        *found = __thtml_string_compare__(value_ptr, objv[i]) == 0;
+    }
+    return TCL_OK;
+}
+
+static inline void __thtml_scope_init__(__thtml_scope_t *scope, __thtml_scope_t *parent, Tcl_Obj *dict) {
+    scope->dict = dict;
+    scope->parent = parent;
+    if (dict != NULL) {
+        Tcl_IncrRefCount(dict);
+    }
+}
+
+static inline void __thtml_scope_free__(__thtml_scope_t *scope) {
+    if (scope->dict != NULL) {
+        Tcl_DecrRefCount(scope->dict);
+        scope->dict = NULL;
+    }
+}
+
+// sets "value_ptr" to NULL if the key is not found in any layer
+static inline int __thtml_scope_get__(Tcl_Interp *interp, __thtml_scope_t *scope, Tcl_Obj *key_ptr, Tcl_Obj **value_ptr) {
+    for (; scope != NULL; scope = scope->parent) {
+        if (scope->dict == NULL) {
+            continue;
+        }
+        if (TCL_OK != Tcl_DictObjGet(interp, scope->dict, key_ptr, value_ptr)) {
+            return TCL_ERROR;
+        }
+        if (*value_ptr != NULL) {
+            return TCL_OK;
+        }
+    }
+    *value_ptr = NULL;
+    return TCL_OK;
+}
+
+// makes the dict of the layer safe to write to
+static inline Tcl_Obj *__thtml_scope_unshare__(__thtml_scope_t *scope) {
+    if (scope->dict == NULL) {
+        scope->dict = Tcl_NewDictObj();
+        Tcl_IncrRefCount(scope->dict);
+    } else if (Tcl_IsShared(scope->dict)) {
+        Tcl_Obj *dict_ptr = Tcl_DuplicateObj(scope->dict);
+        Tcl_IncrRefCount(dict_ptr);
+        Tcl_DecrRefCount(scope->dict);
+        scope->dict = dict_ptr;
+    }
+    return scope->dict;
+}
+
+#ifdef THTML_RUNTIME
+
+int __thtml_scope_set__(Tcl_Interp *interp, __thtml_scope_t *scope, Tcl_Size keyc, Tcl_Obj *const keyv[], Tcl_Obj *value_ptr) {
+    Tcl_Obj *dict_ptr = __thtml_scope_unshare__(scope);
+    if (keyc > 1) {
+        // a nested write into a dict of an outer layer starts from a copy of it in this layer
+        Tcl_Obj *current_ptr;
+        if (TCL_OK != Tcl_DictObjGet(interp, dict_ptr, keyv[0], &current_ptr)) {
+            return TCL_ERROR;
+        }
+        if (current_ptr == NULL) {
+            if (TCL_OK != __thtml_scope_get__(interp, scope->parent, keyv[0], &current_ptr)) {
+                return TCL_ERROR;
+            }
+            if (current_ptr != NULL && TCL_OK != Tcl_DictObjPut(interp, dict_ptr, keyv[0], current_ptr)) {
+                return TCL_ERROR;
+            }
+        }
+    }
+    return Tcl_DictObjPutKeyList(interp, dict_ptr, keyc, keyv, value_ptr);
+}
+
+// puts all the keys of "source_ptr" in the layer
+int __thtml_scope_merge__(Tcl_Interp *interp, __thtml_scope_t *scope, Tcl_Obj *source_ptr) {
+    Tcl_Obj *key_ptr = NULL, *value_ptr = NULL;
+    int done;
     Tcl_DictSearch search;
-    if (Tcl_DictObjFirst(interp, source_obj, &search, &key_obj, &value_obj,
-                         &done) != TCL_OK) {
+    if (TCL_OK != Tcl_DictObjFirst(interp, source_ptr, &search, &key_ptr, &value_ptr, &done)) {
         return TCL_ERROR;
     }
+    Tcl_Obj *dict_ptr = __thtml_scope_unshare__(scope);
     while (!done) {
-        Tcl_DictObjPut(interp, target_obj, key_obj, value_obj);
-        Tcl_DictObjNext(&search, &key_obj, &value_obj, &done);
+        Tcl_DictObjPut(interp, dict_ptr, key_ptr, value_ptr);
+        Tcl_DictObjNext(&search, &key_ptr, &value_ptr, &done);
     }
     Tcl_DictObjDone(&search);
     return TCL_OK;
 }
 
-#endif // THTML_H
\ No newline at end of file
+// returns a single dict with the keys of all layers, for the tcl code of an include,
+// the caller owns a reference to it
+Tcl_Obj *__thtml_scope_flatten__(Tcl_Interp *interp, __thtml_scope_t *scope) {
+    __thtml_scope_t flat;
+    if (scope->parent == NULL) {
+        __thtml_scope_init__(&flat, NULL, scope->dict != NULL ? scope->dict : Tcl_NewDictObj());
+        return flat.dict;
+    }
+    Tcl_Obj *parent_dict_ptr = __thtml_scope_flatten__(interp, scope->parent);
+    if (parent_dict_ptr == NULL) {
+        return NULL;
+    }
+    // the flat layer takes over the reference to the dict of the parent
+    flat.dict = parent_dict_ptr;
+    flat.parent = NULL;
+    if (scope->dict != NULL && TCL_OK != __thtml_scope_merge__(interp, &flat, scope->dict)) {
+        __thtml_scope_free__(&flat);
+        return NULL;
+    }
+    return flat.dict;
+}
+
+#endif // THTML_RUNTIME
+
+static inline void __thtml_append_obj__(Tcl_DString *dsPtr, Tcl_Obj *objPtr) {
+    Tcl_Size length;
+    const char *bytes = Tcl_GetStringFromObj(objPtr, &length);
+    Tcl_DStringAppend(dsPtr, bytes, length);
+}
+
+static inline void __thtml_append_escaped_obj__(Tcl_DString *dsPtr, Tcl_Obj *objPtr, int escape) {
+    Tcl_Size length;
+    const char *bytes = Tcl_GetStringFromObj(objPtr, &length);
+    __thtml_append_escaped__(dsPtr, bytes, length, escape);
+}
+
+#ifdef THTML_RUNTIME
+
+static void __thtml_free_literals__(ClientData clientData, Tcl_Interp *interp) {
+    (void) interp;
+    Tcl_Obj **literals = (Tcl_Obj **) clientData;
+    for (Tcl_Obj **p = literals; *p != NULL; p++) {
+        Tcl_DecrRefCount(*p);
+    }
+    Tcl_Free((char *) literals);
+}
+
+// creates the literal pool of a compiled library, one per interp, it is released when the interp is deleted
+Tcl_Obj **__thtml_new_literals__(Tcl_Interp *interp, const char *name, const char *const strings[],
+                                 const Tcl_Size lengths[], Tcl_Size size) {
+    Tcl_Obj **literals = (Tcl_Obj **) Tcl_Alloc(sizeof(Tcl_Obj *) * (size + 1));
+    for (Tcl_Size i = 0; i < size; i++) {
+        literals[i] = Tcl_NewStringObj(strings[i], lengths[i]);
+        Tcl_IncrRefCount(literals[i]);
+    }
+    literals[size] = NULL;
+
+    if (Tcl_GetAssocData(interp, name, NULL) != NULL) {
+        // the library was loaded again, its commands are about to be replaced as well
+        Tcl_DeleteAssocData(interp, name);
+    }
+    Tcl_SetAssocData(interp, name, __thtml_free_literals__, literals);
+    return literals;
+}
+
+static void __thtml_free_templates__(ClientData clientData, Tcl_Interp *interp) {
+    (void) interp;
+    Tcl_Free((char *) clientData);
+}
+
+// creates the per-template state of a compiled library, one per interp, it is released when the interp is deleted
+// the literals of every template are set by the init function of its translation unit
+__thtml_template_t *__thtml_new_templates__(Tcl_Interp *interp, const char *name, Tcl_Size size) {
+    __thtml_template_t *templates = (__thtml_template_t *) Tcl_Alloc(sizeof(__thtml_template_t) * (size + 1));
+    for (Tcl_Size i = 0; i < size; i++) {
+        templates[i].literals = NULL;
+        templates[i].size_estimate = 0;
+    }
+
+    if (Tcl_GetAssocData(interp, name, NULL) != NULL) {
+        Tcl_DeleteAssocData(interp, name);
+    }
+    Tcl_SetAssocData(interp, name, __thtml_free_templates__, templates);
+    return templates;
+}
+
+#endif // THTML_RUNTIME
+
+static inline void __thtml_presize__(Tcl_DString *dsPtr, __thtml_template_t *template) {
+    if (template->size_estimate > TCL_DSTRING_STATIC_SIZE) {
+        Tcl_DStringSetLength(dsPtr, template->size_estimate);
+        Tcl_DStringSetLength(dsPtr, 0);
+    }
+}
+
+static inline void __thtml_update_size_estimate__(__thtml_template_t *template, Tcl_Size size) {
+    if (size > THTML_BUFFER_SIZE_CAP) {
+        size = THTML_BUFFER_SIZE_CAP;
+    }
+    if (size >= template->size_estimate) {
+        template->size_estimate = size;
+    } else {
+        template->size_estimate -= (template->size_estimate - size) / 8;
+    }
+}
+
+// writes the output collected so far to the sink of a streaming render, once enough of it is there
+static inline int __thtml_output_check__(Tcl_Interp *interp, Tcl_DString *dsPtr) {
+    if (((__thtml_output_t *) dsPtr)->sink == NULL || Tcl_DStringLength(dsPtr) < THTML_STREAM_CHUNK_SIZE) {
+        return TCL_OK;
+    }
+    return __thtml_output_flush__(interp, dsPtr, 0);
+}
+
+// a <tpl cache> block keeps what it renders in the output, so the sink waits until it is done
+static inline Tcl_Obj *__thtml_output_pause__(Tcl_DString *dsPtr) {
+    Tcl_Obj *sink_ptr = ((__thtml_output_t *) dsPtr)->sink;
+    ((__thtml_output_t *) dsPtr)->sink = NULL;
+    return sink_ptr;
+}
+
+static inline void __thtml_output_resume__(Tcl_DString *dsPtr, Tcl_Obj *sink_ptr) {
+    ((__thtml_output_t *) dsPtr)->sink = sink_ptr;
+}
+
+// A call of a template or include compiled with the stats option, see thtml_stats.h. Only
+// calls that return TCL_OK are recorded, the time and output include those of the includes it
+// calls.
+typedef struct {
+    __thtml_stats_t *stats;
+    Tcl_WideInt start;
+    Tcl_WideInt position;
+} __thtml_stats_frame_t;
+
+static inline void __thtml_stats_enter__(Tcl_Interp *interp, __thtml_stats_frame_t *frame, Tcl_DString *dsPtr) {
+    frame->stats = (__thtml_stats_t *) Tcl_GetAssocData(interp, THTML_STATS_ASSOC_KEY, NULL);
+    if (frame->stats == NULL) {
+        return;
+    }
+    frame->start = frame->stats->now();
+    frame->position = frame->stats->flushed + Tcl_DStringLength(dsPtr);
+}
+
+static inline void __thtml_stats_leave__(__thtml_stats_frame_t *frame, const char *name, Tcl_DString *dsPtr) {
+    __thtml_stats_t *stats = frame->stats;
+    if (stats == NULL) {
+        return;
+    }
+    stats->record(stats, name, stats->now() - frame->start,
+                  stats->flushed + Tcl_DStringLength(dsPtr) - frame->position);
+}
+
+#ifdef THTML_RUNTIME
+
+// the sink is a channel if there is one by that name, an empty sink is the same as none
+int __thtml_output_init__(Tcl_Interp *interp, __thtml_output_t *output, Tcl_Obj *sink_ptr) {
+    Tcl_DStringInit(&output->ds);
+    output->sink = NULL;
+    output->channel = NULL;
+
+    Tcl_Size length;
+    const char *name = sink_ptr == NULL ? NULL : Tcl_GetStringFromObj(sink_ptr, &length);
+    if (name == NULL || length == 0) {
+        return TCL_OK;
+    }
+
+    int mode;
+    output->channel = Tcl_GetChannel(interp, name, &mode);
+    if (output->channel == NULL) {
+        Tcl_ResetResult(interp);
+    } else if (!(mode & TCL_WRITABLE)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("channel \"%s\" wasn't opened for writing", name));
+        return TCL_ERROR;
+    }
+    output->sink = sink_ptr;
+    return TCL_OK;
+}
+
+// writes the output collected so far to the sink and empties it, the channel is flushed as well
+// if asked to, so that what was written so far reaches the other end
+int __thtml_output_flush__(Tcl_Interp *interp, Tcl_DString *dsPtr, int flush_channel) {
+    __thtml_output_t *output = (__thtml_output_t *) dsPtr;
+    if (output->sink == NULL) {
+        return TCL_OK;
+    }
+
+    if (output->channel != NULL) {
+        if (Tcl_DStringLength(dsPtr) > 0
+            && Tcl_WriteChars(output->channel, Tcl_DStringValue(dsPtr), Tcl_DStringLength(dsPtr)) < 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\": %s",
+                                                   Tcl_GetChannelName(output->channel), Tcl_PosixError(interp)));
+            return TCL_ERROR;
+        }
+        if (flush_channel && Tcl_Flush(output->channel) != TCL_OK) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("error flushing \"%s\": %s",
+                                                   Tcl_GetChannelName(output->channel), Tcl_PosixError(interp)));
+            return TCL_ERROR;
+        }
+    } else if (Tcl_DStringLength(dsPtr) > 0) {
+        Tcl_Size prefixc;
+        Tcl_Obj **prefixv;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, output->sink, &prefixc, &prefixv)) {
+            return TCL_ERROR;
+        }
+
+        // the prefix is copied, the command may change the list it came from
+        Tcl_Obj **objv = (Tcl_Obj **) Tcl_Alloc(sizeof(Tcl_Obj *) * (prefixc + 1));
+        for (Tcl_Size i = 0; i < prefixc; i++) {
+            objv[i] = prefixv[i];
+            Tcl_IncrRefCount(objv[i]);
+        }
+        objv[prefixc] = Tcl_NewStringObj(Tcl_DStringValue(dsPtr), Tcl_DStringLength(dsPtr));
+        Tcl_IncrRefCount(objv[prefixc]);
+
+        int code = Tcl_EvalObjv(interp, prefixc + 1, objv, TCL_EVAL_GLOBAL);
+
+        for (Tcl_Size i = 0; i <= prefixc; i++) {
+            Tcl_DecrRefCount(objv[i]);
+        }
+        Tcl_Free((char *) objv);
+        if (code != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Tcl_ResetResult(interp);
+    }
+
+#ifdef THTML_STATS
+    __thtml_stats_t *stats = (__thtml_stats_t *) Tcl_GetAssocData(interp, THTML_STATS_ASSOC_KEY, NULL);
+    if (stats != NULL) {
+        stats->flushed += Tcl_DStringLength(dsPtr);
+    }
+#endif
+
+    Tcl_DStringSetLength(dsPtr, 0);
+    return TCL_OK;
+}
+
+int __thtml_size_estimate_cmd__(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    if (objc != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, "");
+        return TCL_ERROR;
+    }
+    __thtml_template_t *template = (__thtml_template_t *) clientData;
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(template->size_estimate));
+    return TCL_OK;
+}
+
+// without the thtml library in the interp, a <tpl cache> block is rendered every time
+int __thtml_fragment_get__(Tcl_Interp *interp, const char *key, Tcl_DString *dsPtr) {
+    const __thtml_fragment_cache_t *cache = (const __thtml_fragment_cache_t *) Tcl_GetAssocData(interp, THTML_FRAGMENT_ASSOC_KEY, NULL);
+    return cache != NULL && cache->get(key, dsPtr);
+}
+
+void __thtml_fragment_put__(Tcl_Interp *interp, const char *key, const char *bytes, Tcl_Size length, Tcl_WideInt ttl) {
+    const __thtml_fragment_cache_t *cache = (const __thtml_fragment_cache_t *) Tcl_GetAssocData(interp, THTML_FRAGMENT_ASSOC_KEY, NULL);
+    if (cache != NULL) {
+        cache->put(key, bytes, length, ttl);
+    }
+}
+
+int __thtml_eval_objv__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    int code = Tcl_EvalObjv(interp, objc, objv, 0);
+    if (code != TCL_RETURN) {
+        return code;
+    }
+
+    // a "return" in a template script behaves as it does in the body of a proc,
+    // i.e. it takes off one level and yields the code given with -code (ok by default)
+    Tcl_Obj *options_obj = Tcl_GetReturnOptions(interp, code);
+    Tcl_IncrRefCount(options_obj);
+    Tcl_Obj *level_key_obj = Tcl_NewStringObj("-level", 6);
+    Tcl_IncrRefCount(level_key_obj);
+    Tcl_Obj *level_obj = NULL;
+    int level = 1;
+    if (TCL_OK != Tcl_DictObjGet(interp, options_obj, level_key_obj, &level_obj)
+        || (level_obj != NULL && TCL_OK != Tcl_GetIntFromObj(interp, level_obj, &level))) {
+        Tcl_DecrRefCount(level_key_obj);
+        Tcl_DecrRefCount(options_obj);
+        return TCL_ERROR;
+    }
+    if (Tcl_IsShared(options_obj)) {
+        Tcl_Obj *dup_obj = Tcl_DuplicateObj(options_obj);
+        Tcl_IncrRefCount(dup_obj);
+        Tcl_DecrRefCount(options_obj);
+        options_obj = dup_obj;
+    }
+    Tcl_DictObjPut(interp, options_obj, level_key_obj, Tcl_NewIntObj(level - 1));
+    Tcl_DecrRefCount(level_key_obj);
+    code = Tcl_SetReturnOptions(interp, options_obj);
+    Tcl_DecrRefCount(options_obj);
+    return code;
+}
+
+// Natively compiled commands. They take the same argv as __thtml_eval_objv__ and leave
+// their value in the interp result. The argument count is checked at compile time,
+// anything off the fast path (nested indices, bad values, missing keys) is handed
+// to the Tcl command with the same argv so that results and error messages match.
+
+int __thtml_lindex__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    Tcl_Size length;
+    Tcl_Obj **elements;
+    Tcl_Size index;
+    if (TCL_OK != Tcl_ListObjGetElements(NULL, objv[1], &length, &elements)
+        || TCL_OK != Tcl_GetIntForIndex(NULL, objv[2], length - 1, &index)) {
+        return __thtml_eval_objv__(interp, objc, objv);
+    }
+    if (index >= 0 && index < length) {
+        Tcl_SetObjResult(interp, elements[index]);
+    } else {
+        Tcl_ResetResult(interp);
+    }
+    return TCL_OK;
+}
+
+int __thtml_lrange__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    Tcl_Size length;
+    Tcl_Obj **elements;
+    Tcl_Size first, last;
+    if (TCL_OK != Tcl_ListObjGetElements(NULL, objv[1], &length, &elements)
+        || TCL_OK != Tcl_GetIntForIndex(NULL, objv[2], length - 1, &first)
+        || TCL_OK != Tcl_GetIntForIndex(NULL, objv[3], length - 1, &last)) {
+        return __thtml_eval_objv__(interp, objc, objv);
+    }
+    if (first < 0) {
+        first = 0;
+    }
+    if (last >= length) {
+        last = length - 1;
+    }
+    if (first > last) {
+        Tcl_ResetResult(interp);
+    } else if (first == 0 && last == length - 1) {
+        Tcl_SetObjResult(interp, objv[1]);
+    } else {
+        Tcl_SetObjResult(interp, Tcl_NewListObj(last - first + 1, &elements[first]));
+    }
+    return TCL_OK;
+}
+
+int __thtml_llength__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    Tcl_Size length;
+    if (TCL_OK != Tcl_ListObjLength(NULL, objv[1], &length)) {
+        return __thtml_eval_objv__(interp, objc, objv);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(length));
+    return TCL_OK;
+}
+
+int __thtml_string_index__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    Tcl_Size length = Tcl_GetCharLength(objv[2]);
+    Tcl_Size index;
+    if (TCL_OK != Tcl_GetIntForIndex(NULL, objv[3], length - 1, &index)) {
+        return __thtml_eval_objv__(interp, objc, objv);
+    }
+    if (index >= 0 && index < length) {
+        Tcl_SetObjResult(interp, Tcl_GetRange(objv[2], index, index));
+    } else {
+        Tcl_ResetResult(interp);
+    }
+    return TCL_OK;
+}
+
+int __thtml_string_length__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    (void) objc;
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(Tcl_GetCharLength(objv[2])));
+    return TCL_OK;
+}
+
+int __thtml_string_toupper__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    (void) objc;
+    Tcl_Size length;
+    const char *bytes = Tcl_GetStringFromObj(objv[2], &length);
+
+    // most values are already upper case or have no letters at all, those are returned as they are
+    Tcl_Size i = 0;
+    while (i < length && (unsigned char) bytes[i] < 0x80 && !(bytes[i] >= 'a' && bytes[i] <= 'z')) {
+        i++;
+    }
+    if (i == length) {
+        Tcl_SetObjResult(interp, objv[2]);
+        return TCL_OK;
+    }
+
+    Tcl_Obj *result_ptr = Tcl_NewStringObj(bytes, length);
+    length = Tcl_UtfToUpper(Tcl_GetString(result_ptr));
+    Tcl_SetObjLength(result_ptr, length);
+    Tcl_SetObjResult(interp, result_ptr);
+    return TCL_OK;
+}
+
+int __thtml_dict_get__(Tcl_Interp *interp, Tcl_Size objc, Tcl_Obj *const objv[]) {
+    Tcl_Obj *value_ptr = objv[2];
+    for (Tcl_Size i = 3; i < objc; i++) {
+        Tcl_Obj *dict_ptr = value_ptr;
+        if (TCL_OK != Tcl_DictObjGet(NULL, dict_ptr, objv[i], &value_ptr) || value_ptr == NULL) {
+            return __thtml_eval_objv__(interp, objc, objv);
+        }
+    }
+    Tcl_SetObjResult(interp, value_ptr);
+    return TCL_OK;
+}
+
+#endif // THTML_RUNTIME
+
+#endif // THTML_H
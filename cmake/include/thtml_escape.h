@@ -0,0 +1,255 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+// Escaping of substituted values, shared by the compiled templates and the thtml library.
+// Clean runs are found with SSE2/AVX2 when the compiler targets them and copied in bulk,
+// only the bytes that need escaping are handled one at a time.
+
+#ifndef THTML_ESCAPE_H
+#define THTML_ESCAPE_H
+
+#include <tcl.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define THTML_ESCAPE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define THTML_ESCAPE_SSE2
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define THTML_CTZ(x) __builtin_ctz(x)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+static inline int __thtml_ctz__(unsigned int x) {
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int) index;
+}
+#define THTML_CTZ(x) __thtml_ctz__(x)
+#else
+// no count trailing zeros, the runs are scanned a byte at a time
+#undef THTML_ESCAPE_AVX2
+#undef THTML_ESCAPE_SSE2
+#endif
+
+#ifndef TCL_SIZE_MAX
+typedef int Tcl_Size;
+# define TCL_SIZE_MAX      INT_MAX
+#endif
+
+#define THTML_ESCAPE_NONE 0
+#define THTML_ESCAPE_TEXT 1
+#define THTML_ESCAPE_ATTR 2
+#define THTML_ESCAPE_URL 3
+// a url value at the start of the attribute, where it decides the scheme of the url
+#define THTML_ESCAPE_URL_START 4
+
+typedef struct {
+    const char *bytes;
+    int length;
+} __thtml_entity_t;
+
+static inline const __thtml_entity_t *__thtml_html_entity__(unsigned char c) {
+    static const __thtml_entity_t entities[] = {
+            {"&quot;", 6},
+            {"&amp;",  5},
+            {"&#39;",  5},
+            {"&lt;",   4},
+            {"&gt;",   4},
+    };
+    switch (c) {
+        case '"':
+            return &entities[0];
+        case '&':
+            return &entities[1];
+        case '\'':
+            return &entities[2];
+        case '<':
+            return &entities[3];
+        case '>':
+            return &entities[4];
+        default:
+            return NULL;
+    }
+}
+
+static inline int __thtml_needs_html_escape__(unsigned char c, int attr) {
+    return c == '<' || c == '>' || c == '&' || (attr && (c == '"' || c == '\''));
+}
+
+// returns the length of the run at the start of "p" that does not need escaping,
+// in text only "<>&" are escaped, attribute values escape quotes as well
+static inline Tcl_Size __thtml_html_clean_run__(const char *p, const char *end, int attr) {
+    const char *q = p;
+#if defined(THTML_ESCAPE_AVX2)
+    const __m256i lt = _mm256_set1_epi8('<');
+    const __m256i gt = _mm256_set1_epi8('>');
+    const __m256i amp = _mm256_set1_epi8('&');
+    const __m256i dquote = _mm256_set1_epi8('"');
+    const __m256i squote = _mm256_set1_epi8('\'');
+    while (end - q >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) q);
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt), _mm256_cmpeq_epi8(v, gt)),
+                                    _mm256_cmpeq_epi8(v, amp));
+        if (attr) {
+            m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(v, dquote), _mm256_cmpeq_epi8(v, squote)));
+        }
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(m);
+        if (mask) {
+            return (q - p) + THTML_CTZ(mask);
+        }
+        q += 32;
+    }
+#elif defined(THTML_ESCAPE_SSE2)
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i squote = _mm_set1_epi8('\'');
+    while (end - q >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) q);
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                                 _mm_cmpeq_epi8(v, amp));
+        if (attr) {
+            m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, squote)));
+        }
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(m);
+        if (mask) {
+            return (q - p) + THTML_CTZ(mask);
+        }
+        q += 16;
+    }
+#endif
+    while (q < end && !__thtml_needs_html_escape__((unsigned char) *q, attr)) {
+        q++;
+    }
+    return q - p;
+}
+
+static inline void __thtml_append_html_escaped__(Tcl_DString *dsPtr, const char *p, Tcl_Size length, int attr) {
+    const char *end = p + length;
+    while (p < end) {
+        Tcl_Size run = __thtml_html_clean_run__(p, end, attr);
+        if (run > 0) {
+            Tcl_DStringAppend(dsPtr, p, run);
+            p += run;
+        }
+        if (p < end) {
+            const __thtml_entity_t *entity = __thtml_html_entity__((unsigned char) *p);
+            Tcl_DStringAppend(dsPtr, entity->bytes, entity->length);
+            p++;
+        }
+    }
+}
+
+// characters that may appear as they are in a url, anything else is percent-encoded
+static inline int __thtml_is_url_char__(unsigned char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return 1;
+    }
+    return c != '\0' && strchr("-._~:/?#[]@!$&()*+,;=%", c) != NULL;
+}
+
+// returns 1 if the url is relative or its scheme is http, https or mailto, the scheme is what
+// comes before a ":" that is not preceded by any of "/?#"
+static inline int __thtml_is_safe_url__(const char *p, Tcl_Size length) {
+    static const char *const schemes[] = {"http", "https", "mailto"};
+    const char *end = p + length;
+    const char *q = p;
+    while (q < end && *q != ':' && *q != '/' && *q != '?' && *q != '#') {
+        q++;
+    }
+    if (q == end || *q != ':') {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(schemes) / sizeof(schemes[0]); i++) {
+        const char *s = schemes[i];
+        const char *r = p;
+        // schemes are case-insensitive
+        while (r < q && *s != '\0' && (*r == *s || *r == *s - 'a' + 'A')) {
+            r++;
+            s++;
+        }
+        if (r == q && *s == '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// urls end up in attribute values, so "&" is escaped as an entity on top of percent-encoding
+static inline void __thtml_append_url_escaped__(Tcl_DString *dsPtr, const char *p, Tcl_Size length) {
+    static const char hex[] = "0123456789ABCDEF";
+    const char *end = p + length;
+    while (p < end) {
+        const char *q = p;
+        while (q < end && *q != '&' && __thtml_is_url_char__((unsigned char) *q)) {
+            q++;
+        }
+        if (q > p) {
+            Tcl_DStringAppend(dsPtr, p, q - p);
+            p = q;
+        }
+        if (p < end) {
+            unsigned char c = (unsigned char) *p;
+            if (c == '&') {
+                Tcl_DStringAppend(dsPtr, "&amp;", 5);
+            } else {
+                char encoded[3] = {'%', hex[c >> 4], hex[c & 0x0F]};
+                Tcl_DStringAppend(dsPtr, encoded, 3);
+            }
+            p++;
+        }
+    }
+}
+
+// returns 1 if the value would be changed by escaping it for the given context
+static inline int __thtml_needs_escape__(const char *p, Tcl_Size length, int escape) {
+    const char *end = p + length;
+    if (escape == THTML_ESCAPE_URL_START && !__thtml_is_safe_url__(p, length)) {
+        return 1;
+    }
+    if (escape == THTML_ESCAPE_URL || escape == THTML_ESCAPE_URL_START) {
+        while (p < end) {
+            if (*p == '&' || !__thtml_is_url_char__((unsigned char) *p)) {
+                return 1;
+            }
+            p++;
+        }
+        return 0;
+    }
+    return __thtml_html_clean_run__(p, end, escape == THTML_ESCAPE_ATTR) < length;
+}
+
+static inline void __thtml_append_escaped__(Tcl_DString *dsPtr, const char *p, Tcl_Size length, int escape) {
+    switch (escape) {
+        case THTML_ESCAPE_TEXT:
+            __thtml_append_html_escaped__(dsPtr, p, length, 0);
+            break;
+        case THTML_ESCAPE_ATTR:
+            __thtml_append_html_escaped__(dsPtr, p, length, 1);
+            break;
+        case THTML_ESCAPE_URL:
+            __thtml_append_url_escaped__(dsPtr, p, length);
+            break;
+        case THTML_ESCAPE_URL_START:
+            // a url with any other scheme, e.g. javascript:, is replaced with one that goes nowhere
+            if (__thtml_is_safe_url__(p, length)) {
+                __thtml_append_url_escaped__(dsPtr, p, length);
+            } else {
+                Tcl_DStringAppend(dsPtr, "#", 1);
+            }
+            break;
+        default:
+            Tcl_DStringAppend(dsPtr, p, length);
+    }
+}
+
+#endif //THTML_ESCAPE_H
@@ -0,0 +1,32 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+// The get and put functions of the fragment cache, which keeps the output of <tpl cache="key">
+// blocks for all the threads of the process, see fragment.c.
+
+#ifndef THTML_FRAGMENT_H
+#define THTML_FRAGMENT_H
+
+#include <tcl.h>
+
+#ifndef TCL_SIZE_MAX
+typedef int Tcl_Size;
+# define Tcl_GetSizeIntFromObj Tcl_GetIntFromObj
+# define Tcl_NewSizeIntObj Tcl_NewIntObj
+# define TCL_SIZE_MAX      INT_MAX
+# define TCL_SIZE_MODIFIER ""
+#endif
+
+#define THTML_FRAGMENT_ASSOC_KEY "thtml-fragment-cache"
+
+typedef struct {
+    // appends the fragment stored under the key and returns 1, or returns 0 if there is none
+    int (*get)(const char *key, Tcl_DString *dsPtr);
+    // stores a fragment under the key for ttl seconds, without expiry if ttl is 0
+    void (*put)(const char *key, const char *bytes, Tcl_Size length, Tcl_WideInt ttl);
+} __thtml_fragment_cache_t;
+
+#endif //THTML_FRAGMENT_H
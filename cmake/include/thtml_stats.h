@@ -0,0 +1,35 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+// What a template compiled with the stats option records its calls with, the per interp
+// counters behind ::thtml::stats, see stats.c.
+
+#ifndef THTML_STATS_H
+#define THTML_STATS_H
+
+#include <tcl.h>
+
+#ifndef TCL_SIZE_MAX
+typedef int Tcl_Size;
+# define Tcl_GetSizeIntFromObj Tcl_GetIntFromObj
+# define Tcl_NewSizeIntObj Tcl_NewIntObj
+# define TCL_SIZE_MAX      INT_MAX
+# define TCL_SIZE_MODIFIER ""
+#endif
+
+#define THTML_STATS_ASSOC_KEY "thtml-stats"
+
+typedef struct __thtml_stats_s {
+    // bytes written to sinks in the interp so far, a call takes the difference between its start
+    // and its end
+    Tcl_WideInt flushed;
+    // microseconds of a monotonic clock
+    Tcl_WideInt (*now)(void);
+    // adds a call to the counters of the template or include with the given name
+    void (*record)(struct __thtml_stats_s *stats, const char *name, Tcl_WideInt us, Tcl_WideInt bytes);
+} __thtml_stats_t;
+
+#endif //THTML_STATS_H
@@ -1,4 +1,7 @@
 #include "common.h"
+#include "md5.h"
+
+#include <string.h>
 
 void thtml_AppendEscaped(const char *p, const char *end, Tcl_DString *dsPtr) {
     while (p < end) {
@@ -17,6 +20,24 @@ void thtml_AppendEscaped(const char *p, const char *end, Tcl_DString *dsPtr) {
     }
 }
 
+// matches "<tpl flush/>", with any whitespace before the "/>", and moves past it
+static int thtml_IsFlushTag(const char *p, const char *end, const char **next_ptr) {
+    static const char tag[] = "<tpl flush";
+    Tcl_Size tag_length = sizeof(tag) - 1;
+    if (end - p < tag_length + 2 || memcmp(p, tag, tag_length) != 0) {
+        return 0;
+    }
+    const char *q = p + tag_length;
+    while (q < end && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) {
+        q++;
+    }
+    if (end - q < 2 || q[0] != '/' || q[1] != '>') {
+        return 0;
+    }
+    *next_ptr = q + 2;
+    return 1;
+}
+
 // escape "<", ">", "&" characters when inside html tag attributes (quotes) or commands (square brackets)
 void thtml_EscapeTemplate(const char *p, const char *end, Tcl_DString *dsPtr) {
     int inside_otag = 0;
@@ -49,6 +70,11 @@ void thtml_EscapeTemplate(const char *p, const char *end, Tcl_DString *dsPtr) {
                 inside_otag = 0;
             }
             Tcl_DStringAppend(dsPtr, p, 1);
+        } else if (*p == '<' && thtml_IsFlushTag(p, end, &p)) {
+            // an attribute without a value is dropped by the parser
+            Tcl_DStringAppend(dsPtr, "<tpl flush=\"1\"/>", -1);
+            escaped = 0;
+            continue;
         } else if (*p == '<') {
             inside_otag = 1;
             Tcl_DStringAppend(dsPtr, p, 1);
@@ -69,4 +95,46 @@ void thtml_EscapeTemplate(const char *p, const char *end, Tcl_DString *dsPtr) {
         escaped = 0;
         p++;
     }
-}
\ No newline at end of file
+}
+
+// maps the output context of template text ("text", "attr" or "url") to one of THTML_ESCAPE_*
+int thtml_GetEscapeFromObj(Tcl_Interp *interp, Tcl_Obj *context_ptr, int *escape_ptr) {
+    static const char *const contexts[] = {"text", "attr", "url", NULL};
+    static const int escapes[] = {THTML_ESCAPE_TEXT, THTML_ESCAPE_ATTR, THTML_ESCAPE_URL};
+    int index;
+    if (TCL_OK != Tcl_GetIndexFromObj(interp, context_ptr, contexts, "context", 0, &index)) {
+        return TCL_ERROR;
+    }
+    *escape_ptr = escapes[index];
+    return TCL_OK;
+}
+
+// writes the md5 of the text as 32 hex digits and a terminating null to "hex"
+void thtml_Md5Hex(char *text, char *hex) {
+    unsigned char result[16];
+    md5String(text, result);
+    for (int i = 0; i < 16; i++) {
+        sprintf(hex + (i * 2), "%02x", result[i]);
+    }
+}
+
+// The identifiers in the generated code are numbered with counters kept in codearr, next to the
+// ones of the tcl side of the compiler, so every compilation numbers its own identifiers and
+// interps in different threads compile concurrently without sharing any state.
+
+// increments the counter "key" of the compilation and returns its new value
+int thtml_NextCount(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, const char *key) {
+    Tcl_Obj *key_ptr = Tcl_NewStringObj(key, -1);
+    Tcl_IncrRefCount(key_ptr);
+
+    int count = 0;
+    Tcl_Obj *count_ptr = Tcl_ObjGetVar2(interp, codearrVar_ptr, key_ptr, 0);
+    if (count_ptr != NULL && TCL_OK != Tcl_GetIntFromObj(NULL, count_ptr, &count)) {
+        count = 0;
+    }
+    count++;
+    Tcl_ObjSetVar2(interp, codearrVar_ptr, key_ptr, Tcl_NewIntObj(count), 0);
+
+    Tcl_DecrRefCount(key_ptr);
+    return count;
+}
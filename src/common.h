@@ -50,8 +50,13 @@ typedef int Tcl_Size;
 
 #define CHARTYPE(what, c) (is ## what ((int)((unsigned char)(c))))
 
+#include "thtml_escape.h"
+
 void thtml_AppendEscaped(const char *p, const char *end, Tcl_DString *dsPtr);
 void thtml_EscapeTemplate(const char *p, const char *end, Tcl_DString *dsPtr);
+int thtml_GetEscapeFromObj(Tcl_Interp *interp, Tcl_Obj *context_ptr, int *escape_ptr);
+void thtml_Md5Hex(char *text, char *hex);
+int thtml_NextCount(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, const char *key);
 
 
 #endif //THTML_COMMON_H
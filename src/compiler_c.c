@@ -9,16 +9,9 @@
 #include "md5.h"
 #include <ctype.h>
 #include <string.h>
+#include <stdio.h>
 #include <assert.h>
-
-static int count_text_subst = 0;
-static int count_var_dict_subst = 0;
-
-static int template_cmd_count = 0;
-static int foreach_cmd_count = 0;
-static int subcmd_count = 0;
-static int op_count = 0;
-static int check_count = 0;
+#include <math.h>
 
 int thtml_CCompileQuotedString(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
                                const char *name);
@@ -68,6 +61,10 @@ void thtml_CGarbageCollection(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_D
             Tcl_DStringAppend(ds_ptr, "\nTcl_DStringFree(", -1);
             Tcl_DStringAppend(ds_ptr, Tcl_GetString(varname_ptr), -1);
             Tcl_DStringAppend(ds_ptr, ");", -1);
+        } else if (strcmp(type, "scope") == 0) {
+            Tcl_DStringAppend(ds_ptr, "\n__thtml_scope_free__(", -1);
+            Tcl_DStringAppend(ds_ptr, Tcl_GetString(varname_ptr), -1);
+            Tcl_DStringAppend(ds_ptr, ");", -1);
         } else {
             fprintf(stderr, "Unknown type: %s\n", type);
         }
@@ -86,9 +83,9 @@ void thtml_CListAppendGC(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, const char
         return;
     }
 
-    // get last element of gc_lists
+    // get the top (first) element of gc_lists, same as top_gc_list does
     Tcl_Obj *gc_list_ptr = NULL;
-    if (TCL_OK != Tcl_ListObjIndex(interp, gc_lists_ptr, gc_lists_length - 1, &gc_list_ptr)) {
+    if (TCL_OK != Tcl_ListObjIndex(interp, gc_lists_ptr, 0, &gc_list_ptr) || gc_list_ptr == NULL) {
         return;
     }
 
@@ -136,8 +133,8 @@ void thtml_CListAppendGC(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, const char
 //        return;
 //    }
 
-    // replace the last element of gc_lists_ptr
-    if (TCL_OK != Tcl_ListObjReplace(interp, gc_lists_ptr, gc_lists_length - 1, gc_lists_length - 1, 1, &new_gc_list_ptr)) {
+    // replace the top element of gc_lists_ptr
+    if (TCL_OK != Tcl_ListObjReplace(interp, gc_lists_ptr, 0, 1, 1, &new_gc_list_ptr)) {
         Tcl_DecrRefCount(new_gc_list_ptr);
         return;
     }
@@ -163,7 +160,7 @@ void thtml_CListRemoveGC(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, const char
 
     // get first element of gc_lists
     Tcl_Obj *gc_list_ptr = NULL;
-    if (TCL_OK != Tcl_ListObjIndex(interp, gc_lists_ptr, 0, &gc_list_ptr)) {
+    if (TCL_OK != Tcl_ListObjIndex(interp, gc_lists_ptr, 0, &gc_list_ptr) || gc_list_ptr == NULL) {
         return;
     }
 
@@ -198,8 +195,8 @@ void thtml_CListRemoveGC(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, const char
         }
     }
 
-    // replace the last element of gc_lists_ptr
-    if (TCL_OK != Tcl_ListObjReplace(interp, gc_lists_ptr, gc_lists_length - 1, gc_lists_length - 1, 1, &new_gc_list_ptr)) {
+    // replace the top element of gc_lists_ptr
+    if (TCL_OK != Tcl_ListObjReplace(interp, gc_lists_ptr, 0, 1, 1, &new_gc_list_ptr)) {
         return;
     }
 
@@ -209,6 +206,100 @@ void thtml_CListRemoveGC(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, const char
     }
 }
 
+int thtml_CAppendLiteral(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, const char *literal,
+                         Tcl_Size literal_length) {
+    // literals are collected in codearr(literals) and looked up by codearr(literal,<text>),
+    // the generated library creates them once per interp and the code refers to them by index
+    Tcl_DString key_ds;
+    Tcl_DStringInit(&key_ds);
+    Tcl_DStringAppend(&key_ds, "literal,", -1);
+    Tcl_DStringAppend(&key_ds, literal, literal_length);
+
+    Tcl_Obj *index_ptr = Tcl_GetVar2Ex(interp, Tcl_GetString(codearrVar_ptr), Tcl_DStringValue(&key_ds), 0);
+    if (index_ptr == NULL) {
+        Tcl_Obj *literals_ptr = Tcl_SetVar2Ex(interp, Tcl_GetString(codearrVar_ptr), "literals",
+                                              Tcl_NewStringObj(literal, literal_length),
+                                              TCL_APPEND_VALUE | TCL_LIST_ELEMENT | TCL_LEAVE_ERR_MSG);
+        Tcl_Size num_literals;
+        if (literals_ptr == NULL || TCL_OK != Tcl_ListObjLength(interp, literals_ptr, &num_literals)) {
+            Tcl_DStringFree(&key_ds);
+            return TCL_ERROR;
+        }
+
+        index_ptr = Tcl_SetVar2Ex(interp, Tcl_GetString(codearrVar_ptr), Tcl_DStringValue(&key_ds),
+                                  Tcl_NewSizeIntObj(num_literals - 1), TCL_LEAVE_ERR_MSG);
+        if (index_ptr == NULL) {
+            Tcl_DStringFree(&key_ds);
+            return TCL_ERROR;
+        }
+    }
+    Tcl_DStringFree(&key_ds);
+
+    // __literals__[1]
+    Tcl_DStringAppend(ds_ptr, "__literals__[", -1);
+    Tcl_DStringAppend(ds_ptr, Tcl_GetString(index_ptr), -1);
+    Tcl_DStringAppend(ds_ptr, "]", -1);
+    return TCL_OK;
+}
+
+// static text runs at least this long are emitted as block-scoped static arrays
+#define THTML_STATIC_TEXT_ARRAY_MIN_LENGTH 256
+
+// returns the number of bytes the C compiler makes out of the string literal body
+// between "p" and "end", or -1 if it contains escapes whose length we do not track
+static Tcl_Size thtml_CLiteralLength(const char *p, const char *end) {
+    Tcl_Size length = 0;
+    while (p < end) {
+        if (*p == '\\') {
+            if (p + 1 == end || strchr("\"\\'?[]abfnrtv", *(p + 1)) == NULL) {
+                return -1;
+            }
+            p++;
+        }
+        length++;
+        p++;
+    }
+    return length;
+}
+
+static void thtml_CAppendLength(Tcl_DString *ds_ptr, Tcl_Size length) {
+    char length_str[32];
+    snprintf(length_str, sizeof(length_str), "%" TCL_SIZE_MODIFIER "d", length);
+    Tcl_DStringAppend(ds_ptr, length_str, -1);
+}
+
+static void thtml_CAppendStaticText(const char *p, const char *end, Tcl_DString *ds_ptr) {
+    if (p == end) {
+        return;
+    }
+
+    Tcl_Size length = thtml_CLiteralLength(p, end);
+    if (length >= 0 && length < THTML_STATIC_TEXT_ARRAY_MIN_LENGTH) {
+        // Tcl_DStringAppend(__ds_default__, "<div>", 5);
+        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_default__, \"", -1);
+        thtml_AppendEscaped(p, end, ds_ptr);
+        Tcl_DStringAppend(ds_ptr, "\", ", -1);
+        thtml_CAppendLength(ds_ptr, length);
+        Tcl_DStringAppend(ds_ptr, ");\n", -1);
+        return;
+    }
+
+    // { static const char __text__[] = "<div>\n" "...";
+    //   Tcl_DStringAppend(__ds_default__, __text__, sizeof(__text__) - 1); }
+    // one string literal piece per line keeps each piece within compiler limits
+    Tcl_DStringAppend(ds_ptr, "\n{\nstatic const char __text__[] =", -1);
+    const char *q = p;
+    while (q < end) {
+        const char *eol = memchr(q, '\n', end - q);
+        const char *piece_end = eol == NULL ? end : eol + 1;
+        Tcl_DStringAppend(ds_ptr, "\n\"", -1);
+        thtml_AppendEscaped(q, piece_end, ds_ptr);
+        Tcl_DStringAppend(ds_ptr, "\"", -1);
+        q = piece_end;
+    }
+    Tcl_DStringAppend(ds_ptr, ";\nTcl_DStringAppend(__ds_default__, __text__, sizeof(__text__) - 1);\n}\n", -1);
+}
+
 int thtml_CTransformCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     UNUSED(clientData);
 
@@ -229,11 +320,16 @@ int thtml_CTransformCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
 
+    // runs of text are joined across blank code, so that they are appended at once
+    Tcl_DString text_ds;
+    Tcl_DStringInit(&text_ds);
+
     while (p < end) {
         // make sure "p" points to the start of the first text block, i.e. it is '\x02'
         if (*p != '\x02') {
             fprintf(stderr, "Text block does not start with start-of-text marker ch=%02x\n", *p);
             Tcl_DStringFree(&ds);
+            Tcl_DStringFree(&text_ds);
             SetResult("Text block does not start with start-of-text marker");
             return TCL_ERROR;
         }
@@ -245,9 +341,7 @@ int thtml_CTransformCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
         const char *q = p;
         while (q < end) {
             if (*q == '\x03') {
-                Tcl_DStringAppend(&ds, "\nTcl_DStringAppend(__ds_default__, \"", -1);
-                thtml_AppendEscaped(p, q, &ds);
-                Tcl_DStringAppend(&ds, "\", -1);\n", -1);
+                Tcl_DStringAppend(&text_ds, p, q - p);
                 break;
             }
             q++;
@@ -255,6 +349,7 @@ int thtml_CTransformCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
 
         if (q == end) {
             Tcl_DStringFree(&ds);
+            Tcl_DStringFree(&text_ds);
             SetResult("Text block does not end with end-of-text marker");
             return TCL_ERROR;
         }
@@ -264,20 +359,28 @@ int thtml_CTransformCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl
 
         // loop until we reach the end of the code block denoted by '\x02', excluding the last '\x02'
         q = p;
-        while (q < end) {
-            if (*q == '\x02') {
-                Tcl_DStringAppend(&ds, p, q - p);
-                break;
+        int blank = 1;
+        while (q < end && *q != '\x02') {
+            if (!CHARTYPE(space, *q)) {
+                blank = 0;
             }
             q++;
         }
 
+        if (!blank) {
+            thtml_CAppendStaticText(Tcl_DStringValue(&text_ds), Tcl_DStringValue(&text_ds) + Tcl_DStringLength(&text_ds), &ds);
+            Tcl_DStringSetLength(&text_ds, 0);
+            Tcl_DStringAppend(&ds, p, q - p);
+        }
+
         // skip the last '\x02'
         p = q;
     }
+    thtml_CAppendStaticText(Tcl_DStringValue(&text_ds), Tcl_DStringValue(&text_ds) + Tcl_DStringLength(&text_ds), &ds);
 
     Tcl_DStringResult(interp, &ds);
     Tcl_DStringFree(&ds);
+    Tcl_DStringFree(&text_ds);
     return TCL_OK;
 }
 
@@ -314,6 +417,36 @@ int thtml_CCompileExprCmd(ClientData clientData, Tcl_Interp *interp, int objc, T
     return TCL_OK;
 }
 
+int thtml_CCompileConditionCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "CCompileConditionCmd\n"));
+
+    CheckArgs(4, 4, 1, "codearrVar text name");
+
+    Tcl_Size text_length;
+    char *text = Tcl_GetStringFromObj(objv[2], &text_length);
+
+    Tcl_Parse parse;
+    if (TCL_OK != Tcl_ParseExpr(interp, text, text_length, &parse)) {
+        Tcl_FreeParse(&parse);
+        return TCL_ERROR;
+    }
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+
+    if (TCL_OK != thtml_CCompileCondition(interp, objv[1], &ds, &parse, Tcl_GetString(objv[3]))) {
+        Tcl_FreeParse(&parse);
+        Tcl_DStringFree(&ds);
+        return TCL_ERROR;
+    }
+
+    Tcl_DStringResult(interp, &ds);
+    Tcl_DStringFree(&ds);
+    Tcl_FreeParse(&parse);
+    return TCL_OK;
+}
+
 int thtml_CCompileQuotedStringCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
     UNUSED(clientData);
     DBG(fprintf(stderr, "CCompileQuotedStringCmd\n"));
@@ -348,7 +481,12 @@ int thtml_CCompileTemplateTextCmd(ClientData clientData, Tcl_Interp *interp, int
     UNUSED(clientData);
     DBG(fprintf(stderr, "CCompileTemplateTextCmd\n"));
 
-    CheckArgs(3, 3, 1, "codearrVar text");
+    CheckArgs(3, 4, 1, "codearrVar text ?context?");
+
+    int escape = THTML_ESCAPE_NONE;
+    if (objc == 4 && TCL_OK != thtml_GetEscapeFromObj(interp, objv[3], &escape)) {
+        return TCL_ERROR;
+    }
 
     Tcl_Size text_length;
     char *text = Tcl_GetStringFromObj(objv[2], &text_length);
@@ -398,7 +536,7 @@ int thtml_CCompileTemplateTextCmd(ClientData clientData, Tcl_Interp *interp, int
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
 
-    if (TCL_OK != thtml_CCompileTemplateText(interp, objv[1], &ds, &parse)) {
+    if (TCL_OK != thtml_CCompileTemplateText(interp, objv[1], &ds, &parse, escape)) {
         Tcl_FreeParse(&parse);
         Tcl_DStringFree(&ds);
         return TCL_ERROR;
@@ -419,8 +557,7 @@ int thtml_CCompileScriptCmd(ClientData clientData, Tcl_Interp *interp, int objc,
     Tcl_Size text_length;
     const char *text = Tcl_GetStringFromObj(objv[2], &text_length);
 
-    Tcl_Size name_length;
-    const char *name = Tcl_GetStringFromObj(objv[3], &name_length);
+    const char *name = Tcl_GetString(objv[3]);
 
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
@@ -431,20 +568,6 @@ int thtml_CCompileScriptCmd(ClientData clientData, Tcl_Interp *interp, int objc,
         return TCL_ERROR;
     }
 
-    Tcl_DStringAppend(&ds, "\nTcl_DString __ds_", -1);
-    Tcl_DStringAppend(&ds, name, name_length);
-    Tcl_DStringAppend(&ds, "_base__;", -1);
-    Tcl_DStringAppend(&ds, "\nTcl_DString *__ds_", -1);
-    Tcl_DStringAppend(&ds, name, name_length);
-    Tcl_DStringAppend(&ds, "__ = &__ds_", -1);
-    Tcl_DStringAppend(&ds, name, name_length);
-    Tcl_DStringAppend(&ds, "_base__;", -1);
-    Tcl_DStringAppend(&ds, "\nTcl_DStringInit(__ds_", -1);
-    Tcl_DStringAppend(&ds, name, name_length);
-    Tcl_DStringAppend(&ds, "__);", -1);
-
-    thtml_CListAppendGC(interp, objv[1], name, "dstring", "__ds_");
-
     Tcl_DString script_ds;
     Tcl_DStringInit(&script_ds);
 
@@ -456,155 +579,117 @@ int thtml_CCompileScriptCmd(ClientData clientData, Tcl_Interp *interp, int objc,
         return TCL_ERROR;
     }
 
-    if (!compiled_cmd) {
-
-        // Tcl_DStringAppend(__ds_val1__, "::thtml::runtime::tcl::evaluate_script", -1);
-        Tcl_DStringAppend(&ds, "\nTcl_DStringAppend(__ds_", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__, \"::thtml::runtime::tcl::evaluate_script\", -1);", -1);
+    // the command leaves its value in the interp result, either natively or via __thtml_eval_objv__
+    Tcl_DStringAppend(&ds, Tcl_DStringValue(&script_ds), Tcl_DStringLength(&script_ds));
 
-        // Tcl_DStringStartSublist(__ds_val1__);
-        Tcl_DStringAppend(&ds, "\nTcl_DStringStartSublist(__ds_", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__);", -1);
-
-        Tcl_DStringAppend(&ds, Tcl_DStringValue(&script_ds), Tcl_DStringLength(&script_ds));
-
-        // Tcl_DStringStartSublist(__ds_val1__);
-        Tcl_DStringAppend(&ds, "\nTcl_DStringEndSublist(__ds_", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__);", -1);
+    Tcl_FreeParse(&parse);
 
-        // Tcl_Obj *__val${val_num}__ = Tcl_DStringToObj(__ds_val1__);
-        Tcl_DStringAppend(&ds, "\nTcl_Obj *__", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__ = Tcl_DStringToObj(__ds_", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__);", -1);
+    Tcl_DStringResult(interp, &ds);
+    Tcl_DStringFree(&ds);
+    Tcl_DStringFree(&script_ds);
+    return TCL_OK;
+}
 
-        // Tcl_IncrRefCount(__val${val_num}__);
-        Tcl_DStringAppend(&ds, "\nTcl_IncrRefCount(__", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__);\n", -1);
+int thtml_CLiteralCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "CLiteralCmd\n"));
 
-        thtml_CListAppendGC(interp, objv[1], name, "obj", "__");
+    CheckArgs(3, 3, 1, "codearrVar literal");
 
-        // fprintf(stderr, "%s\n", Tcl_GetString(__val${val_num}__));
-//        Tcl_DStringAppend(&ds, "\nfprintf(stderr, \"__val${val_num}__ = %s\\n\", Tcl_GetString(__", -1);
-//        Tcl_DStringAppend(&ds, name, name_length);
-//        Tcl_DStringAppend(&ds, "__));\n", -1);
+    Tcl_Size literal_length;
+    const char *literal = Tcl_GetStringFromObj(objv[2], &literal_length);
 
-        // if (TCL_OK != Tcl_EvalObjEx(__interp__, __val${val_num}__, TCL_EVAL_DIRECT)) {return TCL_ERROR;}
-        Tcl_DStringAppend(&ds, "\nif (TCL_OK != Tcl_EvalObjEx(__interp__, __", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__, TCL_EVAL_DIRECT)) {", -1);
-        // Tcl_DecrRefCount(__val${val_num}__);
-        thtml_CGarbageCollection(interp, objv[1], &ds);
-        Tcl_DStringAppend(&ds, "\nreturn TCL_ERROR;\n}", -1);
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    if (TCL_OK != thtml_CAppendLiteral(interp, objv[1], &ds, literal, literal_length)) {
+        Tcl_DStringFree(&ds);
+        return TCL_ERROR;
+    }
 
-        // Tcl_DecrRefCount(__val${val_num}__);
-        Tcl_DStringAppend(&ds, "\nTcl_DecrRefCount(__", -1);
-        Tcl_DStringAppend(&ds, name, name_length);
-        Tcl_DStringAppend(&ds, "__);\n", -1);
+    Tcl_DStringResult(interp, &ds);
+    Tcl_DStringFree(&ds);
+    return TCL_OK;
+}
 
-        thtml_CListRemoveGC(interp, objv[1], name, "__");
+// code compiled with a codearr of its own refers to its literals by their index in that codearr,
+// the indices are mapped to the ones of the table they are merged into, see ::thtml::build::merge_chunks
+int thtml_CRemapLiteralsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "CRemapLiteralsCmd\n"));
 
+    CheckArgs(3, 3, 1, "code indices");
 
-    } else {
-        Tcl_DStringAppend(&ds, Tcl_DStringValue(&script_ds), Tcl_DStringLength(&script_ds));
+    Tcl_Size indices_length;
+    Tcl_Obj **indices;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, objv[2], &indices_length, &indices)) {
+        return TCL_ERROR;
     }
 
-    // Tcl_DStringFree(__ds_val1__);
-    Tcl_DStringAppend(&ds, "\nTcl_DStringFree(__ds_", -1);
-    Tcl_DStringAppend(&ds, name, name_length);
-    Tcl_DStringAppend(&ds, "__);", -1);
+    Tcl_Size code_length;
+    const char *code = Tcl_GetStringFromObj(objv[1], &code_length);
+    const char *end = code + code_length;
+    static const char prefix[] = "__literals__[";
+    const Tcl_Size prefix_length = sizeof(prefix) - 1;
 
-    thtml_CListRemoveGC(interp, objv[1], name, "__ds_");
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    const char *p = code;
+    const char *q;
+    while ((q = strstr(p, prefix)) != NULL) {
+        q += prefix_length;
+        Tcl_DStringAppend(&ds, p, q - p);
+
+        const char *r = q;
+        Tcl_Size index = 0;
+        while (r < end && isdigit((unsigned char) *r)) {
+            index = index * 10 + (*r - '0');
+            r++;
+        }
+        if (r == q || *r != ']') {
+            p = q;
+            continue;
+        }
+        if (index >= indices_length) {
+            Tcl_DStringFree(&ds);
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("literal index %ld out of range", (long) index));
+            return TCL_ERROR;
+        }
 
-    Tcl_FreeParse(&parse);
+        Tcl_DStringAppend(&ds, Tcl_GetString(indices[index]), -1);
+        p = r;
+    }
+    Tcl_DStringAppend(&ds, p, end - p);
 
     Tcl_DStringResult(interp, &ds);
-    Tcl_DStringFree(&ds);
-    Tcl_DStringFree(&script_ds);
     return TCL_OK;
 }
 
 #define THTML_IN_EVAL 1
-#define THTML_NUMBER 1 << 1
 #define THTML_STRING 1 << 2
-#define THTML_BOOL 1 << 3
-
-static int
-thtml_CAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                        Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr, int flags);
-
-static int thtml_CAppendCheck_Bool(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, const char *varname) {
-    Tcl_DStringAppend(ds_ptr, "\n// check boolean: ", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-
-    // int __a_val__ = 0;
-    Tcl_DStringAppend(ds_ptr, "\nint __", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, "_val", -1);
-    Tcl_DStringAppend(ds_ptr, "__ = 0;", -1);
+// the output context of a substituted value, one of THTML_ESCAPE_*
+#define THTML_ESCAPE_FLAGS(escape) ((escape) << 4)
+#define THTML_ESCAPE_FROM_FLAGS(flags) (((flags) >> 4) & 7)
 
-    // if (TCL_OK != Tcl_GetBooleanFromObj(__interp__, a, &__a_val__)) { return TCL_ERROR; }
-    Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != Tcl_GetBooleanFromObj(__interp__, ", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, ", &__", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, "_val", -1);
-    Tcl_DStringAppend(ds_ptr, "__)) {", -1);
-    thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
-    Tcl_DStringAppend(ds_ptr, "\nSetResult(\"invalid in boolean check\");\nreturn TCL_ERROR; }", -1);
+// __thtml_append_obj__(__ds_default__, x) or __thtml_append_escaped_obj__(__ds_default__, x, THTML_ESCAPE_TEXT)
+static void thtml_CAppendOutput(Tcl_DString *ds_ptr, const char *name, const char *value, Tcl_Size value_length, int flags) {
+    static const char *const escape_names[] = {"THTML_ESCAPE_NONE", "THTML_ESCAPE_TEXT", "THTML_ESCAPE_ATTR", "THTML_ESCAPE_URL",
+                                               "THTML_ESCAPE_URL_START"};
+    int escape = THTML_ESCAPE_FROM_FLAGS(flags);
 
-    return TCL_OK;
+    Tcl_DStringAppend(ds_ptr, escape == THTML_ESCAPE_NONE ? "\n__thtml_append_obj__(__ds_" : "\n__thtml_append_escaped_obj__(__ds_", -1);
+    Tcl_DStringAppend(ds_ptr, name, -1);
+    Tcl_DStringAppend(ds_ptr, "__, ", -1);
+    Tcl_DStringAppend(ds_ptr, value, value_length);
+    if (escape != THTML_ESCAPE_NONE) {
+        Tcl_DStringAppend(ds_ptr, ", ", -1);
+        Tcl_DStringAppend(ds_ptr, escape_names[escape], -1);
+    }
+    Tcl_DStringAppend(ds_ptr, ");", -1);
 }
 
-static int thtml_CAppendCheck_Number(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, const char *varname) {
-
-    check_count++;
-
-    char check_count_str[12];
-    snprintf(check_count_str, 12, "%d", check_count);
-
-    Tcl_DStringAppend(ds_ptr, "\n// check number: ", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-
-    // void *__a_val__ = NULL;
-    Tcl_DStringAppend(ds_ptr, "\nvoid *__", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, "_val", -1);
-    Tcl_DStringAppend(ds_ptr, check_count_str, -1);
-    Tcl_DStringAppend(ds_ptr, "__ = NULL;", -1);
-
-    // int __a_type__ = TCL_NUMBER_NAN;
-    Tcl_DStringAppend(ds_ptr, "\nint __", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, "_type", -1);
-    Tcl_DStringAppend(ds_ptr, check_count_str, -1);
-    Tcl_DStringAppend(ds_ptr, "__ = TCL_NUMBER_NAN;", -1);
-
-    // if (TCL_OK != Tcl_GetNumberFromObj(__interp__, a, &__a_val__, &__a_type__) || __a_type__ == TCL_NUMBER_NAN) { return TCL_ERROR; }
-    Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != Tcl_GetNumberFromObj(__interp__, ", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, ", &__", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, "_val", -1);
-    Tcl_DStringAppend(ds_ptr, check_count_str, -1);
-    Tcl_DStringAppend(ds_ptr, "__, &__", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, "_type", -1);
-    Tcl_DStringAppend(ds_ptr, check_count_str, -1);
-    Tcl_DStringAppend(ds_ptr, "__) || __", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, "_type", -1);
-    Tcl_DStringAppend(ds_ptr, check_count_str, -1);
-    Tcl_DStringAppend(ds_ptr, "__ == TCL_NUMBER_NAN) {", -1);
-    thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
-    Tcl_DStringAppend(ds_ptr, "\nSetResult(\"invalid in number check\");\nreturn TCL_ERROR; }", -1);
-    return TCL_OK;
-}
+static int
+thtml_CAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                        Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr, int flags);
 
 static int thtml_CAppendVariable_Simple(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, const char *varname_first_part,
                                         Tcl_Size varname_first_part_length, const char *name, Tcl_DString *expr_ds_ptr,
@@ -643,20 +728,16 @@ static int thtml_CAppendVariable_Simple(Tcl_Interp *interp, Tcl_Obj *codearrVar_
             Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
             Tcl_DStringAppend(ds_ptr, "__);", -1);
 
-            // Tcl_DStringAppend(__ds_default__, "\"$x\"", -1);
+            // Tcl_DStringAppend(__ds_default__, "\"$x\"", 2);
             Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_", -1);
             Tcl_DStringAppend(ds_ptr, name, -1);
             Tcl_DStringAppend(ds_ptr, "__, \"$", -1);
             Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
-            Tcl_DStringAppend(ds_ptr, "\", -1);", -1);
+            Tcl_DStringAppend(ds_ptr, "\", ", -1);
+            thtml_CAppendLength(ds_ptr, varname_first_part_length + 1);
+            Tcl_DStringAppend(ds_ptr, ");", -1);
         } else {
-            // Tcl_DStringAppend(__ds_default__, Tcl_GetString(x), -1);
-            Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_", -1);
-            Tcl_DStringAppend(ds_ptr, name, -1);
-            Tcl_DStringAppend(ds_ptr, "__, ", -1);
-            Tcl_DStringAppend(ds_ptr, "Tcl_GetString(", -1);
-            Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
-            Tcl_DStringAppend(ds_ptr, "), -1);", -1);
+            thtml_CAppendOutput(ds_ptr, name, varname_first_part, varname_first_part_length, flags);
         }
     } else {
         if (flags & THTML_IN_EVAL) {
@@ -664,12 +745,6 @@ static int thtml_CAppendVariable_Simple(Tcl_Interp *interp, Tcl_Obj *codearrVar_
             Tcl_DStringAppend(expr_ds_ptr, "$", -1);
             Tcl_DStringAppend(expr_ds_ptr, varname_first_part, varname_first_part_length);
         } else {
-            if (flags & THTML_NUMBER) {
-                thtml_CAppendCheck_Number(interp, codearrVar_ptr, ds_ptr, varname_first_part);
-            } else if (flags & THTML_BOOL) {
-                thtml_CAppendCheck_Bool(interp, codearrVar_ptr, ds_ptr, varname_first_part);
-            }
-
             Tcl_DStringAppend(expr_ds_ptr, varname_first_part, varname_first_part_length);
         }
     }
@@ -681,17 +756,22 @@ thtml_CAppendVariable_Dict(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
                            Tcl_Size varname_first_part_length, Tcl_Obj **parts,
                            Tcl_Size num_parts, const char *name, Tcl_DString *expr_ds_ptr, int flags) {
 
-    count_var_dict_subst++;
+    int count_var_dict_subst = thtml_NextCount(interp, codearrVar_ptr, "count_var_dict_subst");
     char count_var_dict_subst_str[12];
     snprintf(count_var_dict_subst_str, 12, "%d", count_var_dict_subst);
 
     char varname[64];
     snprintf(varname, 64, "__dict_%s__", count_var_dict_subst_str);
 
+    // template data is looked up through the layers of the scope, see __thtml_scope_get__
+    int from_scope = varname_first_part_length == 9 && 0 == strncmp(varname_first_part, "__scope__", 9);
+
     Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *", -1);
     Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, " = ", -1);
-    Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
+    if (!from_scope) {
+        Tcl_DStringAppend(ds_ptr, " = ", -1);
+        Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
+    }
     Tcl_DStringAppend(ds_ptr, ";", -1);
 
     int first = 1;
@@ -709,23 +789,19 @@ thtml_CAppendVariable_Dict(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
         Tcl_DStringAppend(ds_ptr, part, part_length);
         Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
         Tcl_DStringAppend(ds_ptr, ";", -1);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *__", -1);
-        Tcl_DStringAppend(ds_ptr, part, part_length);
-        Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
-        Tcl_DStringAppend(ds_ptr, "_key_ptr__ = Tcl_NewStringObj(\"", -1);
-        Tcl_DStringAppend(ds_ptr, part, part_length);
-        Tcl_DStringAppend(ds_ptr, "\", -1);", -1);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(__", -1);
-        Tcl_DStringAppend(ds_ptr, part, part_length);
-        Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
-        Tcl_DStringAppend(ds_ptr, "_key_ptr__);", -1);
-        Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != Tcl_DictObjGet(__interp__, ", -1);
-        Tcl_DStringAppend(ds_ptr, "", -1);
-        Tcl_DStringAppend(ds_ptr, varname, -1);
-        Tcl_DStringAppend(ds_ptr, ", __", -1);
-        Tcl_DStringAppend(ds_ptr, part, part_length);
-        Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
-        Tcl_DStringAppend(ds_ptr, "_key_ptr__, &", -1);
+        // if (TCL_OK != Tcl_DictObjGet(__interp__, __dict_1__, __literals__[0], &b1) || !b1) { ... }
+        // if (TCL_OK != __thtml_scope_get__(__interp__, __scope__, __literals__[0], &a1) || !a1) { ... }
+        if (i == 0 && from_scope) {
+            Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != __thtml_scope_get__(__interp__, __scope__, ", -1);
+        } else {
+            Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != Tcl_DictObjGet(__interp__, ", -1);
+            Tcl_DStringAppend(ds_ptr, varname, -1);
+            Tcl_DStringAppend(ds_ptr, ", ", -1);
+        }
+        if (TCL_OK != thtml_CAppendLiteral(interp, codearrVar_ptr, ds_ptr, part, part_length)) {
+            return TCL_ERROR;
+        }
+        Tcl_DStringAppend(ds_ptr, ", &", -1);
         Tcl_DStringAppend(ds_ptr, part, part_length);
         Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
         Tcl_DStringAppend(ds_ptr, ") || !", -1);
@@ -735,19 +811,9 @@ thtml_CAppendVariable_Dict(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
 
         thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
 
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DecrRefCount(__", -1);
-        Tcl_DStringAppend(ds_ptr, part, part_length);
-        Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
-        Tcl_DStringAppend(ds_ptr, "_key_ptr__);", -1);
-
         Tcl_DStringAppend(ds_ptr, "\nSetResult(\"dict obj get failed: ", -1);
         Tcl_DStringAppend(ds_ptr, part, part_length);
         Tcl_DStringAppend(ds_ptr, "\");\nreturn TCL_ERROR;\n}", -1);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DecrRefCount(__", -1);
-        Tcl_DStringAppend(ds_ptr, part, part_length);
-        Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
-        Tcl_DStringAppend(ds_ptr, "_key_ptr__);", -1);
-
 
 //         fprintf(stderr, "dict: %s\n", Tcl_GetString(__dict1__));
 //        Tcl_DStringAppend(ds_ptr, "\nfprintf(stderr, \"dict: %s\\n\", Tcl_GetString(__dict_", -1);
@@ -763,19 +829,9 @@ thtml_CAppendVariable_Dict(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
 
     }
 
-    if (flags & THTML_NUMBER) {
-        thtml_CAppendCheck_Number(interp, codearrVar_ptr, ds_ptr, varname);
-    } else if (flags & THTML_BOOL) {
-        thtml_CAppendCheck_Bool(interp, codearrVar_ptr, ds_ptr, varname);
-    }
-
     if (expr_ds_ptr == NULL) {
-        // Tcl_DStringAppend(__ds_wt3__, Tcl_GetString(__dict_2__), -1);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, name, -1);
-        Tcl_DStringAppend(ds_ptr, "__, Tcl_GetString(__dict_", -1);
-        Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
-        Tcl_DStringAppend(ds_ptr, "__), -1);\n", -1);
+        thtml_CAppendOutput(ds_ptr, name, varname, -1, flags);
+        Tcl_DStringAppend(ds_ptr, "\n", -1);
 
         // fprintf(stderr, "%s\n", Tcl_GetString(__dict1__));
 //        Tcl_DStringAppend(ds_ptr, "\nfprintf(stderr, \"%s\\n\", Tcl_GetString(__dict_", -1);
@@ -803,6 +859,12 @@ thtml_CAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *
         const char *p = text_token->start;
         const char *end = text_token->start + text_token->size;
 
+        // ${!x} opts out of escaping in template text
+        if (THTML_ESCAPE_FROM_FLAGS(flags) != THTML_ESCAPE_NONE && p < end && *p == '!') {
+            flags &= ~THTML_ESCAPE_FLAGS(7);
+            p++;
+        }
+
         Tcl_Obj *parts_ptr = Tcl_NewListObj(0, NULL);
         Tcl_IncrRefCount(parts_ptr);
         while (p < end) {
@@ -931,7 +993,7 @@ thtml_CAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *
         }
 
         if (TCL_OK !=
-            thtml_CAppendVariable_Dict(interp, codearrVar_ptr, ds_ptr, "__data__", 8, parts, num_parts, name, cmd_ds_ptr, flags)) {
+            thtml_CAppendVariable_Dict(interp, codearrVar_ptr, ds_ptr, "__scope__", 9, parts, num_parts, name, cmd_ds_ptr, flags)) {
             Tcl_DecrRefCount(parts_ptr);
             return TCL_ERROR;
         }
@@ -1008,523 +1070,400 @@ static const char *INSTR[] = {
 
 };
 
-static int
-thtml_CAppendExpr_Operator(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                           Tcl_Size i, const char *name, Tcl_DString *cmd_ds_ptr, Tcl_DString *after_ds_ptr,
-                           int flags) {
-    Tcl_Token *subexpr_token = &parse_ptr->tokenPtr[i];
-    Tcl_Token *operator_token = &parse_ptr->tokenPtr[i + 1];
-    Tcl_Size operands_offset = i + 2;
-
-    // The numComponents field for a TCL_TOKEN_OPERATOR token is always 0
-    // So, we get numComponents from the TCL_TOKEN_SUB_EXPR token that precedes it
-    Tcl_Size num_components = subexpr_token->numComponents;
+// The C type of the value of a compiled (sub)expression. Numbers and booleans stay C values through
+// the expression and are boxed into a Tcl_Obj only where one is needed, see __thtml_num_t.
+#define THTML_CTYPE_OBJ 0
+#define THTML_CTYPE_NUM 1
+#define THTML_CTYPE_BOOL 2
 
-    int num_operands = 0;
-    Tcl_Size j = 0;
-    while (j < num_components - 2) {
-        Tcl_Token *operand_token = &parse_ptr->tokenPtr[operands_offset + j];
-        if (operand_token->type == TCL_TOKEN_SUB_EXPR) {
-            // fprintf(stderr, ">>> subexpr %d\n", operand_token->numComponents);
-            num_operands++;
-            j += 1 + operand_token->numComponents;
-            continue;
-        }
-        // fprintf(stderr, "num_operands: %d j: %d num_components: %d\n", num_operands, j, num_components);
-        // the following should never happen
-        SetResult("error parsing expression: not enough operands");
-        return TCL_ERROR;
+static int
+thtml_CAppendExpr_Value(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                        Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr, int ctype);
+
+// appends "value" of C type "from" to the expression as C type "to", the conversions that
+// can fail or that create an object are done by statements before the expression
+static void
+thtml_CAppendExpr_Convert(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, const char *name,
+                          const char *value, int from, int to, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr) {
+    if (from == to) {
+        Tcl_DStringAppend(expr_ds_ptr, value, -1);
+        return;
     }
 
+    if (from == THTML_CTYPE_NUM && to == THTML_CTYPE_BOOL) {
+        // __thtml_num_bool__(__flag1_op2__)
+        Tcl_DStringAppend(expr_ds_ptr, "__thtml_num_bool__(", -1);
+        Tcl_DStringAppend(expr_ds_ptr, value, -1);
+        Tcl_DStringAppend(expr_ds_ptr, ")", -1);
+        return;
+    }
+    if (from == THTML_CTYPE_BOOL && to == THTML_CTYPE_NUM) {
+        Tcl_DStringAppend(expr_ds_ptr, "__thtml_num_int__(", -1);
+        Tcl_DStringAppend(expr_ds_ptr, value, -1);
+        Tcl_DStringAppend(expr_ds_ptr, ")", -1);
+        return;
+    }
 
-    if (operator_token->size == 1) {
-        char ch = operator_token->start[0];
-        if (num_operands == 1) {
-            if (ch == '!') {
-                // logical not, one operand
-                op_count++;
-                char op_count_str[12];
-                snprintf(op_count_str, 12, "%d", op_count);
-
-                char varname[64];
-                snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
-
-                Tcl_DString operator_ds;
-                Tcl_DStringInit(&operator_ds);
-
-                Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-                Tcl_DStringAppend(&operator_ds, varname, -1);
-                Tcl_DStringAppend(&operator_ds, " = ", -1);
-                Tcl_DStringAppend(&operator_ds, " __thtml_", -1);
-                Tcl_DStringAppend(&operator_ds, INSTR[operator_token->start[0]], -1);
-                Tcl_DStringAppend(&operator_ds, "__(", -1);
-
-                if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name,
-                                                      &operator_ds, after_ds_ptr, THTML_BOOL)) {
-                    Tcl_DStringFree(&operator_ds);
-                    return TCL_ERROR;
-                }
-                Tcl_DStringAppend(&operator_ds, ");", -1);
-                Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-                Tcl_DStringFree(&operator_ds);
-
-                Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-                Tcl_DStringAppend(ds_ptr, varname, -1);
-                Tcl_DStringAppend(ds_ptr, ");", -1);
-
-                Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
+    int op_count = thtml_NextCount(interp, codearrVar_ptr, "op_count");
+    char varname[64];
 
-                Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
-                Tcl_DStringAppend(after_ds_ptr, varname, -1);
-                Tcl_DStringAppend(after_ds_ptr, ");", -1);
+    if (to == THTML_CTYPE_OBJ) {
+        snprintf(varname, 64, "__%s_obj%d__", name, op_count);
 
-            } else if (ch == '-') {
-                // uminus, one operand
+        // Tcl_Obj *__flag1_obj3__ = __thtml_num_obj__(__flag1_op2__);
+        Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, from == THTML_CTYPE_NUM ? " = __thtml_num_obj__(" : " = Tcl_NewBooleanObj(", -1);
+        Tcl_DStringAppend(ds_ptr, value, -1);
+        Tcl_DStringAppend(ds_ptr, ");", -1);
 
-                op_count++;
-                char op_count_str[12];
-                snprintf(op_count_str, 12, "%d", op_count);
+        Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, ");", -1);
 
-                char varname[64];
-                snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
+        Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
+        Tcl_DStringAppend(after_ds_ptr, varname, -1);
+        Tcl_DStringAppend(after_ds_ptr, ");", -1);
+    } else {
+        // __thtml_num_t __flag1_num3__;
+        // if (TCL_OK != __thtml_num_from_obj__(__interp__, __dict_1__, &__flag1_num3__)) { ... }
+        // int __flag1_bool3__;
+        // if (TCL_OK != Tcl_GetBooleanFromObj(__interp__, __dict_1__, &__flag1_bool3__)) { ... }
+        int to_num = to == THTML_CTYPE_NUM;
+        snprintf(varname, 64, to_num ? "__%s_num%d__" : "__%s_bool%d__", name, op_count);
+
+        Tcl_DStringAppend(ds_ptr, to_num ? "\n__thtml_num_t " : "\nint ", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, ";", -1);
+        Tcl_DStringAppend(ds_ptr, to_num ? "\nif (TCL_OK != __thtml_num_from_obj__(__interp__, "
+                                         : "\nif (TCL_OK != Tcl_GetBooleanFromObj(__interp__, ", -1);
+        Tcl_DStringAppend(ds_ptr, value, -1);
+        Tcl_DStringAppend(ds_ptr, ", &", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, ")) {", -1);
+        thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
+        Tcl_DStringAppend(ds_ptr, "\nreturn TCL_ERROR; }", -1);
+    }
 
-                Tcl_DString operator_ds;
-                Tcl_DStringInit(&operator_ds);
+    Tcl_DStringAppend(expr_ds_ptr, varname, -1);
+}
 
-                Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-                Tcl_DStringAppend(&operator_ds, varname, -1);
-                Tcl_DStringAppend(&operator_ds, " = ", -1);
-                Tcl_DStringAppend(&operator_ds, " __thtml_uminus__(", -1);
+// a literal number or boolean of the expression becomes a C constant
+static int thtml_CAppendExpr_Constant(const char *text, Tcl_Size text_length, int ctype, Tcl_DString *expr_ds_ptr) {
+    Tcl_Obj *text_ptr = Tcl_NewStringObj(text, text_length);
+    Tcl_IncrRefCount(text_ptr);
+
+    char constant[64] = "";
+    Tcl_WideInt w;
+    double d;
+    int b;
+    if (ctype == THTML_CTYPE_NUM) {
+        if (TCL_OK == Tcl_GetWideIntFromObj(NULL, text_ptr, &w)) {
+            snprintf(constant, 64, "__thtml_num_int__(%" TCL_LL_MODIFIER "d)", w);
+        } else if (TCL_OK == Tcl_GetDoubleFromObj(NULL, text_ptr, &d) && isfinite(d) &&
+                   strpbrk(Tcl_GetString(text_ptr), ".eE") != NULL) {
+            snprintf(constant, 64, "__thtml_num_double__(%.17g)", d);
+        }
+    } else if (ctype == THTML_CTYPE_BOOL) {
+        if (TCL_OK == Tcl_GetBooleanFromObj(NULL, text_ptr, &b)) {
+            snprintf(constant, 64, "%d", b);
+        }
+    }
+    Tcl_DecrRefCount(text_ptr);
 
-                if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name,
-                                                      &operator_ds, after_ds_ptr, THTML_BOOL)) {
-                    Tcl_DStringFree(&operator_ds);
-                    return TCL_ERROR;
-                }
-                Tcl_DStringAppend(&operator_ds, ");", -1);
-                Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-                Tcl_DStringFree(&operator_ds);
+    Tcl_DStringAppend(expr_ds_ptr, constant, -1);
+    return constant[0] != '\0';
+}
 
-                Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-                Tcl_DStringAppend(ds_ptr, varname, -1);
-                Tcl_DStringAppend(ds_ptr, ");", -1);
+// "type" "varname" = helper(__interp__, operands..., &"varname") with a check for its error
+static void
+thtml_CAppendExpr_Checked(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, const char *type,
+                          const char *varname, const char *helper, Tcl_DString *operands_ds, int num_operands) {
+    // __thtml_num_t __flag1_op2__;
+    Tcl_DStringAppend(ds_ptr, "\n", -1);
+    Tcl_DStringAppend(ds_ptr, type, -1);
+    Tcl_DStringAppend(ds_ptr, " ", -1);
+    Tcl_DStringAppend(ds_ptr, varname, -1);
+    Tcl_DStringAppend(ds_ptr, ";", -1);
 
-                Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
+    // if (TCL_OK != __thtml_num_add__(__interp__, __flag1_num1__, __thtml_num_int__(1), &__flag1_op2__)) { ... }
+    Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != ", -1);
+    Tcl_DStringAppend(ds_ptr, helper, -1);
+    Tcl_DStringAppend(ds_ptr, "(__interp__, ", -1);
+    for (int k = 0; k < num_operands; k++) {
+        Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operands_ds[k]), Tcl_DStringLength(&operands_ds[k]));
+        Tcl_DStringAppend(ds_ptr, ", ", -1);
+    }
+    Tcl_DStringAppend(ds_ptr, "&", -1);
+    Tcl_DStringAppend(ds_ptr, varname, -1);
+    Tcl_DStringAppend(ds_ptr, ")) {", -1);
+    thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
+    Tcl_DStringAppend(ds_ptr, "\nreturn TCL_ERROR; }", -1);
+}
 
-                Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
-                Tcl_DStringAppend(after_ds_ptr, varname, -1);
-                Tcl_DStringAppend(after_ds_ptr, ");", -1);
-            } else if (ch == '~') {
-                // bitnot, one operand
+static void thtml_CFreeOperands(int num_operands, Tcl_DString *operands_ds, Tcl_DString *blocks_ds,
+                                Tcl_DString *block_afters_ds) {
+    for (int k = 0; k < num_operands; k++) {
+        Tcl_DStringFree(&operands_ds[k]);
+        Tcl_DStringFree(&blocks_ds[k]);
+        Tcl_DStringFree(&block_afters_ds[k]);
+    }
+}
 
-                op_count++;
-                char op_count_str[12];
-                snprintf(op_count_str, 12, "%d", op_count);
+// the statements of an operand that is evaluated only when it is needed, followed by the
+// assignment of its value to "varname" and the release of its temporary objects
+static void thtml_CAppendExpr_Block(Tcl_DString *ds_ptr, const char *varname, int ctype, Tcl_DString *value_ds_ptr,
+                                    Tcl_DString *block_ds_ptr, Tcl_DString *block_after_ds_ptr) {
+    Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(block_ds_ptr), Tcl_DStringLength(block_ds_ptr));
 
-                char varname[64];
-                snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
+    // __flag1_op3__ = ...;
+    Tcl_DStringAppend(ds_ptr, "\n", -1);
+    Tcl_DStringAppend(ds_ptr, varname, -1);
+    Tcl_DStringAppend(ds_ptr, " = ", -1);
+    Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(value_ds_ptr), Tcl_DStringLength(value_ds_ptr));
+    Tcl_DStringAppend(ds_ptr, ";", -1);
 
-                Tcl_DString operator_ds;
-                Tcl_DStringInit(&operator_ds);
+    // the value may be one of the temporary objects of the block
+    if (ctype == THTML_CTYPE_OBJ) {
+        Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, ");", -1);
+    }
 
-                Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-                Tcl_DStringAppend(&operator_ds, varname, -1);
-                Tcl_DStringAppend(&operator_ds, " = ", -1);
-                Tcl_DStringAppend(&operator_ds, " __thtml_bitnot__(", -1);
+    Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(block_after_ds_ptr), Tcl_DStringLength(block_after_ds_ptr));
+}
 
-                if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name,
-                                                      &operator_ds, after_ds_ptr, THTML_BOOL)) {
-                    Tcl_DStringFree(&operator_ds);
-                    return TCL_ERROR;
-                }
-                Tcl_DStringAppend(&operator_ds, ");", -1);
-                Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-                Tcl_DStringFree(&operator_ds);
+// appends the value of an operator to the expression and sets "ctype_ptr" to its C type, the
+// ternary operator gives its value as "ctype", the one that is asked for
+static int
+thtml_CAppendExpr_Operator(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                           Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr,
+                           int ctype, int *ctype_ptr) {
+    Tcl_Token *subexpr_token = &parse_ptr->tokenPtr[i];
+    Tcl_Token *operator_token = &parse_ptr->tokenPtr[i + 1];
+    Tcl_Size operands_offset = i + 2;
 
-                Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-                Tcl_DStringAppend(ds_ptr, varname, -1);
-                Tcl_DStringAppend(ds_ptr, ");", -1);
+    // The numComponents field for a TCL_TOKEN_OPERATOR token is always 0
+    // So, we get numComponents from the TCL_TOKEN_SUB_EXPR token that precedes it
+    Tcl_Size num_components = subexpr_token->numComponents;
 
-                Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
-
-                Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
-                Tcl_DStringAppend(after_ds_ptr, varname, -1);
-                Tcl_DStringAppend(after_ds_ptr, ");", -1);
-            }
-        } else if (num_operands == 2 &&
-                   (ch == '<' || ch == '>')) {
-
-            // two operands
-            op_count++;
-            char op_count_str[12];
-            snprintf(op_count_str, 12, "%d", op_count);
-
-            char varname[64];
-            snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
-
-            Tcl_DString operator_ds;
-            Tcl_DStringInit(&operator_ds);
-
-            Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " = ", -1);
-            Tcl_DStringAppend(&operator_ds, " __thtml_", -11);
-            Tcl_DStringAppend(&operator_ds, INSTR[operator_token->start[0]], -1);
-            Tcl_DStringAppend(&operator_ds, "__(", -1);
-
-            Tcl_Token *first_operand = &parse_ptr->tokenPtr[operands_offset];
-
-            // fprintf(stderr, "first_operand of op: %c has numComponents: %d\n", ch, first_operand->numComponents);
-            if (TCL_OK !=
-                thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name, &operator_ds,
-                                        after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ", ", -1);
-
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr,
-                                                  operands_offset + first_operand->numComponents + 1, name,
-                                                  &operator_ds, after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ");", -1);
-
-            // check for divided_by_zero, exponent_of_zero, general_arithmetic_error, and out_of_memory
-            // if ( __cmd29_expr_op30__ < 0 && __cmd29_expr_op30__ > -5 ) { return TCL_ERROR; }
-            Tcl_DStringAppend(&operator_ds, "\nif ( ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " < (Tcl_Obj *) 0 ", -1);
-            Tcl_DStringAppend(&operator_ds, " && ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " > (Tcl_Obj *) -5 ) {", -1);
-            thtml_CGarbageCollection(interp, codearrVar_ptr, &operator_ds);
-            Tcl_DStringAppend(&operator_ds, "SetResult(\"math error in CAppendExpr_Operator\");  return TCL_ERROR; }", -1);
-
-            Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-            Tcl_DStringFree(&operator_ds);
-
-            Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-            Tcl_DStringAppend(ds_ptr, varname, -1);
-            Tcl_DStringAppend(ds_ptr, ");", -1);
-
-            Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
-
-            Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
-            Tcl_DStringAppend(after_ds_ptr, varname, -1);
-            Tcl_DStringAppend(after_ds_ptr, ");", -1);
-
-        } else if (num_operands == 2 &&
-                   (ch == '+' || ch == '-' || ch == '*' || ch == '/' || ch == '%' || ch == '^' || ch == '&' ||
-                    ch == '|' ||
-                    ch == '~')) {
-
-            // binary math op, two operands
-            op_count++;
-            char op_count_str[12];
-            snprintf(op_count_str, 12, "%d", op_count);
-
-            char varname[64];
-            snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
-
-            Tcl_DString operator_ds;
-            Tcl_DStringInit(&operator_ds);
-
-            Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " = ", -1);
-            Tcl_DStringAppend(&operator_ds, " __thtml_", -11);
-            Tcl_DStringAppend(&operator_ds, INSTR[operator_token->start[0]], -1);
-            Tcl_DStringAppend(&operator_ds, "__(__interp__, ", -1);
-
-            Tcl_Token *first_operand = &parse_ptr->tokenPtr[operands_offset];
-
-            // fprintf(stderr, "first_operand of op: %c has numComponents: %d\n", ch, first_operand->numComponents);
-            if (TCL_OK !=
-                thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name, &operator_ds,
-                                        after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ", ", -1);
-
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr,
-                                                  operands_offset + first_operand->numComponents + 1, name,
-                                                  &operator_ds, after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ");", -1);
-
-            // check for divided_by_zero, exponent_of_zero, general_arithmetic_error, and out_of_memory
-            // if ( __cmd29_expr_op30__ < 0 && __cmd29_expr_op30__ > -5 ) { return TCL_ERROR; }
-            Tcl_DStringAppend(&operator_ds, "\nif ( ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " < (Tcl_Obj *) 0 ", -1);
-            Tcl_DStringAppend(&operator_ds, " && ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " > (Tcl_Obj *) -5 ) {", -1);
-            thtml_CGarbageCollection(interp, codearrVar_ptr, &operator_ds);
-            Tcl_DStringAppend(&operator_ds, "\nSetResult(\"math error in CAppendExpr_Operator\");  return TCL_ERROR; }", -1);
-
-            Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-            Tcl_DStringFree(&operator_ds);
-
-            Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-            Tcl_DStringAppend(ds_ptr, varname, -1);
-            Tcl_DStringAppend(ds_ptr, ");", -1);
-
-            Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
-
-            Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
-            Tcl_DStringAppend(after_ds_ptr, varname, -1);
-            Tcl_DStringAppend(after_ds_ptr, ");", -1);
-
-        } else if (ch == '?') {
-            // three operands
-            op_count++;
-            char op_count_str[12];
-            snprintf(op_count_str, 12, "%d", op_count);
-
-            char varname[64];
-            snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
-
-            Tcl_DString operator_ds;
-            Tcl_DStringInit(&operator_ds);
-
-            Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " = __thtml_ternary__(__interp__, ", -1);
-
-            Tcl_Token *first_operand = &parse_ptr->tokenPtr[operands_offset];
-            Tcl_Size second_operand_index = operands_offset + first_operand->numComponents + 1;
-            Tcl_Token *second_operand = &parse_ptr->tokenPtr[second_operand_index];
-            Tcl_Size third_operand_index = second_operand_index + second_operand->numComponents + 1;
-
-            // fprintf(stderr, "first_operand of op: %c has numComponents: %d\n", ch, first_operand->numComponents);
-            if (TCL_OK !=
-                thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name, &operator_ds,
-                                        after_ds_ptr, THTML_BOOL)) {
-                return TCL_ERROR;
-            }
-            Tcl_DStringAppend(&operator_ds, ", ", -1);
-            if (TCL_OK !=
-                thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, second_operand_index, name,
-                                        &operator_ds, after_ds_ptr, flags)) {
-                return TCL_ERROR;
-            }
-            Tcl_DStringAppend(&operator_ds, ", ", -1);
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, third_operand_index, name,
-                                                  &operator_ds, after_ds_ptr, flags)) {
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ");", -1);
-
-            // check for divided_by_zero, exponent_of_zero, general_arithmetic_error, and out_of_memory
-            // if ( __cmd29_expr_op30__ < 0 && __cmd29_expr_op30__ > -5 ) { return TCL_ERROR; }
-            Tcl_DStringAppend(&operator_ds, "\nif ( ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " < (Tcl_Obj *) 0 ", -1);
-            Tcl_DStringAppend(&operator_ds, " && ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " > (Tcl_Obj *) -5 ) {", -1);
-            thtml_CGarbageCollection(interp, codearrVar_ptr, &operator_ds);
-            Tcl_DStringAppend(&operator_ds, "\nSetResult(\"math error in CAppendExpr_Operator\");  return TCL_ERROR; }", -1);
-
-            Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-            Tcl_DStringFree(&operator_ds);
-
-            Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-            Tcl_DStringAppend(ds_ptr, varname, -1);
-            Tcl_DStringAppend(ds_ptr, ");", -1);
-
-            Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
-
-            Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
-            Tcl_DStringAppend(after_ds_ptr, varname, -1);
-            Tcl_DStringAppend(after_ds_ptr, ");", -1);
-
-
-        } else {
-            SetResult("error parsing expression: unsupported operator");
+    Tcl_Size operands[3];
+    int num_operands = 0;
+    Tcl_Size j = 0;
+    while (j < num_components - 1) {
+        Tcl_Token *operand_token = &parse_ptr->tokenPtr[operands_offset + j];
+        if (operand_token->type != TCL_TOKEN_SUB_EXPR || num_operands == 3) {
+            // the following should never happen
+            SetResult("error parsing expression: not enough operands");
             return TCL_ERROR;
         }
-    } else if (operator_token->size == 2) {
-        char ch1 = operator_token->start[0];
-        char ch2 = operator_token->start[1];
-        if ((ch1 == '&' && ch2 == '&') || (ch1 == '|' && ch2 == '|') || (ch1 == '<' && ch2 == '<') ||
-            (ch1 == '>' && ch2 == '>') || (ch1 == '=' && ch2 == '=') || (ch1 == '!' && ch2 == '=') ||
-            (ch1 == '<' && ch2 == '=') || (ch1 == '>' && ch2 == '=')) {
-            // two operands
-            op_count++;
-            char op_count_str[12];
-            snprintf(op_count_str, 12, "%d", op_count);
-
-            char varname[64];
-            snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
-
-            Tcl_DString operator_ds;
-            Tcl_DStringInit(&operator_ds);
-
-            Tcl_Token *first_operand = &parse_ptr->tokenPtr[operands_offset];
-            Tcl_Token *second_operand = &parse_ptr->tokenPtr[operands_offset + first_operand->numComponents + 1];
-
-            Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " = ", -1);
-            Tcl_DStringAppend(&operator_ds, " __thtml_", -1);
-            Tcl_DStringAppend(&operator_ds, INSTR[(operator_token->start[0] << 8) + operator_token->start[1]], -1);
-            Tcl_DStringAppend(&operator_ds, "__(", -1);
-
-            if (TCL_OK !=
-                thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name, &operator_ds,
-                                        after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ", ", -1);
-
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr,
-                                                  operands_offset + first_operand->numComponents + 1, name,
-                                                  &operator_ds, after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ");", -1);
-            Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-            Tcl_DStringFree(&operator_ds);
-
-            Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-            Tcl_DStringAppend(ds_ptr, varname, -1);
-            Tcl_DStringAppend(ds_ptr, ");", -1);
-
-            Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
-
-            Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
-            Tcl_DStringAppend(after_ds_ptr, varname, -1);
-            Tcl_DStringAppend(after_ds_ptr, ");", -1);
-        } else if ((ch1 == '*' && ch2 == '*')) {
-            // expon, two operands
-            op_count++;
-            char op_count_str[12];
-            snprintf(op_count_str, 12, "%d", op_count);
-
-            char varname[64];
-            snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
-
-            Tcl_DString operator_ds;
-            Tcl_DStringInit(&operator_ds);
-
-            Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " = ", -1);
-            Tcl_DStringAppend(&operator_ds, " __thtml_expon__(__interp__, ", -1);
-
-            Tcl_Token *first_operand = &parse_ptr->tokenPtr[operands_offset];
-
-            // fprintf(stderr, "first_operand of op: %c has numComponents: %d\n", ch, first_operand->numComponents);
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name,
-                                                  &operator_ds, after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ", ", -1);
+        operands[num_operands++] = operands_offset + j;
+        j += 1 + operand_token->numComponents;
+    }
 
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr,
-                                                  operands_offset + first_operand->numComponents + 1, name,
-                                                  &operator_ds, after_ds_ptr, THTML_NUMBER)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
+    const char *instr = NULL;
+    if (operator_token->size == 1) {
+        instr = INSTR[(unsigned char) operator_token->start[0]];
+    } else if (operator_token->size == 2) {
+        size_t index = ((unsigned char) operator_token->start[0] << 8) + (unsigned char) operator_token->start[1];
+        if (index < sizeof(INSTR) / sizeof(INSTR[0])) {
+            instr = INSTR[index];
+        }
+    }
+    if (instr == NULL) {
+        SetResult("error parsing expression: unsupported operator");
+        return TCL_ERROR;
+    }
 
-            Tcl_DStringAppend(&operator_ds, ");", -1);
+    // the C type of the operands and the kind of value that the operator gives
+    enum {
+        THTML_OP_MATH, THTML_OP_COMPARE, THTML_OP_STRCMP, THTML_OP_MEMBER, THTML_OP_LOGIC, THTML_OP_NOT, THTML_OP_UPLUS,
+        THTML_OP_TERNARY
+    } kind;
+    const char *c_op = NULL;
+    int operand_ctype;
+    if (num_operands == 1 && strcmp(instr, "not") == 0) {
+        kind = THTML_OP_NOT;
+        operand_ctype = THTML_CTYPE_BOOL;
+    } else if (num_operands == 1 && strcmp(instr, "add") == 0) {
+        kind = THTML_OP_UPLUS;
+        operand_ctype = THTML_CTYPE_NUM;
+    } else if (num_operands == 1 && (strcmp(instr, "sub") == 0 || strcmp(instr, "bitnot") == 0)) {
+        kind = THTML_OP_MATH;
+        instr = instr[0] == 's' ? "uminus" : "bitnot";
+        operand_ctype = THTML_CTYPE_NUM;
+    } else if (num_operands == 3 && strcmp(instr, "ternary") == 0) {
+        kind = THTML_OP_TERNARY;
+        operand_ctype = ctype;
+    } else if (num_operands == 2 && (strcmp(instr, "lt") == 0 || strcmp(instr, "gt") == 0 ||
+                                     strcmp(instr, "lte") == 0 || strcmp(instr, "gte") == 0 ||
+                                     strcmp(instr, "eq") == 0 || strcmp(instr, "ne") == 0)) {
+        kind = THTML_OP_COMPARE;
+        c_op = instr[0] == 'l' ? (instr[2] == 'e' ? "<=" : "<") : instr[0] == 'g' ? (instr[2] == 'e' ? ">=" : ">")
+             : instr[0] == 'e' ? "==" : "!=";
+        operand_ctype = THTML_CTYPE_NUM;
+    } else if (num_operands == 2 && (strcmp(instr, "streq") == 0 || strcmp(instr, "strneq") == 0)) {
+        kind = THTML_OP_STRCMP;
+        c_op = instr[3] == 'e' ? "==" : "!=";
+        operand_ctype = THTML_CTYPE_OBJ;
+    } else if (num_operands == 2 && (strcmp(instr, "in") == 0 || strcmp(instr, "ni") == 0)) {
+        kind = THTML_OP_MEMBER;
+        operand_ctype = THTML_CTYPE_OBJ;
+    } else if (num_operands == 2 && (strcmp(instr, "and") == 0 || strcmp(instr, "or") == 0)) {
+        kind = THTML_OP_LOGIC;
+        c_op = instr[0] == 'a' ? " && " : " || ";
+        operand_ctype = THTML_CTYPE_BOOL;
+    } else if (num_operands == 2 && strcmp(instr, "not") != 0 && strcmp(instr, "ternary") != 0) {
+        kind = THTML_OP_MATH;
+        operand_ctype = THTML_CTYPE_NUM;
+    } else {
+        SetResult("error parsing expression: unsupported operator");
+        return TCL_ERROR;
+    }
 
-            // check for divided_by_zero, exponent_of_zero, general_arithmetic_error, and out_of_memory
-            // if ( __cmd29_expr_op30__ < 0 && __cmd29_expr_op30__ > -5 ) { return TCL_ERROR; }
-            Tcl_DStringAppend(&operator_ds, "\nif ( ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " < (Tcl_Obj *) 0 ", -1);
-            Tcl_DStringAppend(&operator_ds, " && ", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " > (Tcl_Obj *) -5 ) {", -1);
-            thtml_CGarbageCollection(interp, codearrVar_ptr, &operator_ds);
-            Tcl_DStringAppend(&operator_ds, "\nSetResult(\"math error in CAppendExpr_Operator\"); return TCL_ERROR; }", -1);
+    // the operands after the first one of && || and ?: are evaluated only when they are needed,
+    // their statements are kept in "blocks_ds" and their temporary objects in "block_afters_ds"
+    // until we know whether they go into a block of their own
+    int num_eager = kind == THTML_OP_LOGIC || kind == THTML_OP_TERNARY ? 1 : num_operands;
+    Tcl_DString operands_ds[3];
+    Tcl_DString blocks_ds[3];
+    Tcl_DString block_afters_ds[3];
+    for (int k = 0; k < num_operands; k++) {
+        Tcl_DStringInit(&operands_ds[k]);
+        Tcl_DStringInit(&blocks_ds[k]);
+        Tcl_DStringInit(&block_afters_ds[k]);
+    }
+    int lazy = 0;
+    for (int k = 0; k < num_operands; k++) {
+        int eager = k < num_eager;
+        if (TCL_OK != thtml_CAppendExpr_Value(interp, codearrVar_ptr, eager ? ds_ptr : &blocks_ds[k], parse_ptr,
+                                              operands[k], name, &operands_ds[k],
+                                              eager ? after_ds_ptr : &block_afters_ds[k],
+                                              kind == THTML_OP_TERNARY && k == 0 ? THTML_CTYPE_BOOL : operand_ctype)) {
+            thtml_CFreeOperands(num_operands, operands_ds, blocks_ds, block_afters_ds);
+            return TCL_ERROR;
+        }
+        if (!eager && (Tcl_DStringLength(&blocks_ds[k]) > 0 || Tcl_DStringLength(&block_afters_ds[k]) > 0)) {
+            lazy = 1;
+        }
+    }
 
-            Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-            Tcl_DStringFree(&operator_ds);
+    int op_count = thtml_NextCount(interp, codearrVar_ptr, "op_count");
+    char varname[64];
+    snprintf(varname, 64, "__%s_op%d__", name, op_count);
 
-            Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
-            Tcl_DStringAppend(ds_ptr, varname, -1);
-            Tcl_DStringAppend(ds_ptr, ");", -1);
+    // operands that are plain C expressions are left to the short-circuit of the C operators
+    if (lazy && kind == THTML_OP_LOGIC) {
+        // int __flag1_op3__ = __flag1_bool1__;
+        // if (__flag1_op3__) { ... __flag1_op3__ = ...; ... }
+        Tcl_DStringAppend(ds_ptr, "\nint ", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, " = ", -1);
+        Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operands_ds[0]), Tcl_DStringLength(&operands_ds[0]));
+        Tcl_DStringAppend(ds_ptr, ";", -1);
+        Tcl_DStringAppend(ds_ptr, instr[0] == 'a' ? "\nif (" : "\nif (!", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, ") {", -1);
+        thtml_CAppendExpr_Block(ds_ptr, varname, THTML_CTYPE_BOOL, &operands_ds[1], &blocks_ds[1],
+                                &block_afters_ds[1]);
+        Tcl_DStringAppend(ds_ptr, "\n}", -1);
 
-            Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
+        Tcl_DStringAppend(expr_ds_ptr, varname, -1);
+        *ctype_ptr = THTML_CTYPE_BOOL;
+        thtml_CFreeOperands(num_operands, operands_ds, blocks_ds, block_afters_ds);
+        return TCL_OK;
+    }
+    if (lazy && kind == THTML_OP_TERNARY) {
+        // Tcl_Obj *__val1_op3__;
+        // if (__val1_bool1__) { ... } else { ... }
+        Tcl_DStringAppend(ds_ptr, ctype == THTML_CTYPE_OBJ ? "\nTcl_Obj *" : ctype == THTML_CTYPE_NUM ? "\n__thtml_num_t "
+                                                                                                   : "\nint ", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, ";", -1);
+        Tcl_DStringAppend(ds_ptr, "\nif (", -1);
+        Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operands_ds[0]), Tcl_DStringLength(&operands_ds[0]));
+        Tcl_DStringAppend(ds_ptr, ") {", -1);
+        thtml_CAppendExpr_Block(ds_ptr, varname, ctype, &operands_ds[1], &blocks_ds[1], &block_afters_ds[1]);
+        Tcl_DStringAppend(ds_ptr, "\n} else {", -1);
+        thtml_CAppendExpr_Block(ds_ptr, varname, ctype, &operands_ds[2], &blocks_ds[2], &block_afters_ds[2]);
+        Tcl_DStringAppend(ds_ptr, "\n}", -1);
 
+        if (ctype == THTML_CTYPE_OBJ) {
             Tcl_DStringAppend(after_ds_ptr, "\nTcl_DecrRefCount(", -1);
             Tcl_DStringAppend(after_ds_ptr, varname, -1);
             Tcl_DStringAppend(after_ds_ptr, ");", -1);
-        } else if ((ch1 == 'e' && ch2 == 'q') || (ch1 == 'n' && ch2 == 'e') ||
-                   (ch1 == 'i' && ch2 == 'n') || (ch1 == 'n' && ch2 == 'i')) {
-            // two operands
-            op_count++;
-            char op_count_str[12];
-            snprintf(op_count_str, 12, "%d", op_count);
-
-            char varname[64];
-            snprintf(varname, 64, "__%s_op%s__", name, op_count_str);
-
-            Tcl_DString operator_ds;
-            Tcl_DStringInit(&operator_ds);
-
-            Tcl_Token *first_operand = &parse_ptr->tokenPtr[operands_offset];
-            Tcl_Token *second_operand = &parse_ptr->tokenPtr[operands_offset + first_operand->numComponents + 1];
-
-            Tcl_DStringAppend(&operator_ds, "\nTcl_Obj *", -1);
-            Tcl_DStringAppend(&operator_ds, varname, -1);
-            Tcl_DStringAppend(&operator_ds, " = ", -1);
-            Tcl_DStringAppend(&operator_ds, " __thtml_", -1);
-            Tcl_DStringAppend(&operator_ds, INSTR[(operator_token->start[0] << 8) + operator_token->start[1]], -1);
-            Tcl_DStringAppend(&operator_ds, "__(", -1);
-
-            if (TCL_OK !=
-                thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name, &operator_ds,
-                                        after_ds_ptr, 0)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ", ", -1);
-
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr,
-                                                  operands_offset + first_operand->numComponents + 1, name,
-                                                  &operator_ds, after_ds_ptr, 0)) {
-                Tcl_DStringFree(&operator_ds);
-                return TCL_ERROR;
-            }
-
-            Tcl_DStringAppend(&operator_ds, ");", -1);
-            Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&operator_ds), Tcl_DStringLength(&operator_ds));
-            Tcl_DStringFree(&operator_ds);
+        }
 
-            Tcl_DStringAppend(cmd_ds_ptr, varname, -1);
+        Tcl_DStringAppend(expr_ds_ptr, varname, -1);
+        *ctype_ptr = ctype;
+        thtml_CFreeOperands(num_operands, operands_ds, blocks_ds, block_afters_ds);
+        return TCL_OK;
+    }
 
-        } else {
-            SetResult("error parsing expression: unsupported operator");
-            return TCL_ERROR;
+    switch (kind) {
+        case THTML_OP_MATH: {
+            // __thtml_num_add__, __thtml_num_uminus__, ...
+            char helper[64];
+            snprintf(helper, 64, "__thtml_num_%s__", instr);
+            thtml_CAppendExpr_Checked(interp, codearrVar_ptr, ds_ptr, "__thtml_num_t", varname, helper, operands_ds,
+                                      num_operands);
+            Tcl_DStringAppend(expr_ds_ptr, varname, -1);
+            *ctype_ptr = THTML_CTYPE_NUM;
+            break;
         }
-    } else {
-        SetResult("error parsing expression: unsupported operator");
-        return TCL_ERROR;
+        case THTML_OP_UPLUS:
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[0]), Tcl_DStringLength(&operands_ds[0]));
+            *ctype_ptr = THTML_CTYPE_NUM;
+            break;
+        case THTML_OP_COMPARE:
+        case THTML_OP_STRCMP:
+            // (__thtml_num_compare__(__flag1_num1__, __thtml_num_int__(18)) >= 0)
+            Tcl_DStringAppend(expr_ds_ptr, kind == THTML_OP_COMPARE ? "(__thtml_num_compare__("
+                                                                     : "(__thtml_string_compare__(", -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[0]), Tcl_DStringLength(&operands_ds[0]));
+            Tcl_DStringAppend(expr_ds_ptr, ", ", -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[1]), Tcl_DStringLength(&operands_ds[1]));
+            Tcl_DStringAppend(expr_ds_ptr, ") ", -1);
+            Tcl_DStringAppend(expr_ds_ptr, c_op, -1);
+            Tcl_DStringAppend(expr_ds_ptr, " 0)", -1);
+            *ctype_ptr = THTML_CTYPE_BOOL;
+            break;
+        case THTML_OP_MEMBER:
+            thtml_CAppendExpr_Checked(interp, codearrVar_ptr, ds_ptr, "int", varname, "__thtml_list_contains__",
+                                      operands_ds, num_operands);
+            Tcl_DStringAppend(expr_ds_ptr, instr[0] == 'i' ? "" : "!", -1);
+            Tcl_DStringAppend(expr_ds_ptr, varname, -1);
+            *ctype_ptr = THTML_CTYPE_BOOL;
+            break;
+        case THTML_OP_LOGIC:
+            // (__flag1_bool1__ && (__thtml_num_compare__(...) > 0))
+            Tcl_DStringAppend(expr_ds_ptr, "(", -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[0]), Tcl_DStringLength(&operands_ds[0]));
+            Tcl_DStringAppend(expr_ds_ptr, c_op, -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[1]), Tcl_DStringLength(&operands_ds[1]));
+            Tcl_DStringAppend(expr_ds_ptr, ")", -1);
+            *ctype_ptr = THTML_CTYPE_BOOL;
+            break;
+        case THTML_OP_NOT:
+            Tcl_DStringAppend(expr_ds_ptr, "(!", -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[0]), Tcl_DStringLength(&operands_ds[0]));
+            Tcl_DStringAppend(expr_ds_ptr, ")", -1);
+            *ctype_ptr = THTML_CTYPE_BOOL;
+            break;
+        case THTML_OP_TERNARY:
+            // (__flag1_bool1__ ? __literals__[2] : __literals__[3])
+            Tcl_DStringAppend(expr_ds_ptr, "(", -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[0]), Tcl_DStringLength(&operands_ds[0]));
+            Tcl_DStringAppend(expr_ds_ptr, " ? ", -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[1]), Tcl_DStringLength(&operands_ds[1]));
+            Tcl_DStringAppend(expr_ds_ptr, " : ", -1);
+            Tcl_DStringAppend(expr_ds_ptr, Tcl_DStringValue(&operands_ds[2]), Tcl_DStringLength(&operands_ds[2]));
+            Tcl_DStringAppend(expr_ds_ptr, ")", -1);
+            *ctype_ptr = ctype;
+            break;
     }
 
+    thtml_CFreeOperands(num_operands, operands_ds, blocks_ds, block_afters_ds);
     return TCL_OK;
 }
 
@@ -1573,12 +1512,14 @@ thtml_CAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
         Tcl_DStringAppend(ds_ptr, name, -1);
         Tcl_DStringAppend(ds_ptr, "__, \"", -1);
         Tcl_DStringAppend(ds_ptr, token->start, token->size);
-        Tcl_DStringAppend(ds_ptr, "\", -1);", -1);
+        Tcl_DStringAppend(ds_ptr, "\", ", -1);
+        thtml_CAppendLength(ds_ptr, thtml_CLiteralLength(token->start, token->start + token->size));
+        Tcl_DStringAppend(ds_ptr, ");", -1);
         *out_i = i + 1;
         return TCL_OK;
     } else if (token->type == TCL_TOKEN_COMMAND) {
 
-        subcmd_count++;
+        int subcmd_count = thtml_NextCount(interp, codearrVar_ptr, "subcmd_count");
 
         char subcmd_name[64];
         snprintf(subcmd_name, 64, "%s_subcmd%d", name, subcmd_count);
@@ -1586,33 +1527,6 @@ thtml_CAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
         Tcl_DStringAppend(ds_ptr, "\n// SubCommand: ", -1);
         Tcl_DStringAppend(ds_ptr, token->start, token->size);
 
-        // Tcl_DString __ds_subcmd1_base__;
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DString __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "_base__;", -1);
-
-        // Tcl_DString * __ds_subcmd1__ = &__ds__subcmd1_base__;
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DString *__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ = &__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "_base__;", -1);
-
-        // Tcl_DStringInit(__ds_subcmd1__);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringInit(__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__);", -1);
-
-        // Tcl_DStringAppend(__ds_subcmd1__, "::thtml::runtime::tcl::evaluate_script", -1);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__, \"::thtml::runtime::tcl::evaluate_script\", -1);", -1);
-
-        // Tcl_DStringStartSublist(__ds_subcmd1__);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringStartSublist(__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__);", -1);
-
         Tcl_Parse subcmd_parse;
         if (TCL_OK != Tcl_ParseCommand(interp, token->start + 1, token->size - 2, 0, &subcmd_parse)) {
             return TCL_ERROR;
@@ -1620,49 +1534,10 @@ thtml_CAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
         int compiled_cmd;
         if (TCL_OK !=
             thtml_CCompileCommand(interp, codearrVar_ptr, ds_ptr, &subcmd_parse, subcmd_name, 1, &compiled_cmd)) {
+            Tcl_FreeParse(&subcmd_parse);
             return TCL_ERROR;
         }
-
-        // Tcl_DStringEndSublist(__ds__subcmd1__);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringEndSublist(__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__);", -1);
-
-        if (!compiled_cmd) {
-            // Tcl_Obj *__val3_cmd1__ = Tcl_DStringToObj(__ds_subcmd1__);
-            Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *__", -1);
-            Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__ = Tcl_DStringToObj(__ds_", -1);
-            Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__);", -1);
-
-            // Tcl_IncrRefCount(__val3_cmd1__);
-            Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(__", -1);
-            Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__);", -1);
-
-            thtml_CListAppendGC(interp, codearrVar_ptr, subcmd_name, "obj", "__");
-
-            // fprintf(stderr, "script: %s\n", Tcl_GetString(__val3_cmd1__));
-//            Tcl_DStringAppend(ds_ptr, "\nfprintf(stderr, \"script: %s\\n\", Tcl_GetString(__", -1);
-//            Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-//            Tcl_DStringAppend(ds_ptr, "__));", -1);
-
-
-            // if (TCL_OK != Tcl_EvalObjEx(__interp__, __val3_cmd1__, TCL_EVAL_DIRECT)) { return TCL_ERROR; }
-            Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != Tcl_EvalObjEx(__interp__, __", -1);
-            Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__, TCL_EVAL_DIRECT)) {", -1);
-            thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
-            Tcl_DStringAppend(ds_ptr, "\nSetResult(\"eval command failed in CAppendCommand_Token\"); return TCL_ERROR; }", -1);
-
-            // Tcl_DecrRefCount(__val3_cmd1__);
-            Tcl_DStringAppend(ds_ptr, "\nTcl_DecrRefCount(__", -1);
-            Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__);", -1);
-
-            thtml_CListRemoveGC(interp, codearrVar_ptr, subcmd_name, "__");
-        }
+        Tcl_FreeParse(&subcmd_parse);
 
         // Tcl_Obj *__val3_subcmd1__ = Tcl_GetObjResult(__interp__);
         Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *__", -1);
@@ -1683,12 +1558,12 @@ thtml_CAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
             Tcl_DStringAppend(cmd_ds_ptr, "_res__", -1);
         } else {
 
-            // Tcl_DStringAppend(__ds_val3__, Tcl_GetString(__val3_subcmd1__), -1);
-            Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_", -1);
+            // __thtml_append_obj__(__ds_val3__, __val3_subcmd1_res__);
+            Tcl_DStringAppend(ds_ptr, "\n__thtml_append_obj__(__ds_", -1);
             Tcl_DStringAppend(ds_ptr, name, -1);
-            Tcl_DStringAppend(ds_ptr, "__, Tcl_GetString(__", -1);
+            Tcl_DStringAppend(ds_ptr, "__, __", -1);
             Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "_res__), -1);", -1);
+            Tcl_DStringAppend(ds_ptr, "_res__);", -1);
         }
 
         // Tcl_DecrRefCount(__val3_subcmd1_res__);
@@ -1696,18 +1571,12 @@ thtml_CAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
         Tcl_DStringAppend(after_ds_ptr, subcmd_name, -1);
         Tcl_DStringAppend(after_ds_ptr, "_res__);", -1);
 
-        // Tcl_DStringFree(__ds_subcmd1__);
-        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringFree(__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__);", -1);
-
     } else if (token->type == TCL_TOKEN_EXPAND_WORD) {
         SetResult("error parsing expression: expand word not supported");
         return TCL_ERROR;
     } else if (token->type == TCL_TOKEN_WORD) {
 
-        static int word_token_count = 0;
-        word_token_count++;
+        int word_token_count = thtml_NextCount(interp, codearrVar_ptr, "word_token_count");
 
         char word_token_name[64];
         snprintf(word_token_name, 64, "wt%d", word_token_count);
@@ -1771,61 +1640,153 @@ thtml_CAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
 }
 
 static int
-thtml_CAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                        Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr, int flags) {
+thtml_CAppendCommand_Word(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                          Tcl_Size i, Tcl_Size word_index, const char *name, Tcl_DString *after_ds_ptr) {
     Tcl_Token *token = &parse_ptr->tokenPtr[i];
 
-    if (token->type == TCL_TOKEN_SUB_EXPR) {
-        Tcl_Token *next_token = &parse_ptr->tokenPtr[i + 1];
-        Tcl_DStringAppend(expr_ds_ptr, "(", 1);
-        if (next_token->type == TCL_TOKEN_OPERATOR) {
-            // If the first sub-token after the TCL_TOKEN_SUB_EXPR token is a TCL_TOKEN_OPERATOR token,
-            // the subexpression consists of an operator and its token operands.
-            if (TCL_OK != thtml_CAppendExpr_Operator(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, expr_ds_ptr,
-                                                     after_ds_ptr, flags)) {
-                return TCL_ERROR;
-            }
-        } else if (next_token->type == TCL_TOKEN_TEXT) {
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i + 1, name, expr_ds_ptr,
-                                                  after_ds_ptr, flags)) {
-                return TCL_ERROR;
-            }
-        } else {
-            // Otherwise, the subexpression is a value described by one of the token types TCL_TOKEN_WORD,
-            // TCL_TOKEN_BS, TCL_TOKEN_COMMAND, TCL_TOKEN_VARIABLE, and TCL_TOKEN_SUB_EXPR.
-            if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i + 1, name, expr_ds_ptr,
-                                                  after_ds_ptr, flags)) {
+    char slot_name[96];
+    snprintf(slot_name, 96, "__%s_objv__[%" TCL_SIZE_MODIFIER "d]", name, word_index);
+
+    Tcl_DString slot_ds;
+    Tcl_DStringInit(&slot_ds);
+
+    char word_name[64];
+    int word_ds_p = 0;
+
+    if (token->type == TCL_TOKEN_SIMPLE_WORD) {
+        Tcl_Token *text_token = &parse_ptr->tokenPtr[i + 1];
+        assert(text_token->type == TCL_TOKEN_TEXT);
+
+        // __literals__[0], a shared object that keeps the resolved command or parsed value across renders
+        if (TCL_OK != thtml_CAppendLiteral(interp, codearrVar_ptr, &slot_ds, text_token->start, text_token->size)) {
+            Tcl_DStringFree(&slot_ds);
+            return TCL_ERROR;
+        }
+    } else if (token->type == TCL_TOKEN_WORD && token->numComponents == 2 &&
+               parse_ptr->tokenPtr[i + 1].type == TCL_TOKEN_VARIABLE) {
+        // the word is just a variable e.g. $b or $item.name, pass the object as is
+        if (TCL_OK != thtml_CAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i + 1, name, &slot_ds, 0)) {
+            Tcl_DStringFree(&slot_ds);
+            return TCL_ERROR;
+        }
+    } else if (token->type == TCL_TOKEN_WORD && token->numComponents == 1 &&
+               parse_ptr->tokenPtr[i + 1].type == TCL_TOKEN_COMMAND) {
+        // the word is just a command substitution, pass its result as is
+        Tcl_Size out_i;
+        if (TCL_OK != thtml_CAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i + 1, &out_i, name,
+                                                 &slot_ds, after_ds_ptr, 0)) {
+            Tcl_DStringFree(&slot_ds);
+            return TCL_ERROR;
+        }
+    } else if (token->type == TCL_TOKEN_WORD) {
+        // a word made of several parts e.g. "hi $name", concatenate them into a new object
+        word_ds_p = 1;
+        snprintf(word_name, 64, "%s_word%" TCL_SIZE_MODIFIER "d", name, word_index);
+
+        // Tcl_DString __ds_cmd1_word1_base__;
+        Tcl_DStringAppend(ds_ptr, "\nTcl_DString __ds_", -1);
+        Tcl_DStringAppend(ds_ptr, word_name, -1);
+        Tcl_DStringAppend(ds_ptr, "_base__;", -1);
+
+        // Tcl_DString *__ds_cmd1_word1__ = &__ds_cmd1_word1_base__;
+        Tcl_DStringAppend(ds_ptr, "\nTcl_DString *__ds_", -1);
+        Tcl_DStringAppend(ds_ptr, word_name, -1);
+        Tcl_DStringAppend(ds_ptr, "__ = &__ds_", -1);
+        Tcl_DStringAppend(ds_ptr, word_name, -1);
+        Tcl_DStringAppend(ds_ptr, "_base__;", -1);
+
+        // Tcl_DStringInit(__ds_cmd1_word1__);
+        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringInit(__ds_", -1);
+        Tcl_DStringAppend(ds_ptr, word_name, -1);
+        Tcl_DStringAppend(ds_ptr, "__);", -1);
+
+        thtml_CListAppendGC(interp, codearrVar_ptr, word_name, "dstring", "__ds_");
+
+        Tcl_Size j = i + 1;
+        Tcl_Size end = i + 1 + token->numComponents;
+        while (j < end) {
+            if (TCL_OK != thtml_CAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, j, &j, word_name,
+                                                     NULL, after_ds_ptr, 0)) {
+                Tcl_DStringFree(&slot_ds);
                 return TCL_ERROR;
             }
         }
-        Tcl_DStringAppend(expr_ds_ptr, ")", 1);
+
+        // Tcl_NewStringObj(Tcl_DStringValue(__ds_cmd1_word1__), Tcl_DStringLength(__ds_cmd1_word1__))
+        Tcl_DStringAppend(&slot_ds, "Tcl_NewStringObj(Tcl_DStringValue(__ds_", -1);
+        Tcl_DStringAppend(&slot_ds, word_name, -1);
+        Tcl_DStringAppend(&slot_ds, "__), Tcl_DStringLength(__ds_", -1);
+        Tcl_DStringAppend(&slot_ds, word_name, -1);
+        Tcl_DStringAppend(&slot_ds, "__))", -1);
+    } else if (token->type == TCL_TOKEN_EXPAND_WORD) {
+        Tcl_DStringFree(&slot_ds);
+        SetResult("error parsing command: expand word not supported");
+        return TCL_ERROR;
+    } else {
+        Tcl_DStringFree(&slot_ds);
+        SetResult("error parsing command: unsupported word type");
+        return TCL_ERROR;
+    }
+
+    // __cmd1_objv__[1] = b;
+    Tcl_DStringAppend(ds_ptr, "\n", -1);
+    Tcl_DStringAppend(ds_ptr, slot_name, -1);
+    Tcl_DStringAppend(ds_ptr, " = ", -1);
+    Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&slot_ds), Tcl_DStringLength(&slot_ds));
+    Tcl_DStringAppend(ds_ptr, ";", -1);
+    Tcl_DStringFree(&slot_ds);
+
+    // Tcl_IncrRefCount(__cmd1_objv__[1]);
+    Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
+    Tcl_DStringAppend(ds_ptr, slot_name, -1);
+    Tcl_DStringAppend(ds_ptr, ");", -1);
+
+    thtml_CListAppendGC(interp, codearrVar_ptr, slot_name, "obj", NULL);
+
+    if (word_ds_p) {
+        // Tcl_DStringFree(__ds_cmd1_word1__);
+        Tcl_DStringAppend(ds_ptr, "\nTcl_DStringFree(__ds_", -1);
+        Tcl_DStringAppend(ds_ptr, word_name, -1);
+        Tcl_DStringAppend(ds_ptr, "__);", -1);
+
+        thtml_CListRemoveGC(interp, codearrVar_ptr, word_name, "__ds_");
+    }
+
+    return TCL_OK;
+}
+
+static int
+thtml_CAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                        Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr, int flags) {
+    Tcl_Token *token = &parse_ptr->tokenPtr[i];
+
+    if (token->type == TCL_TOKEN_SUB_EXPR) {
+        return thtml_CAppendExpr_Value(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, expr_ds_ptr, after_ds_ptr,
+                                       THTML_CTYPE_OBJ);
     } else if (token->type == TCL_TOKEN_VARIABLE) {
         return thtml_CAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, "default", expr_ds_ptr, flags);
     } else if (token->type == TCL_TOKEN_TEXT) {
-        count_text_subst++;
+        int count_text_subst = thtml_NextCount(interp, codearrVar_ptr, "count_text_subst");
         char count_text_subst_str[12];
         snprintf(count_text_subst_str, 12, "%d", count_text_subst);
 
         char varname[64];
         snprintf(varname, 64, "__%s_text%s__", name, count_text_subst_str);
 
+        // Tcl_Obj *__flag1_text1__ = __literals__[2];
         Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *", -1);
         Tcl_DStringAppend(ds_ptr, varname, -1);
-        Tcl_DStringAppend(ds_ptr, " = Tcl_NewStringObj(\"", -1);
-        Tcl_DStringAppend(ds_ptr, token->start, token->size);
-        Tcl_DStringAppend(ds_ptr, "\", -1);", -1);
+        Tcl_DStringAppend(ds_ptr, " = ", -1);
+        if (TCL_OK != thtml_CAppendLiteral(interp, codearrVar_ptr, ds_ptr, token->start, token->size)) {
+            return TCL_ERROR;
+        }
+        Tcl_DStringAppend(ds_ptr, ";", -1);
 
         // incr ref count
         Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(", -1);
         Tcl_DStringAppend(ds_ptr, varname, -1);
         Tcl_DStringAppend(ds_ptr, ");", -1);
 
-        if (flags & THTML_NUMBER) {
-            thtml_CAppendCheck_Number(interp, codearrVar_ptr, ds_ptr, varname);
-        } else if (flags & THTML_BOOL) {
-            thtml_CAppendCheck_Bool(interp, codearrVar_ptr, ds_ptr, varname);
-        }
-
         // add to expression
         Tcl_DStringAppend(expr_ds_ptr, varname, -1);
 
@@ -1860,8 +1821,63 @@ thtml_CAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
     return TCL_OK;
 }
 
-int thtml_CCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                       const char *name) {
+// appends the value of the (sub)expression at token "i" as a C value of type "ctype", one of
+// THTML_CTYPE_*, the operators take their operands as the C type they work on
+static int
+thtml_CAppendExpr_Value(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                        Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr, Tcl_DString *after_ds_ptr, int ctype) {
+    Tcl_Token *token = &parse_ptr->tokenPtr[i];
+
+    if (token->type == TCL_TOKEN_SUB_EXPR || (token->type == TCL_TOKEN_WORD && token->numComponents == 1)) {
+        if (parse_ptr->tokenPtr[i + 1].type != TCL_TOKEN_OPERATOR) {
+            // a value described by one of the token types TCL_TOKEN_WORD, TCL_TOKEN_TEXT, TCL_TOKEN_BS,
+            // TCL_TOKEN_COMMAND, TCL_TOKEN_VARIABLE, and TCL_TOKEN_SUB_EXPR
+            return thtml_CAppendExpr_Value(interp, codearrVar_ptr, ds_ptr, parse_ptr, i + 1, name, expr_ds_ptr,
+                                           after_ds_ptr, ctype);
+        }
+
+        // If the first sub-token after the TCL_TOKEN_SUB_EXPR token is a TCL_TOKEN_OPERATOR token,
+        // the subexpression consists of an operator and its token operands.
+        Tcl_DString value_ds;
+        Tcl_DStringInit(&value_ds);
+        int value_ctype;
+        if (TCL_OK != thtml_CAppendExpr_Operator(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, &value_ds,
+                                                 after_ds_ptr, ctype, &value_ctype)) {
+            Tcl_DStringFree(&value_ds);
+            return TCL_ERROR;
+        }
+        thtml_CAppendExpr_Convert(interp, codearrVar_ptr, ds_ptr, name, Tcl_DStringValue(&value_ds), value_ctype,
+                                  ctype, expr_ds_ptr, after_ds_ptr);
+        Tcl_DStringFree(&value_ds);
+        return TCL_OK;
+    }
+
+    Tcl_DString value_ds;
+    Tcl_DStringInit(&value_ds);
+    if (token->type == TCL_TOKEN_TEXT) {
+        if (thtml_CAppendExpr_Constant(token->start, token->size, ctype, expr_ds_ptr)) {
+            Tcl_DStringFree(&value_ds);
+            return TCL_OK;
+        }
+        // __literals__[2]
+        if (TCL_OK != thtml_CAppendLiteral(interp, codearrVar_ptr, &value_ds, token->start, token->size)) {
+            Tcl_DStringFree(&value_ds);
+            return TCL_ERROR;
+        }
+    } else if (TCL_OK != thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, &value_ds,
+                                                 after_ds_ptr, 0)) {
+        Tcl_DStringFree(&value_ds);
+        return TCL_ERROR;
+    }
+    thtml_CAppendExpr_Convert(interp, codearrVar_ptr, ds_ptr, name, Tcl_DStringValue(&value_ds), THTML_CTYPE_OBJ,
+                              ctype, expr_ds_ptr, after_ds_ptr);
+    Tcl_DStringFree(&value_ds);
+    return TCL_OK;
+}
+
+// Tcl_Obj *__flag1__ = ...; or int __flag1__ = ...; followed by the release of the temporary objects
+static int thtml_CCompileTypedExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                                   const char *name, int ctype) {
     // After Tcl_ParseExpr returns, the first token pointed to by the tokenPtr field of the Tcl_Parse structure
     // always has type TCL_TOKEN_SUB_EXPR. It is followed by the sub-tokens that must be evaluated to produce
     // the value of the expression. Only the token information in the Tcl_Parse structure is modified:
@@ -1869,7 +1885,7 @@ int thtml_CCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
 
     Tcl_DString expr_ds;
     Tcl_DStringInit(&expr_ds);
-    Tcl_DStringAppend(&expr_ds, "\nTcl_Obj *__", -1);
+    Tcl_DStringAppend(&expr_ds, ctype == THTML_CTYPE_OBJ ? "\nTcl_Obj *__" : "\nint __", -1);
     Tcl_DStringAppend(&expr_ds, name, -1);
     Tcl_DStringAppend(&expr_ds, "__ = ", -1);
 
@@ -1877,7 +1893,7 @@ int thtml_CCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
     Tcl_DStringInit(&after_ds);
 
     if (TCL_OK !=
-        thtml_CAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, 0, name, &expr_ds, &after_ds, 0)) {
+        thtml_CAppendExpr_Value(interp, codearrVar_ptr, ds_ptr, parse_ptr, 0, name, &expr_ds, &after_ds, ctype)) {
         Tcl_DStringFree(&expr_ds);
         Tcl_DStringFree(&after_ds);
         return TCL_ERROR;
@@ -1887,9 +1903,11 @@ int thtml_CCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
     Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&expr_ds), Tcl_DStringLength(&expr_ds));
     Tcl_DStringFree(&expr_ds);
 
-    Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(__", -1);
-    Tcl_DStringAppend(ds_ptr, name, -1);
-    Tcl_DStringAppend(ds_ptr, "__);", -1);
+    if (ctype == THTML_CTYPE_OBJ) {
+        Tcl_DStringAppend(ds_ptr, "\nTcl_IncrRefCount(__", -1);
+        Tcl_DStringAppend(ds_ptr, name, -1);
+        Tcl_DStringAppend(ds_ptr, "__);", -1);
+    }
 
     Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&after_ds), Tcl_DStringLength(&after_ds));
     Tcl_DStringFree(&after_ds);
@@ -1897,6 +1915,17 @@ int thtml_CCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
     return TCL_OK;
 }
 
+int thtml_CCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                       const char *name) {
+    return thtml_CCompileTypedExpr(interp, codearrVar_ptr, ds_ptr, parse_ptr, name, THTML_CTYPE_OBJ);
+}
+
+// the expression as a C int, for the conditions of if statements
+int thtml_CCompileCondition(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                            const char *name) {
+    return thtml_CCompileTypedExpr(interp, codearrVar_ptr, ds_ptr, parse_ptr, name, THTML_CTYPE_BOOL);
+}
+
 int
 thtml_CCompileQuotedString(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
                            const char *name) {
@@ -1924,9 +1953,12 @@ thtml_CCompileQuotedString(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
 }
 
 int
-thtml_CCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr) {
+thtml_CCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                           int escape) {
     for (int i = 0; i < parse_ptr->numTokens; i++) {
         Tcl_Token *token = &parse_ptr->tokenPtr[i];
+        // a value that starts a url attribute decides its scheme
+        int value_escape = escape == THTML_ESCAPE_URL && i == 0 ? THTML_ESCAPE_URL_START : escape;
         if (token->type == TCL_TOKEN_TEXT) {
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
         } else if (token->type == TCL_TOKEN_BS) {
@@ -1934,13 +1966,23 @@ thtml_CCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
         } else if (token->type == TCL_TOKEN_COMMAND) {
 
-            template_cmd_count++;
+            int template_cmd_count = thtml_NextCount(interp, codearrVar_ptr, "template_cmd_count");
 
             char cmd_name[64];
             snprintf(cmd_name, 64, "cmd%d", template_cmd_count);
 
+            // [!cmd ...] opts out of escaping the result of the command, as ${!x} does for variables
+            const char *cmd_start = token->start + 1;
+            Tcl_Size cmd_size = token->size - 2;
+            int cmd_escape = value_escape;
+            if (cmd_size > 0 && *cmd_start == '!') {
+                cmd_escape = THTML_ESCAPE_NONE;
+                cmd_start++;
+                cmd_size--;
+            }
+
             Tcl_Parse cmd_parse;
-            if (TCL_OK != Tcl_ParseCommand(interp, token->start + 1, token->size - 2, 0, &cmd_parse)) {
+            if (TCL_OK != Tcl_ParseCommand(interp, cmd_start, cmd_size, 0, &cmd_parse)) {
                 Tcl_FreeParse(&cmd_parse);
                 return TCL_ERROR;
             }
@@ -1958,39 +2000,9 @@ thtml_CCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
 
             Tcl_DStringAppend(ds_ptr, "\x03", -1);
 
-            if (!compiled_cmd) {
-                // Tcl_DString __ds_cmd1_base__;
-                Tcl_DStringAppend(ds_ptr, "\nTcl_DString __ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "_base__", -1);
-
-                // Tcl_DString *__ds_cmd1__ = &__ds_cmd1_base__;
-                Tcl_DStringAppend(ds_ptr, ";\nTcl_DString *__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__ = &__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "_base__;", -1);
-
-                // Tcl_DStringInit(__ds_cmd1__);
-                Tcl_DStringAppend(ds_ptr, "\nTcl_DStringInit(__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__);", -1);
-            }
-
             Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&cmd_ds), Tcl_DStringLength(&cmd_ds));
             Tcl_DStringFree(&cmd_ds);
 
-            if (!compiled_cmd) {
-                // if (TCL_OK != Tcl_EvalObjEx(interp, Tcl_DStringToObj(__ds_cmd1__), TCL_EVAL_DIRECT)) { return TCL_ERROR; }
-                Tcl_DStringAppend(ds_ptr,
-                                  "\nif (TCL_OK != Tcl_EvalObjEx(__interp__, Tcl_DStringToObj(__ds_",
-                                  -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__), TCL_EVAL_DIRECT)) {", -1);
-                thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
-                Tcl_DStringAppend(ds_ptr, "\nSetResult(\"eval command failed in CCompileTemplateText\"); return TCL_ERROR; }", -1);
-            }
-
             // Tcl_Obj *__cmd1__ = Tcl_GetObjResult(__interp__);
             Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *__", -1);
             Tcl_DStringAppend(ds_ptr, cmd_name, -1);
@@ -2004,29 +2016,23 @@ thtml_CCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStr
             // Tcl_ResetResult(__interp__);
             Tcl_DStringAppend(ds_ptr, "\nTcl_ResetResult(__interp__);", -1);
 
-            // Tcl_DStringAppend(__ds_default__, Tcl_GetString(__cmd1__), -1);
-            Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_default__, Tcl_GetString(__", -1);
-            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "_res__), -1);", -1);
+            // __thtml_append_escaped_obj__(__ds_default__, __cmd1_res__, THTML_ESCAPE_TEXT);
+            char cmd_res_name[80];
+            snprintf(cmd_res_name, 80, "__%s_res__", cmd_name);
+            thtml_CAppendOutput(ds_ptr, "default", cmd_res_name, -1, THTML_ESCAPE_FLAGS(cmd_escape));
 
             // Tcl_DecrRefCount(__cmd1__);
             Tcl_DStringAppend(ds_ptr, "\nTcl_DecrRefCount(__", -1);
             Tcl_DStringAppend(ds_ptr, cmd_name, -1);
             Tcl_DStringAppend(ds_ptr, "_res__);", -1);
 
-            if (!compiled_cmd) {
-                // Tcl_DStringFree(__ds_cmd1__);
-                Tcl_DStringAppend(ds_ptr, "\nTcl_DStringFree(__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__);", -1);
-            }
-
             Tcl_DStringAppend(ds_ptr, "\x02", -1);
 
             Tcl_FreeParse(&cmd_parse);
         } else if (token->type == TCL_TOKEN_VARIABLE) {
             Tcl_DStringAppend(ds_ptr, "\x03", -1);
-            if (TCL_OK != thtml_CAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, "default", NULL, 0)) {
+            if (TCL_OK != thtml_CAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, "default", NULL,
+                                                THTML_ESCAPE_FLAGS(value_escape))) {
                 return TCL_ERROR;
             }
             Tcl_DStringAppend(ds_ptr, "\n\x02", -1);
@@ -2072,59 +2078,53 @@ int thtml_CCompileExprCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_D
     return TCL_OK;
 }
 
-int
-thtml_CCompileGenericCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                             const char *name) {
-    // print all tokens
-//    for (int i = 0; i < parse_ptr->numTokens; i++) {
-//        Tcl_Token *token = &parse_ptr->tokenPtr[i];
-//        fprintf(stderr, "lindex: token %d: type: %d - token: %.*s - numComponents: %d\n", i, token->type,
-//                token->size, token->start, token->numComponents);
-//    }
-
-    if (parse_ptr->tokenPtr[2].numComponents != 2) {
-        SetResult("error parsing expression: lindex requires two arguments");
-        return TCL_ERROR;
-    }
-
-    Tcl_Token *token = &parse_ptr->tokenPtr[0];
-
-    Tcl_DString cmd_ds;
-    Tcl_DStringInit(&cmd_ds);
-    Tcl_DStringAppend(&cmd_ds, "\nif (TCL_OK != __thtml_", -1);
-    Tcl_DStringAppend(&cmd_ds, token->start, token->size);
-    Tcl_DStringAppend(&cmd_ds, "_", -1);
-    Tcl_DStringAppend(&cmd_ds, Tcl_GetString(Tcl_NewIntObj(parse_ptr->tokenPtr[2].numComponents)), -1);
-    Tcl_DStringAppend(&cmd_ds, "(__interp__, ", -1);
+typedef struct {
+    const char *name;
+    const char *subcommand;
+    Tcl_Size min_words;
+    Tcl_Size max_words;
+    const char *function;
+} thtml_CNativeCommand;
+
+// commands with a C implementation in thtml.h, words include the command (and subcommand) name,
+// a max_words of -1 means there is no upper bound
+static const thtml_CNativeCommand thtml_CNativeCommands[] = {
+        {"lindex",  NULL,      3, 3,  "__thtml_lindex__"},
+        {"lrange",  NULL,      4, 4,  "__thtml_lrange__"},
+        {"llength", NULL,      2, 2,  "__thtml_llength__"},
+        {"string",  "index",   4, 4,  "__thtml_string_index__"},
+        {"string",  "length",  3, 3,  "__thtml_string_length__"},
+        {"string",  "toupper", 3, 3,  "__thtml_string_toupper__"},
+        {"dict",    "get",     4, -1, "__thtml_dict_get__"},
+        {NULL,      NULL,      0, 0,  NULL}
+};
 
-    Tcl_DString after_ds;
-    Tcl_DStringInit(&after_ds);
+static int thtml_CTokenEquals(Tcl_Token *token, const char *str) {
+    return token->type == TCL_TOKEN_SIMPLE_WORD && (size_t) token->size == strlen(str)
+           && 0 == strncmp(token->start, str, token->size);
+}
 
-    int in_eval_p = 0;
-    Tcl_Size i = 2;
-    int first = 1;
-    while (i < parse_ptr->numTokens) {
-        if (!first) {
-            Tcl_DStringAppend(&cmd_ds, ", ", -1);
+// returns the C function for the command, or NULL if it has to be evaluated
+static const char *thtml_CFindNativeCommand(Tcl_Parse *parse_ptr) {
+    Tcl_Size num_words = parse_ptr->numWords;
+    if (num_words < 2) {
+        return NULL;
+    }
+    Tcl_Token *name_token = &parse_ptr->tokenPtr[0];
+    Tcl_Token *subcommand_token = &parse_ptr->tokenPtr[name_token->numComponents + 1];
+    for (const thtml_CNativeCommand *command = thtml_CNativeCommands; command->name != NULL; command++) {
+        if (!thtml_CTokenEquals(name_token, command->name)) {
+            continue;
         }
-        if (TCL_OK !=
-            thtml_CAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, &i, name, &cmd_ds, &after_ds, in_eval_p)) {
-            fprintf(stderr, "thtml_CAppendCommand_Token failed\n");
-            return TCL_ERROR;
+        if (command->subcommand != NULL && !thtml_CTokenEquals(subcommand_token, command->subcommand)) {
+            continue;
+        }
+        if (num_words < command->min_words || (command->max_words != -1 && num_words > command->max_words)) {
+            return NULL;
         }
-        first = 0;
+        return command->function;
     }
-    Tcl_DStringAppend(&cmd_ds, ")) {", -1);
-    thtml_CGarbageCollection(interp, codearrVar_ptr, &cmd_ds);
-    Tcl_DStringAppend(&cmd_ds, "\nSetResult(\"failure in CCompileGenericCommand\"); return TCL_ERROR; }", -1);
-
-    Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&cmd_ds), Tcl_DStringLength(&cmd_ds));
-    Tcl_DStringFree(&cmd_ds);
-
-    Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&after_ds), Tcl_DStringLength(&after_ds));
-    Tcl_DStringFree(&after_ds);
-
-    return TCL_OK;
+    return NULL;
 }
 
 int thtml_CCompileCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
@@ -2140,41 +2140,66 @@ int thtml_CCompileCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStri
             }
             *compiled_command = 1;
             return TCL_OK;
-//        } else if (token->size == 6 && 0 == strncmp(token->start, "lindex", 6)) {
-//            if (TCL_OK != thtml_CCompileGenericCommand(interp, codearrVar_ptr, ds_ptr, parse_ptr, name)) {
-//                return TCL_ERROR;
-//            }
-//            *compiled_command = 1;
-//            return TCL_OK;
         }
     }
 
+    // commands in the native table are called directly, anything else goes through
+    // the evaluator, either way with a pre-resolved argv so it is not string-parsed on every render
+    const char *function = thtml_CFindNativeCommand(parse_ptr);
+    Tcl_Size num_words = parse_ptr->numWords;
+    char num_words_str[24];
+    snprintf(num_words_str, 24, "%" TCL_SIZE_MODIFIER "d", num_words);
+
+    Tcl_DStringAppend(ds_ptr, "\n// Command: ", -1);
+    Tcl_DStringAppend(ds_ptr, parse_ptr->commandStart, parse_ptr->commandSize);
+
+    // Tcl_Obj *__cmd1_objv__[3];
+    Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *__", -1);
+    Tcl_DStringAppend(ds_ptr, name, -1);
+    Tcl_DStringAppend(ds_ptr, "_objv__[", -1);
+    Tcl_DStringAppend(ds_ptr, num_words_str, -1);
+    Tcl_DStringAppend(ds_ptr, "];", -1);
+
     Tcl_DString after_ds;
     Tcl_DStringInit(&after_ds);
 
-    int in_eval_p = 1;  // it is not a compiled command, so we are in eval
     Tcl_Size i = 0;
-    int first = 1;
-    while (i < parse_ptr->numTokens) {
-        if (!first) {
-            Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_", -1);
-            Tcl_DStringAppend(ds_ptr, name, -1);
-            Tcl_DStringAppend(ds_ptr, "__, \" \", -1);", -1);
-        }
-
-        if (TCL_OK !=
-            thtml_CAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, &i, name, NULL, &after_ds, in_eval_p)) {
-            fprintf(stderr, "thtml_CAppendCommand_Token failed\n");
+    for (Tcl_Size word_index = 0; word_index < num_words; word_index++) {
+        if (TCL_OK != thtml_CAppendCommand_Word(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, word_index, name,
+                                                &after_ds)) {
+            Tcl_DStringFree(&after_ds);
             return TCL_ERROR;
         }
+        i += parse_ptr->tokenPtr[i].numComponents + 1;
+    }
+
+    // if (TCL_OK != __thtml_eval_objv__(__interp__, 3, __cmd1_objv__)) { return TCL_ERROR; }
+    Tcl_DStringAppend(ds_ptr, "\nif (TCL_OK != ", -1);
+    Tcl_DStringAppend(ds_ptr, function != NULL ? function : "__thtml_eval_objv__", -1);
+    Tcl_DStringAppend(ds_ptr, "(__interp__, ", -1);
+    Tcl_DStringAppend(ds_ptr, num_words_str, -1);
+    Tcl_DStringAppend(ds_ptr, ", __", -1);
+    Tcl_DStringAppend(ds_ptr, name, -1);
+    Tcl_DStringAppend(ds_ptr, "_objv__)) {", -1);
+    thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
+    Tcl_DStringAppend(ds_ptr, "\nreturn TCL_ERROR; }", -1);
+
+    for (Tcl_Size word_index = 0; word_index < num_words; word_index++) {
+        char slot_name[96];
+        snprintf(slot_name, 96, "__%s_objv__[%" TCL_SIZE_MODIFIER "d]", name, word_index);
 
-        first = 0;
+        // Tcl_DecrRefCount(__cmd1_objv__[0]);
+        Tcl_DStringAppend(ds_ptr, "\nTcl_DecrRefCount(", -1);
+        Tcl_DStringAppend(ds_ptr, slot_name, -1);
+        Tcl_DStringAppend(ds_ptr, ");", -1);
+
+        thtml_CListRemoveGC(interp, codearrVar_ptr, slot_name, NULL);
     }
 
     Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&after_ds), Tcl_DStringLength(&after_ds));
     Tcl_DStringFree(&after_ds);
 
-    *compiled_command = 0;
+    *compiled_command = function != NULL;
     return TCL_OK;
 }
 
@@ -2200,12 +2225,14 @@ thtml_CCompileForeachList(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStri
             Tcl_DStringAppend(ds_ptr, name, -1);
             Tcl_DStringAppend(ds_ptr, "__, \"", -1);
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
-            Tcl_DStringAppend(ds_ptr, "\", -1);", -1);
+            Tcl_DStringAppend(ds_ptr, "\", ", -1);
+            thtml_CAppendLength(ds_ptr, thtml_CLiteralLength(token->start, token->start + token->size));
+            Tcl_DStringAppend(ds_ptr, ");", -1);
         } else if (token->type == TCL_TOKEN_BS) {
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
         } else if (token->type == TCL_TOKEN_COMMAND) {
 
-            foreach_cmd_count++;
+            int foreach_cmd_count = thtml_NextCount(interp, codearrVar_ptr, "foreach_cmd_count");
 
             char cmd_name[64];
             snprintf(cmd_name, 64, "forcmd%d", foreach_cmd_count);
@@ -2229,39 +2256,9 @@ thtml_CCompileForeachList(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStri
 
 //            Tcl_DStringAppend(ds_ptr, "\x03", -1);
 
-            if (!compiled_cmd) {
-                // Tcl_DString __ds_cmd1_base__;
-                Tcl_DStringAppend(ds_ptr, "\nTcl_DString __ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "_base__", -1);
-
-                // Tcl_DString *__ds_cmd1__ = &__ds_cmd1_base__;
-                Tcl_DStringAppend(ds_ptr, ";\nTcl_DString *__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__ = &__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "_base__;", -1);
-
-                // Tcl_DStringInit(__ds_cmd1__);
-                Tcl_DStringAppend(ds_ptr, "\nTcl_DStringInit(__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__);", -1);
-            }
-
             Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&cmd_ds), Tcl_DStringLength(&cmd_ds));
             Tcl_DStringFree(&cmd_ds);
 
-            if (!compiled_cmd) {
-                // if (TCL_OK != Tcl_EvalObjEx(interp, Tcl_DStringToObj(__ds_cmd1__), TCL_EVAL_DIRECT)) { return TCL_ERROR; }
-                Tcl_DStringAppend(ds_ptr,
-                                  "\nif (TCL_OK != Tcl_EvalObjEx(__interp__, Tcl_DStringToObj(__ds_",
-                                  -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__), TCL_EVAL_DIRECT)) {", -1);
-                thtml_CGarbageCollection(interp, codearrVar_ptr, ds_ptr);
-                Tcl_DStringAppend(ds_ptr, "\nSetResult(\"eval failed in CCompileForeachList\"); return TCL_ERROR; }", -1);
-            }
-
             // Tcl_Obj *__cmd1__ = Tcl_GetObjResult(__interp__);
             Tcl_DStringAppend(ds_ptr, "\nTcl_Obj *__", -1);
             Tcl_DStringAppend(ds_ptr, cmd_name, -1);
@@ -2287,13 +2284,6 @@ thtml_CCompileForeachList(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStri
             Tcl_DStringAppend(ds_ptr, cmd_name, -1);
             Tcl_DStringAppend(ds_ptr, "_res__);", -1);
 
-            if (!compiled_cmd) {
-                // Tcl_DStringFree(__ds_forcmd1__);
-                Tcl_DStringAppend(ds_ptr, "\nTcl_DStringFree(__ds_", -1);
-                Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-                Tcl_DStringAppend(ds_ptr, "__);", -1);
-            }
-
 //            Tcl_DStringAppend(ds_ptr, "\x02", -1);
 
             Tcl_FreeParse(&cmd_parse);
@@ -2379,13 +2369,17 @@ thtml_CCompileQuotedArg(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
             Tcl_DStringAppend(ds_ptr, name, -1);
             Tcl_DStringAppend(ds_ptr, "__, \"", -1);
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
-            Tcl_DStringAppend(ds_ptr, "\", -1);", -1);
+            Tcl_DStringAppend(ds_ptr, "\", ", -1);
+            thtml_CAppendLength(ds_ptr, thtml_CLiteralLength(token->start, token->start + token->size));
+            Tcl_DStringAppend(ds_ptr, ");", -1);
         } else if (token->type == TCL_TOKEN_BS) {
             Tcl_DStringAppend(ds_ptr, "\nTcl_DStringAppend(__ds_", -1);
             Tcl_DStringAppend(ds_ptr, name, -1);
             Tcl_DStringAppend(ds_ptr, "__, \"", -1);
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
-            Tcl_DStringAppend(ds_ptr, "\", -1);", -1);
+            Tcl_DStringAppend(ds_ptr, "\", ", -1);
+            thtml_CAppendLength(ds_ptr, thtml_CLiteralLength(token->start, token->start + token->size));
+            Tcl_DStringAppend(ds_ptr, ");", -1);
         } else if (token->type == TCL_TOKEN_COMMAND) {
             SetResult("error parsing quoted string: command substitution not supported");
             return TCL_ERROR;
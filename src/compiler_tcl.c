@@ -9,13 +9,82 @@
 #include <string.h>
 #include <assert.h>
 
-static int subcmd_count = 0;
-static int template_cmd_count = 0;
-static int count_var_dict_subst = 0;
-static int foreach_cmd_count = 0;
 
 static int thtml_TclAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                                 Tcl_Size i, Tcl_Size *out_i, const char *name, Tcl_DString *cmd_ds_ptr, int in_eval_p);
+                                 Tcl_Size i, Tcl_Size *out_i, const char *name, Tcl_DString *cmd_ds_ptr);
+
+// The output is appended with as few commands as possible. Runs of text are joined across blank
+// code, and code that only appends to the output joins the text around it in a single append,
+// e.g. append __ds_default__ "<p>" [::thtml::runtime::tcl::escape_text $item] "</p>"
+typedef struct {
+    // the words of the pending append, each one after a space
+    Tcl_DString words;
+    // text for the quoted word that comes next
+    Tcl_DString text;
+} thtml_tcl_append_t;
+
+static void thtml_TclAppendCloseText(thtml_tcl_append_t *append_ptr) {
+    if (Tcl_DStringLength(&append_ptr->text) == 0) {
+        return;
+    }
+    Tcl_DStringAppend(&append_ptr->words, " \"", 2);
+    Tcl_DStringAppend(&append_ptr->words, Tcl_DStringValue(&append_ptr->text), Tcl_DStringLength(&append_ptr->text));
+    Tcl_DStringAppend(&append_ptr->words, "\"", 1);
+    Tcl_DStringSetLength(&append_ptr->text, 0);
+}
+
+static void thtml_TclAppendFlush(thtml_tcl_append_t *append_ptr, Tcl_DString *ds_ptr) {
+    thtml_TclAppendCloseText(append_ptr);
+    if (Tcl_DStringLength(&append_ptr->words) == 0) {
+        return;
+    }
+    Tcl_DStringAppend(ds_ptr, "\nappend __ds_default__", -1);
+    Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&append_ptr->words), Tcl_DStringLength(&append_ptr->words));
+    Tcl_DStringAppend(ds_ptr, "\n", 1);
+    Tcl_DStringSetLength(&append_ptr->words, 0);
+}
+
+static int thtml_TclIsWord(Tcl_Token *token_ptr, const char *word) {
+    return token_ptr->type == TCL_TOKEN_SIMPLE_WORD && token_ptr->size == (Tcl_Size) strlen(word)
+           && memcmp(token_ptr->start, word, token_ptr->size) == 0;
+}
+
+// returns 1 if the code between "p" and "end" is a single "append __ds_default__ ..." command,
+// along with where the words to append start and end
+static int thtml_TclIsOutputAppend(const char *p, const char *end, const char **words_ptr, const char **words_end_ptr) {
+    Tcl_Parse parse;
+    if (TCL_OK != Tcl_ParseCommand(NULL, p, end - p, 0, &parse)) {
+        return 0;
+    }
+
+    const char *command_end = parse.commandStart + parse.commandSize;
+    const char *q = command_end;
+    while (q < end && CHARTYPE(space, *q)) {
+        q++;
+    }
+
+    int result = 0;
+    if (parse.commentSize == 0 && parse.numWords >= 3 && q == end
+        && thtml_TclIsWord(&parse.tokenPtr[0], "append")) {
+        Tcl_Token *var_token_ptr = &parse.tokenPtr[1 + parse.tokenPtr[0].numComponents];
+        if (thtml_TclIsWord(var_token_ptr, "__ds_default__")) {
+            Tcl_Token *words_token_ptr = var_token_ptr + 1 + var_token_ptr->numComponents;
+            // the command ends with its terminator, if there is one
+            if (command_end > words_token_ptr->start && (command_end[-1] == '\n' || command_end[-1] == ';')) {
+                command_end--;
+            }
+            while (command_end > words_token_ptr->start && CHARTYPE(space, command_end[-1])) {
+                command_end--;
+            }
+            *words_ptr = words_token_ptr->start;
+            *words_end_ptr = command_end;
+            result = 1;
+        }
+    }
+
+    Tcl_FreeParse(&parse);
+    return result;
+}
 
 int thtml_TclTransformCmd(ClientData  clientData, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[]) {
     UNUSED(clientData);
@@ -36,11 +105,17 @@ int thtml_TclTransformCmd(ClientData  clientData, Tcl_Interp *interp, int objc,
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
 
+    thtml_tcl_append_t append;
+    Tcl_DStringInit(&append.words);
+    Tcl_DStringInit(&append.text);
+
     while (p < end) {
         // make sure "p" points to the start of the first text block, i.e. it is '\x02'
         if (*p != '\x02') {
             fprintf(stderr, "Text block does not start with start-of-text marker ch=%02x\n", *p);
             Tcl_DStringFree(&ds);
+            Tcl_DStringFree(&append.words);
+            Tcl_DStringFree(&append.text);
             SetResult("Text block does not start with start-of-text marker");
             return TCL_ERROR;
         }
@@ -52,9 +127,7 @@ int thtml_TclTransformCmd(ClientData  clientData, Tcl_Interp *interp, int objc,
         const char *q = p;
         while (q < end) {
             if (*q == '\x03') {
-                Tcl_DStringAppend(&ds, "\nappend __ds_default__ \"", -1);
-                thtml_AppendEscaped(p, q, &ds);
-                Tcl_DStringAppend(&ds, "\"\n", 2);
+                thtml_AppendEscaped(p, q, &append.text);
                 break;
             }
             q++;
@@ -62,6 +135,8 @@ int thtml_TclTransformCmd(ClientData  clientData, Tcl_Interp *interp, int objc,
 
         if (q == end) {
             Tcl_DStringFree(&ds);
+            Tcl_DStringFree(&append.words);
+            Tcl_DStringFree(&append.text);
             SetResult("Text block does not end with end-of-text marker");
             return TCL_ERROR;
         }
@@ -71,20 +146,37 @@ int thtml_TclTransformCmd(ClientData  clientData, Tcl_Interp *interp, int objc,
 
         // loop until we reach the end of the code block denoted by '\x02', excluding the last '\x02'
         q = p;
-        while (q < end) {
-            if (*q == '\x02') {
-                Tcl_DStringAppend(&ds, p, q - p);
-                break;
-            }
+        while (q < end && *q != '\x02') {
             q++;
         }
 
+        const char *code = p;
+        while (code < q && CHARTYPE(space, *code)) {
+            code++;
+        }
+
+        const char *words;
+        const char *words_end;
+        if (code == q) {
+            // blank code, the text goes on
+        } else if (thtml_TclIsOutputAppend(code, q, &words, &words_end)) {
+            thtml_TclAppendCloseText(&append);
+            Tcl_DStringAppend(&append.words, " ", 1);
+            Tcl_DStringAppend(&append.words, words, words_end - words);
+        } else {
+            thtml_TclAppendFlush(&append, &ds);
+            Tcl_DStringAppend(&ds, p, q - p);
+        }
+
         // skip the last '\x02'
         p = q;
     }
+    thtml_TclAppendFlush(&append, &ds);
 
     Tcl_DStringResult(interp, &ds);
     Tcl_DStringFree(&ds);
+    Tcl_DStringFree(&append.words);
+    Tcl_DStringFree(&append.text);
     return TCL_OK;
 }
 
@@ -109,33 +201,12 @@ int thtml_TclCompileExprCmd(ClientData  clientData, Tcl_Interp *interp, int objc
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
 
-    Tcl_DStringAppend(&ds, "\nset __ds_", -1);
-    Tcl_DStringAppend(&ds, name, -1);
-    Tcl_DStringAppend(&ds, "__ {}", -1);
-
     if (TCL_OK != thtml_TclCompileExpr(interp, objv[1], &ds, &parse, name)) {
         Tcl_FreeParse(&parse);
         Tcl_DStringFree(&ds);
         return TCL_ERROR;
     }
 
-    // # in TclCompileExprCmd
-    Tcl_DStringAppend(&ds, "\n# in TclCompileExpr", -1);
-
-    // puts __ds_${name}__=$__ds_${name}__
-//    Tcl_DStringAppend(&ds, "\nputs __ds_", -1);
-//    Tcl_DStringAppend(&ds, name, -1);
-//    Tcl_DStringAppend(&ds, "__=$__ds_", -1);
-//    Tcl_DStringAppend(&ds, name, -1);
-//    Tcl_DStringAppend(&ds, "__", -1);
-
-    Tcl_DStringAppend(&ds, "\nset __", -1);
-    Tcl_DStringAppend(&ds, name, -1);
-    Tcl_DStringAppend(&ds, "__ [::thtml::runtime::tcl::evaluate_script $__ds_", -1);
-    Tcl_DStringAppend(&ds, name, -1);
-    Tcl_DStringAppend(&ds, "__]", -1);
-
-
     Tcl_DStringResult(interp, &ds);
     Tcl_DStringFree(&ds);
     Tcl_FreeParse(&parse);
@@ -165,6 +236,13 @@ int thtml_TclCompileQuotedStringCmd(ClientData  clientData, Tcl_Interp *interp,
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
 
+    // the string is built anew every time the code runs, e.g. in every iteration of a foreach
+    if (objc == 4) {
+        Tcl_DStringAppend(&ds, "\nset __ds_", -1);
+        Tcl_DStringAppend(&ds, name, -1);
+        Tcl_DStringAppend(&ds, "__ {}", -1);
+    }
+
     if (TCL_OK != thtml_TclCompileQuotedString(interp, objv[1], &ds, &parse, name)) {
         Tcl_FreeParse(&parse);
         Tcl_DStringFree(&ds);
@@ -181,7 +259,12 @@ int thtml_TclCompileTemplateTextCmd(ClientData  clientData, Tcl_Interp *interp,
     UNUSED(clientData);
     DBG(fprintf(stderr, "TclCompileTemplateTextCmd\n"));
 
-    CheckArgs(3, 3, 1, "codearrVar text");
+    CheckArgs(3, 4, 1, "codearrVar text ?context?");
+
+    int escape = THTML_ESCAPE_NONE;
+    if (objc == 4 && TCL_OK != thtml_GetEscapeFromObj(interp, objv[3], &escape)) {
+        return TCL_ERROR;
+    }
 
     Tcl_Size text_length;
     char *text = Tcl_GetStringFromObj(objv[2], &text_length);
@@ -230,7 +313,7 @@ int thtml_TclCompileTemplateTextCmd(ClientData  clientData, Tcl_Interp *interp,
     Tcl_DString ds;
     Tcl_DStringInit(&ds);
 
-    if (TCL_OK != thtml_TclCompileTemplateText(interp, objv[1], &ds, &parse)) {
+    if (TCL_OK != thtml_TclCompileTemplateText(interp, objv[1], &ds, &parse, escape)) {
         Tcl_FreeParse(&parse);
         Tcl_DStringFree(&ds);
         return TCL_ERROR;
@@ -263,20 +346,37 @@ int thtml_TclCompileScriptCmd(ClientData  clientData, Tcl_Interp *interp, int ob
         return TCL_ERROR;
     }
 
-    if (TCL_OK != thtml_TclCompileCommand(interp, objv[1], &ds, &parse, name, 0)) {
+    // The script runs inline in the template proc, so a return anywhere in it, e.g. in the body
+    // of an if or a foreach, is caught and gives the value, as it did when the script was
+    // evaluated one level up in a proc of its own:
+    // set __val1__ [try {...} on return {__val1__ __val1_options__} {dict incr __val1_options__ -level -1; return -options ...}]
+    Tcl_DString cmd_ds;
+    Tcl_DStringInit(&cmd_ds);
+    Tcl_DStringAppend(&cmd_ds, "\nset __", -1);
+    Tcl_DStringAppend(&cmd_ds, name, name_length);
+    Tcl_DStringAppend(&cmd_ds, "__ [try {", -1);
+
+    if (TCL_OK != thtml_TclCompileCommand(interp, objv[1], &ds, &parse, name, &cmd_ds)) {
         Tcl_FreeParse(&parse);
+        Tcl_DStringFree(&cmd_ds);
         Tcl_DStringFree(&ds);
         return TCL_ERROR;
     }
+    Tcl_FreeParse(&parse);
 
-    // # in TclCompileScript
-//    Tcl_DStringAppend(&ds, "\n# in TclCompileScript", -1);
-//
-//    Tcl_DStringAppend(&ds, "\nset __", -1);
-//    Tcl_DStringAppend(&ds, name, name_length);
-//    Tcl_DStringAppend(&ds, "__ $__ds_", -1);
-//    Tcl_DStringAppend(&ds, name, name_length);
-//    Tcl_DStringAppend(&ds, "__", -1);
+    Tcl_DStringAppend(&cmd_ds, "} on return {__", -1);
+    Tcl_DStringAppend(&cmd_ds, name, name_length);
+    Tcl_DStringAppend(&cmd_ds, "__ __", -1);
+    Tcl_DStringAppend(&cmd_ds, name, name_length);
+    Tcl_DStringAppend(&cmd_ds, "_options__} {dict incr __", -1);
+    Tcl_DStringAppend(&cmd_ds, name, name_length);
+    Tcl_DStringAppend(&cmd_ds, "_options__ -level -1; return -options $__", -1);
+    Tcl_DStringAppend(&cmd_ds, name, name_length);
+    Tcl_DStringAppend(&cmd_ds, "_options__ $__", -1);
+    Tcl_DStringAppend(&cmd_ds, name, name_length);
+    Tcl_DStringAppend(&cmd_ds, "__}]", -1);
+    Tcl_DStringAppend(&ds, Tcl_DStringValue(&cmd_ds), Tcl_DStringLength(&cmd_ds));
+    Tcl_DStringFree(&cmd_ds);
 
     Tcl_DStringResult(interp, &ds);
     Tcl_DStringFree(&ds);
@@ -288,42 +388,63 @@ static int
 thtml_TclAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
                           Tcl_Size i, const char *name, Tcl_DString *expr_ds_ptr);
 
+// the runtime command that escapes a value for one of THTML_ESCAPE_*
+static const char *const thtml_tcl_escape_cmds[] = {NULL, "::thtml::runtime::tcl::escape_text",
+                                                    "::thtml::runtime::tcl::escape_attr", "::thtml::runtime::tcl::escape_url",
+                                                    "::thtml::runtime::tcl::escape_url_start"};
+
+// append __ds_default__ $x or append __ds_default__ [::thtml::runtime::tcl::escape_text $x]
+static void thtml_TclAppendOutput(Tcl_DString *ds_ptr, const char *name, const char *varname, Tcl_Size varname_length,
+                                  int escape) {
+    Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
+    Tcl_DStringAppend(ds_ptr, name, -1);
+    if (escape == THTML_ESCAPE_NONE) {
+        Tcl_DStringAppend(ds_ptr, "__ $", -1);
+        Tcl_DStringAppend(ds_ptr, varname, varname_length);
+    } else {
+        Tcl_DStringAppend(ds_ptr, "__ [", -1);
+        Tcl_DStringAppend(ds_ptr, thtml_tcl_escape_cmds[escape], -1);
+        Tcl_DStringAppend(ds_ptr, " $", -1);
+        Tcl_DStringAppend(ds_ptr, varname, varname_length);
+        Tcl_DStringAppend(ds_ptr, "]", -1);
+    }
+}
+
 static int thtml_TclAppendVariable_Simple(Tcl_Interp *interp, Tcl_DString *ds_ptr, const char *varname_first_part,
-                                          Tcl_Size varname_first_part_length, const char *name, Tcl_DString *cmd_ds_ptr, int in_eval_p) {
+                                          Tcl_Size varname_first_part_length, const char *name, Tcl_DString *cmd_ds_ptr,
+                                          int escape) {
     if (cmd_ds_ptr == NULL) {
-        // Tcl_DStringAppend(__ds_default__, "\"$x\"", -1);
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ $", -1);
-        Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
+        thtml_TclAppendOutput(ds_ptr, name, varname_first_part, varname_first_part_length, escape);
     } else {
-        if (in_eval_p) {
-            Tcl_DStringAppend(cmd_ds_ptr, "IN-EVAL: $", -1);
-            Tcl_DStringAppend(cmd_ds_ptr, varname_first_part, varname_first_part_length);
-        } else {
-            Tcl_DStringAppend(cmd_ds_ptr, "$", -1);
-            Tcl_DStringAppend(cmd_ds_ptr, varname_first_part, varname_first_part_length);
-        }
+        // ${x}, so that text can follow it in a quoted word
+        Tcl_DStringAppend(cmd_ds_ptr, "${", -1);
+        Tcl_DStringAppend(cmd_ds_ptr, varname_first_part, varname_first_part_length);
+        Tcl_DStringAppend(cmd_ds_ptr, "}", -1);
     }
     return TCL_OK;
 }
 
 static int
-thtml_TclAppendVariable_Dict(Tcl_Interp *interp, Tcl_DString *ds_ptr, const char *varname_first_part,
+thtml_TclAppendVariable_Dict(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, const char *varname_first_part,
                              Tcl_Size varname_first_part_length, Tcl_Obj **parts,
-                             Tcl_Size num_parts, const char *name, Tcl_DString *expr_ds_ptr, int in_eval_p) {
+                             Tcl_Size num_parts, const char *name, Tcl_DString *expr_ds_ptr, int escape) {
 
-    count_var_dict_subst++;
+    int count_var_dict_subst = thtml_NextCount(interp, codearrVar_ptr, "count_var_dict_subst");
     char count_var_dict_subst_str[12];
     snprintf(count_var_dict_subst_str, 12, "%d", count_var_dict_subst);
 
     char varname[64];
     snprintf(varname, 64, "__dict_%s__", count_var_dict_subst_str);
 
-    Tcl_DStringAppend(ds_ptr, "\nset ", -1);
-    Tcl_DStringAppend(ds_ptr, varname, -1);
-    Tcl_DStringAppend(ds_ptr, " $", -1);
-    Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
+    // template data is looked up through the layers of the scope, see ::thtml::runtime::tcl::scope_get
+    int from_scope = varname_first_part_length == 8 && 0 == strncmp(varname_first_part, "__data__", 8);
+
+    if (!from_scope) {
+        Tcl_DStringAppend(ds_ptr, "\nset ", -1);
+        Tcl_DStringAppend(ds_ptr, varname, -1);
+        Tcl_DStringAppend(ds_ptr, " $", -1);
+        Tcl_DStringAppend(ds_ptr, varname_first_part, varname_first_part_length);
+    }
 
     int first = 1;
     for (int i = 0; i < num_parts; i++) {
@@ -339,9 +460,13 @@ thtml_TclAppendVariable_Dict(Tcl_Interp *interp, Tcl_DString *ds_ptr, const char
         Tcl_DStringAppend(ds_ptr, "\nset __", -1);
         Tcl_DStringAppend(ds_ptr, part, part_length);
         Tcl_DStringAppend(ds_ptr, count_var_dict_subst_str, -1);
-        Tcl_DStringAppend(ds_ptr, "__ [dict get $", -1);
-        Tcl_DStringAppend(ds_ptr, varname, -1);
-        Tcl_DStringAppend(ds_ptr, " ", -1);
+        if (i == 0 && from_scope) {
+            Tcl_DStringAppend(ds_ptr, "__ [::thtml::runtime::tcl::scope_get $__data__ $__parent__ ", -1);
+        } else {
+            Tcl_DStringAppend(ds_ptr, "__ [dict get $", -1);
+            Tcl_DStringAppend(ds_ptr, varname, -1);
+            Tcl_DStringAppend(ds_ptr, " ", -1);
+        }
         Tcl_DStringAppend(ds_ptr, part, part_length);
         Tcl_DStringAppend(ds_ptr, "]", -1);
 
@@ -354,22 +479,19 @@ thtml_TclAppendVariable_Dict(Tcl_Interp *interp, Tcl_DString *ds_ptr, const char
     }
 
     if (expr_ds_ptr == NULL) {
-        // Tcl_DStringAppend(__ds_wt3__, Tcl_GetString(__dict_2__), -1);
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ $", -1);
-        Tcl_DStringAppend(ds_ptr, varname, -1);
+        thtml_TclAppendOutput(ds_ptr, name, varname, -1, escape);
 
     } else {
-        Tcl_DStringAppend(expr_ds_ptr, "$", -1);
+        Tcl_DStringAppend(expr_ds_ptr, "${", -1);
         Tcl_DStringAppend(expr_ds_ptr, varname, -1);
+        Tcl_DStringAppend(expr_ds_ptr, "}", -1);
     }
     return TCL_OK;
 }
 
 int
 thtml_TclAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                        Tcl_Size i, const char *name, Tcl_DString *cmd_ds_ptr, int in_eval_p) {
+                        Tcl_Size i, const char *name, Tcl_DString *cmd_ds_ptr, int escape) {
     Tcl_Token *token = &parse_ptr->tokenPtr[i];
     Tcl_Size numComponents = token->numComponents;
     if (numComponents == 1) {
@@ -379,6 +501,12 @@ thtml_TclAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
         const char *p = text_token->start;
         const char *end = text_token->start + text_token->size;
 
+        // ${!x} opts out of escaping in template text
+        if (escape != THTML_ESCAPE_NONE && p < end && *p == '!') {
+            escape = THTML_ESCAPE_NONE;
+            p++;
+        }
+
         Tcl_Obj *parts_ptr = Tcl_NewListObj(0, NULL);
         Tcl_IncrRefCount(parts_ptr);
         while (p < end) {
@@ -471,14 +599,14 @@ thtml_TclAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
                     // found a match
                     if (num_parts == 1) {
                         if (TCL_OK != thtml_TclAppendVariable_Simple(interp, ds_ptr, varname_first_part,
-                                                                     varname_first_part_length, name, cmd_ds_ptr, in_eval_p)) {
+                                                                     varname_first_part_length, name, cmd_ds_ptr, escape)) {
                             Tcl_DecrRefCount(parts_ptr);
                             return TCL_ERROR;
                         }
                     } else {
                         if (TCL_OK !=
-                                thtml_TclAppendVariable_Dict(interp, ds_ptr, varname_first_part,
-                                                             varname_first_part_length, &parts[1], num_parts - 1, name, cmd_ds_ptr, in_eval_p)) {
+                                thtml_TclAppendVariable_Dict(interp, codearrVar_ptr, ds_ptr, varname_first_part,
+                                                             varname_first_part_length, &parts[1], num_parts - 1, name, cmd_ds_ptr, escape)) {
                             Tcl_DecrRefCount(parts_ptr);
                             return TCL_ERROR;
                         }
@@ -505,7 +633,7 @@ thtml_TclAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
         }
 
         if (TCL_OK !=
-                thtml_TclAppendVariable_Dict(interp, ds_ptr, "__data__", 8, parts, num_parts, name, cmd_ds_ptr, in_eval_p)) {
+                thtml_TclAppendVariable_Dict(interp, codearrVar_ptr, ds_ptr, "__data__", 8, parts, num_parts, name, cmd_ds_ptr, escape)) {
             Tcl_DecrRefCount(parts_ptr);
             return TCL_ERROR;
         }
@@ -518,6 +646,35 @@ thtml_TclAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString
     return TCL_OK;
 }
 
+// appends an operand of && || or ?: that is evaluated only when needed, the dict lookups that
+// it uses go inside it, e.g. [set __dict_1__ ...\nexpr {${__dict_1__} eq "x"}], so that they
+// are not run when the operand is not
+static int
+thtml_TclAppendExpr_LazyOperand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_Parse *parse_ptr, Tcl_Size i,
+                                const char *name, Tcl_DString *cmd_ds_ptr) {
+    Tcl_DString lookups_ds;
+    Tcl_DStringInit(&lookups_ds);
+    Tcl_DString operand_ds;
+    Tcl_DStringInit(&operand_ds);
+    if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, &lookups_ds, parse_ptr, i, name, &operand_ds)) {
+        Tcl_DStringFree(&operand_ds);
+        Tcl_DStringFree(&lookups_ds);
+        return TCL_ERROR;
+    }
+    if (Tcl_DStringLength(&lookups_ds) == 0) {
+        Tcl_DStringAppend(cmd_ds_ptr, Tcl_DStringValue(&operand_ds), Tcl_DStringLength(&operand_ds));
+    } else {
+        Tcl_DStringAppend(cmd_ds_ptr, "[", 1);
+        Tcl_DStringAppend(cmd_ds_ptr, Tcl_DStringValue(&lookups_ds), Tcl_DStringLength(&lookups_ds));
+        Tcl_DStringAppend(cmd_ds_ptr, "\nexpr {", -1);
+        Tcl_DStringAppend(cmd_ds_ptr, Tcl_DStringValue(&operand_ds), Tcl_DStringLength(&operand_ds));
+        Tcl_DStringAppend(cmd_ds_ptr, "}]", 2);
+    }
+    Tcl_DStringFree(&operand_ds);
+    Tcl_DStringFree(&lookups_ds);
+    return TCL_OK;
+}
+
 static int
 thtml_TclAppendExpr_Operator(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
                              Tcl_Size i, const char *name, Tcl_DString *cmd_ds_ptr) {
@@ -590,11 +747,11 @@ thtml_TclAppendExpr_Operator(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DS
             Tcl_DStringAppend(cmd_ds_ptr, " ", 1);
             Tcl_DStringAppend(cmd_ds_ptr, operator_token->start, operator_token->size);
             Tcl_DStringAppend(cmd_ds_ptr, " ", 1);
-            if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, second_operand_index, name, cmd_ds_ptr)) {
+            if (TCL_OK != thtml_TclAppendExpr_LazyOperand(interp, codearrVar_ptr, parse_ptr, second_operand_index, name, cmd_ds_ptr)) {
                 return TCL_ERROR;
             }
             Tcl_DStringAppend(cmd_ds_ptr, " : ", 3);
-            if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, third_operand_index, name, cmd_ds_ptr)) {
+            if (TCL_OK != thtml_TclAppendExpr_LazyOperand(interp, codearrVar_ptr, parse_ptr, third_operand_index, name, cmd_ds_ptr)) {
                 return TCL_ERROR;
             }
         } else {
@@ -613,14 +770,20 @@ thtml_TclAppendExpr_Operator(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DS
             // two operands
 
             Tcl_Token *first_operand = &parse_ptr->tokenPtr[operands_offset];
+            Tcl_Size second_operand_index = operands_offset + first_operand->numComponents + 1;
             if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, operands_offset, name, cmd_ds_ptr)) {
                 return TCL_ERROR;
             }
             Tcl_DStringAppend(cmd_ds_ptr, " ", 1);
             Tcl_DStringAppend(cmd_ds_ptr, operator_token->start, operator_token->size);
             Tcl_DStringAppend(cmd_ds_ptr, " ", 1);
-            if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr,
-                                                    operands_offset + first_operand->numComponents + 1, name, cmd_ds_ptr)) {
+            // the right operand of && and || is evaluated only when needed
+            int lazy = (ch1 == '&' && ch2 == '&') || (ch1 == '|' && ch2 == '|');
+            if (lazy) {
+                if (TCL_OK != thtml_TclAppendExpr_LazyOperand(interp, codearrVar_ptr, parse_ptr, second_operand_index, name, cmd_ds_ptr)) {
+                    return TCL_ERROR;
+                }
+            } else if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, second_operand_index, name, cmd_ds_ptr)) {
                 return TCL_ERROR;
             }
 
@@ -666,12 +829,11 @@ thtml_TclAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStri
         }
         Tcl_DStringAppend(expr_ds_ptr, ")", 1);
     } else if (token->type == TCL_TOKEN_VARIABLE) {
-        return thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, "default", expr_ds_ptr, 0);
+        return thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, "default", expr_ds_ptr, THTML_ESCAPE_NONE);
     } else if (token->type == TCL_TOKEN_TEXT) {
         Tcl_DStringAppend(expr_ds_ptr, token->start, token->size);
     } else if (token->type == TCL_TOKEN_COMMAND) {
-        int in_eval_p = 0;
-        if (TCL_OK != thtml_TclAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, &i, name, expr_ds_ptr, in_eval_p)) {
+        if (TCL_OK != thtml_TclAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, &i, name, expr_ds_ptr)) {
             return TCL_ERROR;
         }
     } else if (token->type == TCL_TOKEN_EXPAND_WORD) {
@@ -693,27 +855,38 @@ thtml_TclAppendExpr_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DStri
     return TCL_OK;
 }
 
-int thtml_TclCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name) {
+// appends expr {...} with the expression to "expr_ds_ptr", the dict lookups it uses go to "ds_ptr"
+static int thtml_TclAppendExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                               const char *name, Tcl_DString *expr_ds_ptr) {
     // After Tcl_ParseExpr returns, the first token pointed to by the tokenPtr field of the Tcl_Parse structure
     // always has type TCL_TOKEN_SUB_EXPR. It is followed by the sub-tokens that must be evaluated to produce
     // the value of the expression. Only the token information in the Tcl_Parse structure is modified:
     // the commentStart, commentSize, commandStart, and commandSize fields are not modified by Tcl_ParseExpr.
 
+    Tcl_DStringAppend(expr_ds_ptr, "expr {", -1);
+    if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, 0, name, expr_ds_ptr)) {
+        return TCL_ERROR;
+    }
+    Tcl_DStringAppend(expr_ds_ptr, "}", -1);
+    return TCL_OK;
+}
+
+// set __flag1__ [expr {...}]
+int thtml_TclCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name) {
     Tcl_DString expr_ds;
     Tcl_DStringInit(&expr_ds);
-    Tcl_DStringAppend(&expr_ds, "\nappend __ds_", -1);
+    Tcl_DStringAppend(&expr_ds, "\nset __", -1);
     Tcl_DStringAppend(&expr_ds, name, -1);
-    Tcl_DStringAppend(&expr_ds, "__ {expr {", -1);
+    Tcl_DStringAppend(&expr_ds, "__ [", -1);
 
-    if (TCL_OK != thtml_TclAppendExpr_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, 0, name, &expr_ds)) {
+    if (TCL_OK != thtml_TclAppendExpr(interp, codearrVar_ptr, ds_ptr, parse_ptr, name, &expr_ds)) {
+        Tcl_DStringFree(&expr_ds);
         return TCL_ERROR;
     }
-    Tcl_DStringAppend(&expr_ds, "}}", -1);
+    Tcl_DStringAppend(&expr_ds, "]", -1);
 
     Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&expr_ds), Tcl_DStringLength(&expr_ds));
     Tcl_DStringFree(&expr_ds);
-
-
     return TCL_OK;
 }
 
@@ -739,7 +912,7 @@ thtml_TclCompileQuotedString(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DS
             SetResult("error parsing quoted string: command substitution not supported");
             return TCL_ERROR;
         } else if (token->type == TCL_TOKEN_VARIABLE) {
-            if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, NULL, 0)) {
+            if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, NULL, THTML_ESCAPE_NONE)) {
                 return TCL_ERROR;
             }
             i++;
@@ -753,9 +926,12 @@ thtml_TclCompileQuotedString(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DS
 }
 
 int
-thtml_TclCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr) {
+thtml_TclCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                             int escape) {
     for (Tcl_Size i = 0; i < parse_ptr->numTokens; i++) {
         Tcl_Token *token = &parse_ptr->tokenPtr[i];
+        // a value that starts a url attribute decides its scheme
+        int value_escape = escape == THTML_ESCAPE_URL && i == 0 ? THTML_ESCAPE_URL_START : escape;
         if (token->type == TCL_TOKEN_TEXT) {
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
         } else if (token->type == TCL_TOKEN_BS) {
@@ -763,46 +939,67 @@ thtml_TclCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DS
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
         } else if (token->type == TCL_TOKEN_COMMAND) {
 
-            template_cmd_count++;
+            int template_cmd_count = thtml_NextCount(interp, codearrVar_ptr, "template_cmd_count");
 
             char cmd_name[64];
             snprintf(cmd_name, 64, "cmd%d", template_cmd_count);
 
 
             DBG(fprintf(stderr, "CompileTemplateText\n"));
+            // [!cmd ...] opts out of escaping the result of the command, as ${!x} does for variables
+            const char *cmd_start = token->start + 1;
+            Tcl_Size cmd_size = token->size - 2;
+            int cmd_escape = value_escape;
+            if (cmd_size > 0 && *cmd_start == '!') {
+                cmd_escape = THTML_ESCAPE_NONE;
+                cmd_start++;
+                cmd_size--;
+            }
+
             Tcl_Parse cmd_parse;
-            if (TCL_OK != Tcl_ParseCommand(interp, token->start + 1, token->size - 2, 0, &cmd_parse)) {
+            if (TCL_OK != Tcl_ParseCommand(interp, cmd_start, cmd_size, 0, &cmd_parse)) {
                 Tcl_FreeParse(&cmd_parse);
                 return TCL_ERROR;
             }
 
-            Tcl_DStringAppend(ds_ptr, "\x03", -1);
-            Tcl_DStringAppend(ds_ptr, "\nset __ds_", -1);
-            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__ {}", -1);
+            // append __ds_default__ [::thtml::runtime::tcl::escape_text [string toupper ${x}]]
+            Tcl_DString cmd_ds;
+            Tcl_DStringInit(&cmd_ds);
+            Tcl_DStringAppend(&cmd_ds, "\nappend __ds_default__ [", -1);
+            if (cmd_escape != THTML_ESCAPE_NONE) {
+                Tcl_DStringAppend(&cmd_ds, thtml_tcl_escape_cmds[cmd_escape], -1);
+                Tcl_DStringAppend(&cmd_ds, " [", -1);
+            }
 
-            if (TCL_OK != thtml_TclCompileCommand(interp, codearrVar_ptr, ds_ptr, &cmd_parse, cmd_name, 0)) {
+            Tcl_DString lookups_ds;
+            Tcl_DStringInit(&lookups_ds);
+            if (TCL_OK != thtml_TclCompileCommand(interp, codearrVar_ptr, &lookups_ds, &cmd_parse, cmd_name, &cmd_ds)) {
                 Tcl_FreeParse(&cmd_parse);
+                Tcl_DStringFree(&lookups_ds);
+                Tcl_DStringFree(&cmd_ds);
                 return TCL_ERROR;
             }
+            Tcl_DStringAppend(&cmd_ds, cmd_escape != THTML_ESCAPE_NONE ? "]]" : "]", -1);
+
+            // the lookups go in a code block of their own, so that the output of the command is
+            // appended along with the text around it
+            if (Tcl_DStringLength(&lookups_ds) > 0) {
+                Tcl_DStringAppend(ds_ptr, "\x03", -1);
+                Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&lookups_ds), Tcl_DStringLength(&lookups_ds));
+                Tcl_DStringAppend(ds_ptr, "\n\x02", -1);
+            }
+            Tcl_DStringFree(&lookups_ds);
 
-            // puts $__cmd1__
-//            Tcl_DStringAppend(ds_ptr, "\nputs $__", -1);
-//            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-//            Tcl_DStringAppend(ds_ptr, "__", -1);
-
-            // append __ds_default__ [::thtml::runtime::tcl::evaluate_script $__ds_cmd1__]
-            Tcl_DStringAppend(ds_ptr, "\nappend __ds_default__ [::thtml::runtime::tcl::evaluate_script $__ds_", -1);
-            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__]", -1);
-
-            Tcl_DStringAppend(ds_ptr, "\x02", -1);
+            Tcl_DStringAppend(ds_ptr, "\x03", -1);
+            Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&cmd_ds), Tcl_DStringLength(&cmd_ds));
+            Tcl_DStringAppend(ds_ptr, "\n\x02", -1);
+            Tcl_DStringFree(&cmd_ds);
 
             Tcl_FreeParse(&cmd_parse);
 
         } else if (token->type == TCL_TOKEN_VARIABLE) {
             Tcl_DStringAppend(ds_ptr, "\x03", -1);
-            if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, "default", NULL, 0)) {
+            if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, "default", NULL, value_escape)) {
                 return TCL_ERROR;
             }
             Tcl_DStringAppend(ds_ptr, "\n\x02", 2);
@@ -815,238 +1012,154 @@ thtml_TclCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DS
     return TCL_OK;
 }
 
-static int thtml_TclAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
-                                Tcl_Size i, Tcl_Size *out_i, const char *name, Tcl_DString *cmd_ds_ptr, int in_eval_p) {
-    if (i >= parse_ptr->numTokens) {
-        return TCL_OK;
+// a word of text that gives the same word inside a quoted word and inside a braced expression
+static void thtml_TclAppendQuotedText(Tcl_DString *ds_ptr, const char *text, Tcl_Size length) {
+    for (const char *p = text; p < text + length; p++) {
+        if (*p == '\\' || *p == '"' || *p == '$' || *p == '[' || *p == ']' || *p == '{' || *p == '}') {
+            Tcl_DStringAppend(ds_ptr, "\\", 1);
+        }
+        Tcl_DStringAppend(ds_ptr, p, 1);
     }
-    Tcl_Token *token = &parse_ptr->tokenPtr[i];
-//     fprintf(stderr, "thtml_TclAppendCommand_Token: i: %d type: %d - token: %.*s - numComponents: %d\n", i, token->type,
-//            token->size, token->start, token->numComponents);
+}
 
-    Tcl_DStringAppend(ds_ptr, "\n#AppendCommand_Token: ", -1);
-    Tcl_DStringAppend(ds_ptr, token->start, token->size);
+// appends the word of a command at token "i" as tcl code that gives the same word, e.g.
+// {a b}, ${__dict_1__}, [string length ${x}] or "item-${i}", the dict lookups of the
+// template variables go to "ds_ptr" before the command, "out_i" is set to the next word
+static int thtml_TclAppendCommand_Word(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                                       Tcl_Size i, Tcl_Size *out_i, const char *name, Tcl_DString *cmd_ds_ptr) {
+    Tcl_Token *token = &parse_ptr->tokenPtr[i];
+    *out_i = i + 1 + token->numComponents;
 
-    if (token->type == TCL_TOKEN_VARIABLE) {
-        if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, cmd_ds_ptr, in_eval_p)) {
-            return TCL_ERROR;
-        }
-        *out_i = i + 2;
-        return TCL_OK;
-    } else if (token->type == TCL_TOKEN_SIMPLE_WORD) {
+    if (token->type == TCL_TOKEN_SIMPLE_WORD) {
         Tcl_Token *text_token = &parse_ptr->tokenPtr[i + 1];
-        assert(text_token->type == TCL_TOKEN_TEXT);
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ {{", -1);
-        Tcl_DStringAppend(ds_ptr, text_token->start, text_token->size);
-        Tcl_DStringAppend(ds_ptr, "}}", -1);
-        *out_i = i + 2;
+        Tcl_DString text_ds;
+        Tcl_DStringInit(&text_ds);
+        Tcl_DStringAppend(&text_ds, text_token->start, text_token->size);
+        Tcl_DString element_ds;
+        Tcl_DStringInit(&element_ds);
+        Tcl_DStringAppendElement(&element_ds, Tcl_DStringValue(&text_ds));
+        Tcl_DStringAppend(cmd_ds_ptr, Tcl_DStringValue(&element_ds), Tcl_DStringLength(&element_ds));
+        Tcl_DStringFree(&element_ds);
+        Tcl_DStringFree(&text_ds);
         return TCL_OK;
-    } else if (token->type == TCL_TOKEN_TEXT) {
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ {", -1);
-        Tcl_DStringAppend(ds_ptr, token->start, token->size);
-        Tcl_DStringAppend(ds_ptr, "}", -1);
-        *out_i = i + 1;
-        return TCL_OK;
-    } else if (token->type == TCL_TOKEN_COMMAND) {
-
-        subcmd_count++;
-
-        char subcmd_name[64];
-        snprintf(subcmd_name, 64, "%s_subcmd%d", name, subcmd_count);
-
-        Tcl_DStringAppend(ds_ptr, "\n#SubCommand: ", -1);
-        Tcl_DStringAppend(ds_ptr, token->start, token->size);
-
-        // set __ds_subcmd1__ {}
-        Tcl_DStringAppend(ds_ptr, "\nset __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ {}", -1);
-
-        // append __ds_subcmd1__ {::thtml::runtime::tcl::evaluate_script}
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ {::thtml::runtime::tcl::evaluate_script}", -1);
-
-        // start sublist, tcl-style
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ \" \\{\"", -1);
-
-        Tcl_Parse subcmd_parse;
-        if (TCL_OK != Tcl_ParseCommand(interp, token->start + 1, token->size - 2, 0, &subcmd_parse)) {
-            return TCL_ERROR;
-        }
-        if (TCL_OK != thtml_TclCompileCommand(interp, codearrVar_ptr, ds_ptr, &subcmd_parse, subcmd_name, 1)) {
-            return TCL_ERROR;
-        }
-
-        // end sublist, tcl-style
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ \"\\}\"", -1);
-
-        Tcl_DStringAppend(ds_ptr, "\nset __", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ $__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__", -1);
-
-        if (cmd_ds_ptr != NULL) {
-            Tcl_DStringAppend(cmd_ds_ptr, "[::thtml::runtime::tcl::evaluate_script $__", -1);
-            Tcl_DStringAppend(cmd_ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(cmd_ds_ptr, "__]", -1);
-        } else {
-            // append __ds_val3__ [::thtml::runtime::tcl::evaluate_script $__val3_subcmd1__]
-            Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-            Tcl_DStringAppend(ds_ptr, name, -1);
-            Tcl_DStringAppend(ds_ptr, "__ [::thtml::runtime::tcl::evaluate_script $__", -1);
-            Tcl_DStringAppend(ds_ptr, subcmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__]", -1);
-        }
-
     } else if (token->type == TCL_TOKEN_EXPAND_WORD) {
-        SetResult("error parsing expression: expand word not supported");
+        SetResult("error parsing command: expand word not supported");
         return TCL_ERROR;
-    } else if (token->type == TCL_TOKEN_WORD) {
-
-        static int word_token_count = 0;
-        word_token_count++;
-
-        char word_token_name[64];
-        snprintf(word_token_name, 64, "wt%d", word_token_count);
-
-        Tcl_DStringAppend(ds_ptr, "\n# TOKEN_WORD: ", -1);
-        Tcl_DStringAppend(ds_ptr, token->start, token->size);
-        Tcl_DStringAppend(ds_ptr, " numComponents: ", -1);
-        Tcl_DStringAppend(ds_ptr, Tcl_GetString(Tcl_NewIntObj(token->numComponents)), -1);
-
-        // set __ds__wt1__ {}
-        Tcl_DStringAppend(ds_ptr, "\nset __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, word_token_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ {}", -1);
+    } else if (token->type != TCL_TOKEN_WORD) {
+        SetResult("error parsing command: unsupported word type");
+        return TCL_ERROR;
+    }
 
-        Tcl_Size start_i = i;
-        Tcl_Size j = i + 1;
-        while (i - start_i - 1 < token->numComponents) {
+    // a variable or a command on its own is the word, the rest are joined in a quoted word
+    Tcl_Token *first_token = &parse_ptr->tokenPtr[i + 1];
+    int quoted = !((first_token->type == TCL_TOKEN_VARIABLE || first_token->type == TCL_TOKEN_COMMAND)
+                   && 1 + first_token->numComponents == token->numComponents);
+    if (quoted) {
+        Tcl_DStringAppend(cmd_ds_ptr, "\"", 1);
+    }
 
-            if (TCL_OK != thtml_TclAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, j, &i, word_token_name,
-                                                     cmd_ds_ptr, 0)) {
+    Tcl_Size j = i + 1;
+    while (j < *out_i) {
+        Tcl_Token *component_token = &parse_ptr->tokenPtr[j];
+        if (component_token->type == TCL_TOKEN_TEXT) {
+            thtml_TclAppendQuotedText(cmd_ds_ptr, component_token->start, component_token->size);
+        } else if (component_token->type == TCL_TOKEN_BS) {
+            Tcl_DStringAppend(cmd_ds_ptr, component_token->start, component_token->size);
+        } else if (component_token->type == TCL_TOKEN_VARIABLE) {
+            if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, j, name, cmd_ds_ptr,
+                                                  THTML_ESCAPE_NONE)) {
                 return TCL_ERROR;
             }
-
-            j = i;
+        } else if (component_token->type == TCL_TOKEN_COMMAND) {
+            if (TCL_OK != thtml_TclAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, j, &j, name,
+                                                       cmd_ds_ptr)) {
+                return TCL_ERROR;
+            }
+            continue;
+        } else {
+            SetResult("error parsing command: unsupported token type");
+            return TCL_ERROR;
         }
+        j += 1 + component_token->numComponents;
+    }
 
-        // puts $__ds_wt1__
-//        Tcl_DStringAppend(ds_ptr, "\nputs $__ds_", -1);
-//        Tcl_DStringAppend(ds_ptr, word_token_name, -1);
-//        Tcl_DStringAppend(ds_ptr, "__", -1);
-
-        // lappend __ds_val1__ $__ds_wt1__
-        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, name, -1);
-        Tcl_DStringAppend(ds_ptr, "__ \\{$__ds_", -1);
-        Tcl_DStringAppend(ds_ptr, word_token_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__\\}", -1);
-
-//        Tcl_DStringAppend(ds_ptr, "\nputs $__ds_", -1);
-//        Tcl_DStringAppend(ds_ptr, name, -1);
-//        Tcl_DStringAppend(ds_ptr, "__", -1);
-
-        // unset __ds_wt1__
-        Tcl_DStringAppend(ds_ptr, "\nunset __ds_", -1);
-        Tcl_DStringAppend(ds_ptr, word_token_name, -1);
-        Tcl_DStringAppend(ds_ptr, "__", -1);
+    if (quoted) {
+        Tcl_DStringAppend(cmd_ds_ptr, "\"", 1);
+    }
+    return TCL_OK;
+}
 
+// appends the command substitution at token "i", e.g. [string length ${x}], to "cmd_ds_ptr"
+static int thtml_TclAppendCommand_Token(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                                        Tcl_Size i, Tcl_Size *out_i, const char *name, Tcl_DString *cmd_ds_ptr) {
+    Tcl_Token *token = &parse_ptr->tokenPtr[i];
 
-        *out_i = i + 1;
-        return TCL_OK;
-    } else if (token->type == TCL_TOKEN_BS) {
-        Tcl_DStringAppend(ds_ptr, token->start, token->size);
-    } else {
-        fprintf(stderr, "TclAppendCommand_Token: other type of token: %d\n", token->type);
+    Tcl_Parse subcmd_parse;
+    if (TCL_OK != Tcl_ParseCommand(interp, token->start + 1, token->size - 2, 0, &subcmd_parse)) {
+        return TCL_ERROR;
+    }
+    Tcl_DStringAppend(cmd_ds_ptr, "[", 1);
+    if (TCL_OK != thtml_TclCompileCommand(interp, codearrVar_ptr, ds_ptr, &subcmd_parse, name, cmd_ds_ptr)) {
+        Tcl_FreeParse(&subcmd_parse);
+        return TCL_ERROR;
     }
+    Tcl_DStringAppend(cmd_ds_ptr, "]", 1);
+    Tcl_FreeParse(&subcmd_parse);
+
     *out_i = i + 1;
     return TCL_OK;
 }
 
-int thtml_TclCompileCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name, int nested) {
+// Appends the command as tcl code that calls it directly, so that it is bytecompiled with the
+// template, e.g. string length ${__dict_1__}. The dict lookups of the template variables that
+// it uses are set in locals by statements in "ds_ptr" before it.
+int thtml_TclCompileCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr,
+                            const char *name, Tcl_DString *cmd_ds_ptr) {
     DBG(fprintf(stderr, "thtml_TclCompileCommand\n"));
 
-    Tcl_Token *token = &parse_ptr->tokenPtr[0];
-
-    Tcl_DStringAppend(ds_ptr, "\n#CompileCommand: ", -1);
-    Tcl_DStringAppend(ds_ptr, token->start, token->size);
-
-    // if it is "expr" command, then call thtml_CCompileExpr
-    if (token->type == TCL_TOKEN_SIMPLE_WORD) {
-        if (token->size == 4 && 0 == strncmp(token->start, "expr", 4)) {
-
-//            Tcl_Token *expr_token1 = &parse_ptr->tokenPtr[0];
-//
-//            fprintf(stderr, "numTokens: %ld\n", parse_ptr->numTokens);
-//            fprintf(stderr, "expr_token->type: %d\n", expr_token1->type);
-//            fprintf(stderr, "expr_token->size: %ld\n", expr_token1->size);
-//            fprintf(stderr, "expr_token->start: %s\n", expr_token1->start);
-//            fprintf(stderr, "expr_token->numComponents: %ld\n", expr_token1->numComponents);
-
-            if (parse_ptr->numTokens == 4) {
-                // handles the case when: expr { $x + $y }
-                Tcl_Token *expr_token = &parse_ptr->tokenPtr[2];
-
-                Tcl_Parse expr_parse;
-                if (TCL_OK != Tcl_ParseExpr(interp, expr_token->start + 1, expr_token->size - 2, &expr_parse)) {
-                    Tcl_FreeParse(&expr_parse);
-                    return TCL_ERROR;
-                }
-
+    if (parse_ptr->numWords == 0) {
+        return TCL_OK;
+    }
 
-                if (TCL_OK != thtml_TclCompileExpr(interp, codearrVar_ptr, ds_ptr, &expr_parse, name)) {
-                    Tcl_FreeParse(&expr_parse);
-                    return TCL_ERROR;
-                }
+    Tcl_Token *token = &parse_ptr->tokenPtr[0];
+    Tcl_Size i = 0;
+
+    // handles the case when: expr { $x + $y }
+    if (parse_ptr->numWords == 2 && thtml_TclIsWord(token, "expr")) {
+        Tcl_Token *expr_token = &parse_ptr->tokenPtr[2];
+        if (expr_token->type == TCL_TOKEN_SIMPLE_WORD && expr_token->start[0] == '{') {
+            Tcl_Parse expr_parse;
+            if (TCL_OK != Tcl_ParseExpr(interp, expr_token->start + 1, expr_token->size - 2, &expr_parse)) {
                 Tcl_FreeParse(&expr_parse);
-
-                return TCL_OK;
-
+                return TCL_ERROR;
             }
-
+            if (TCL_OK != thtml_TclAppendExpr(interp, codearrVar_ptr, ds_ptr, &expr_parse, name, cmd_ds_ptr)) {
+                Tcl_FreeParse(&expr_parse);
+                return TCL_ERROR;
+            }
+            Tcl_FreeParse(&expr_parse);
+            return TCL_OK;
         }
     }
 
-    Tcl_DStringAppend(ds_ptr, "\n#CompileCommand: numTokens=", -1);
-    Tcl_DStringAppend(ds_ptr, Tcl_GetString(Tcl_NewIntObj(parse_ptr->numTokens)), -1);
-
-//    if (nested) {
-//        Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-//        Tcl_DStringAppend(ds_ptr, name, -1);
-//        Tcl_DStringAppend(ds_ptr, "__ {[}", -1);
-//    }
+    // a return gives its value, as it did when the command was evaluated in a script of its own
+    if (thtml_TclIsWord(token, "return")) {
+        Tcl_DStringAppend(cmd_ds_ptr, "return -level 0", -1);
+        i = 1 + token->numComponents;
+    }
 
-    Tcl_Size i = 1;
-    int first = 1;
     while (i < parse_ptr->numTokens) {
-        if (!first) {
-            Tcl_DStringAppend(ds_ptr, "\nappend __ds_", -1);
-            Tcl_DStringAppend(ds_ptr, name, -1);
-            Tcl_DStringAppend(ds_ptr, "__ { }", -11);
+        if (i > 0) {
+            Tcl_DStringAppend(cmd_ds_ptr, " ", 1);
         }
-
-        if (TCL_OK != thtml_TclAppendCommand_Token(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, &i, name, NULL, 1)) {
-            fprintf(stderr, "thtml_TclAppendCommand_Token failed\n");
+        if (TCL_OK != thtml_TclAppendCommand_Word(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, &i, name, cmd_ds_ptr)) {
             return TCL_ERROR;
         }
-
-        first = 0;
-        // fprintf(stderr, "i: %d / %d\n", i, parse_ptr->numTokens);
     }
 
     return TCL_OK;
 }
+
 int
 thtml_TclCompileForeachList(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name) {
     Tcl_DStringAppend(ds_ptr, "\nset __ds_", -1);
@@ -1065,7 +1178,7 @@ thtml_TclCompileForeachList(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DSt
             Tcl_DStringAppend(ds_ptr, token->start, token->size);
         } else if (token->type == TCL_TOKEN_COMMAND) {
 
-            foreach_cmd_count++;
+            int foreach_cmd_count = thtml_NextCount(interp, codearrVar_ptr, "foreach_cmd_count");
 
             char cmd_name[64];
             snprintf(cmd_name, 64, "forcmd%d", foreach_cmd_count);
@@ -1076,42 +1189,28 @@ thtml_TclCompileForeachList(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DSt
                 return TCL_ERROR;
             }
 
+            // lappend __ds_list1__ [lrange ${__dict_1__} 0 1]
             Tcl_DString cmd_ds;
             Tcl_DStringInit(&cmd_ds);
+            Tcl_DStringAppend(&cmd_ds, "\nlappend __ds_", -1);
+            Tcl_DStringAppend(&cmd_ds, name, -1);
+            Tcl_DStringAppend(&cmd_ds, "__ [", -1);
 
             if (TCL_OK !=
-                thtml_TclCompileCommand(interp, codearrVar_ptr, &cmd_ds, &cmd_parse, cmd_name, 0)) {
+                thtml_TclCompileCommand(interp, codearrVar_ptr, ds_ptr, &cmd_parse, cmd_name, &cmd_ds)) {
                 Tcl_FreeParse(&cmd_parse);
                 Tcl_DStringFree(&cmd_ds);
                 return TCL_ERROR;
             }
 
-            // Tcl_DStringInit(__ds_forcmd1__);
-            Tcl_DStringAppend(ds_ptr, "\nset __ds_", -1);
-            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__ {}", -1);
-
+            Tcl_DStringAppend(&cmd_ds, "]", 1);
             Tcl_DStringAppend(ds_ptr, Tcl_DStringValue(&cmd_ds), Tcl_DStringLength(&cmd_ds));
             Tcl_DStringFree(&cmd_ds);
 
-            // set __forcmd1_res__ [::thtml::runtime::tcl::evaluate_script $__ds_forcmd1__]
-            Tcl_DStringAppend(ds_ptr, "\nset __", -1);
-            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "_res__ [::thtml::runtime::tcl::evaluate_script $__ds_", -1);
-            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "__]", -1);
-
-            // lappend __ds_list1__ $__forcmd1__
-            Tcl_DStringAppend(ds_ptr, "\nlappend __ds_", -1);
-            Tcl_DStringAppend(ds_ptr, name, -1);
-            Tcl_DStringAppend(ds_ptr, "__ $__", -1);
-            Tcl_DStringAppend(ds_ptr, cmd_name, -1);
-            Tcl_DStringAppend(ds_ptr, "_res__", -1);
-
             Tcl_FreeParse(&cmd_parse);
 
         } else if (token->type == TCL_TOKEN_VARIABLE) {
-            if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, NULL, 0)) {
+            if (TCL_OK != thtml_TclAppendVariable(interp, codearrVar_ptr, ds_ptr, parse_ptr, i, name, NULL, THTML_ESCAPE_NONE)) {
                 return TCL_ERROR;
             }
             i++;
@@ -18,8 +18,8 @@ int thtml_TclCompileForeachListCmd(ClientData  clientData, Tcl_Interp *interp, i
 
 int thtml_TclCompileExpr(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name);
 int thtml_TclCompileQuotedString(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name);
-int thtml_TclCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr);
-int thtml_TclCompileCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name, int nested);
-int thtml_TclAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, Tcl_Size i, const char *name, Tcl_DString *cmd_ds_ptr, int in_eval_p);
+int thtml_TclCompileTemplateText(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, int escape);
+int thtml_TclCompileCommand(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, const char *name, Tcl_DString *cmd_ds_ptr);
+int thtml_TclAppendVariable(Tcl_Interp *interp, Tcl_Obj *codearrVar_ptr, Tcl_DString *ds_ptr, Tcl_Parse *parse_ptr, Tcl_Size i, const char *name, Tcl_DString *cmd_ds_ptr, int escape);
 
 #endif //THTML_COMPILER_TCL_H
@@ -0,0 +1,163 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "dispatch.h"
+
+#include <stdio.h>
+
+// Maps the filenames given to renderfile in cached mode to the command of the compiled template.
+// The table is filled in when the compiled templates are loaded, filenames spelled any other way
+// are resolved once through ::thtml::cache::resolve and then remembered if the template exists.
+// The command name objects are kept in the table, so Tcl caches their resolution to a command
+// as well.
+
+#define THTML_DISPATCH_ASSOC_KEY "thtml-dispatch"
+
+static void thtml_DispatchFree(ClientData clientData, Tcl_Interp *interp) {
+    UNUSED(interp);
+    Tcl_HashTable *table_ptr = (Tcl_HashTable *) clientData;
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry_ptr = Tcl_FirstHashEntry(table_ptr, &search);
+         entry_ptr != NULL; entry_ptr = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry_ptr));
+    }
+    Tcl_DeleteHashTable(table_ptr);
+    Tcl_Free((char *) table_ptr);
+}
+
+static Tcl_HashTable *thtml_GetDispatchTable(Tcl_Interp *interp) {
+    Tcl_HashTable *table_ptr = (Tcl_HashTable *) Tcl_GetAssocData(interp, THTML_DISPATCH_ASSOC_KEY, NULL);
+    if (table_ptr == NULL) {
+        table_ptr = (Tcl_HashTable *) Tcl_Alloc(sizeof(Tcl_HashTable));
+        Tcl_InitHashTable(table_ptr, TCL_STRING_KEYS);
+        Tcl_SetAssocData(interp, THTML_DISPATCH_ASSOC_KEY, thtml_DispatchFree, table_ptr);
+    }
+    return table_ptr;
+}
+
+static void thtml_DispatchSet(Tcl_HashTable *table_ptr, const char *filename, Tcl_Obj *cmd_name_ptr) {
+    int is_new;
+    Tcl_HashEntry *entry_ptr = Tcl_CreateHashEntry(table_ptr, filename, &is_new);
+    if (!is_new) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry_ptr));
+    }
+    Tcl_IncrRefCount(cmd_name_ptr);
+    Tcl_SetHashValue(entry_ptr, cmd_name_ptr);
+}
+
+int thtml_DispatchSetCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "DispatchSetCmd\n"));
+
+    CheckArgs(3, 3, 1, "filename cmd_name");
+
+    thtml_DispatchSet(thtml_GetDispatchTable(interp), Tcl_GetString(objv[1]), objv[2]);
+    return TCL_OK;
+}
+
+int thtml_DispatchRenderFileCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "DispatchRenderFileCmd\n"));
+
+    CheckArgs(3, 5, 1, "filename data ?doctype? ?sink?");
+
+    Tcl_HashTable *table_ptr = thtml_GetDispatchTable(interp);
+    const char *filename = Tcl_GetString(objv[1]);
+    Tcl_HashEntry *entry_ptr = Tcl_FindHashEntry(table_ptr, filename);
+
+    // the table may change while the template renders, so hold on to the command name
+    Tcl_Obj *cmd_name_ptr;
+    if (entry_ptr != NULL) {
+        cmd_name_ptr = (Tcl_Obj *) Tcl_GetHashValue(entry_ptr);
+        Tcl_IncrRefCount(cmd_name_ptr);
+    } else {
+        Tcl_Obj *resolve_objv[2] = {Tcl_NewStringObj("::thtml::cache::resolve", -1), objv[1]};
+        Tcl_IncrRefCount(resolve_objv[0]);
+        int code = Tcl_EvalObjv(interp, 2, resolve_objv, TCL_EVAL_GLOBAL);
+        Tcl_DecrRefCount(resolve_objv[0]);
+        if (code != TCL_OK) {
+            return code;
+        }
+        cmd_name_ptr = Tcl_GetObjResult(interp);
+        Tcl_IncrRefCount(cmd_name_ptr);
+        Tcl_ResetResult(interp);
+        // only the filenames of compiled templates are remembered, so that unknown names that
+        // come from requests do not grow the table
+        if (Tcl_GetCommandFromObj(interp, cmd_name_ptr) != NULL) {
+            thtml_DispatchSet(table_ptr, filename, cmd_name_ptr);
+        }
+    }
+
+    Tcl_Obj *render_objv[4] = {cmd_name_ptr, objv[2], objc > 3 ? objv[3] : NULL, objc > 4 ? objv[4] : NULL};
+    int code = Tcl_EvalObjv(interp, objc - 1, render_objv, 0);
+    Tcl_DecrRefCount(cmd_name_ptr);
+    return code;
+}
+
+// A template given to render keeps the name of the command of its compiled form as its
+// internal rep, so rendering the same Tcl_Obj again neither hashes the template text nor
+// builds the command name. The internal rep goes away as soon as the string changes.
+
+static void thtml_TemplateFreeInternalRep(Tcl_Obj *obj_ptr);
+static void thtml_TemplateDupInternalRep(Tcl_Obj *src_ptr, Tcl_Obj *dup_ptr);
+
+static const Tcl_ObjType thtml_TemplateObjType = {
+        "thtml-template",
+        thtml_TemplateFreeInternalRep,
+        thtml_TemplateDupInternalRep,
+        NULL,
+        NULL,
+#ifdef TCL_OBJTYPE_V0
+        TCL_OBJTYPE_V0
+#endif
+};
+
+static void thtml_TemplateFreeInternalRep(Tcl_Obj *obj_ptr) {
+    Tcl_DecrRefCount((Tcl_Obj *) obj_ptr->internalRep.twoPtrValue.ptr1);
+}
+
+static void thtml_TemplateDupInternalRep(Tcl_Obj *src_ptr, Tcl_Obj *dup_ptr) {
+    Tcl_Obj *cmd_name_ptr = (Tcl_Obj *) src_ptr->internalRep.twoPtrValue.ptr1;
+    Tcl_IncrRefCount(cmd_name_ptr);
+    dup_ptr->internalRep.twoPtrValue.ptr1 = cmd_name_ptr;
+    dup_ptr->internalRep.twoPtrValue.ptr2 = NULL;
+    dup_ptr->typePtr = &thtml_TemplateObjType;
+}
+
+static Tcl_Obj *thtml_GetTemplateCommandFromObj(Tcl_Obj *template_ptr) {
+    if (template_ptr->typePtr == &thtml_TemplateObjType) {
+        return (Tcl_Obj *) template_ptr->internalRep.twoPtrValue.ptr1;
+    }
+
+    char hex[33];
+    thtml_Md5Hex(Tcl_GetString(template_ptr), hex);
+    Tcl_Obj *cmd_name_ptr = Tcl_ObjPrintf("::thtml::cache::__template__%s", hex);
+    Tcl_IncrRefCount(cmd_name_ptr);
+
+    // the string rep was generated above, it stays valid for the new internal rep
+    if (template_ptr->typePtr != NULL && template_ptr->typePtr->freeIntRepProc != NULL) {
+        template_ptr->typePtr->freeIntRepProc(template_ptr);
+    }
+    template_ptr->internalRep.twoPtrValue.ptr1 = cmd_name_ptr;
+    template_ptr->internalRep.twoPtrValue.ptr2 = NULL;
+    template_ptr->typePtr = &thtml_TemplateObjType;
+    return cmd_name_ptr;
+}
+
+int thtml_DispatchRenderCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "DispatchRenderCmd\n"));
+
+    CheckArgs(3, 5, 1, "template data ?doctype? ?sink?");
+
+    // the template may lose its internal rep while it renders, so hold on to the command name
+    Tcl_Obj *cmd_name_ptr = thtml_GetTemplateCommandFromObj(objv[1]);
+    Tcl_Obj *render_objv[4] = {cmd_name_ptr, objv[2], objc > 3 ? objv[3] : NULL, objc > 4 ? objv[4] : NULL};
+    Tcl_IncrRefCount(cmd_name_ptr);
+    int code = Tcl_EvalObjv(interp, objc - 1, render_objv, 0);
+    Tcl_DecrRefCount(cmd_name_ptr);
+    return code;
+}
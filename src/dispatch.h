@@ -0,0 +1,16 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef THTML_DISPATCH_H
+#define THTML_DISPATCH_H
+
+#include "common.h"
+
+int thtml_DispatchSetCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_DispatchRenderCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_DispatchRenderFileCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+
+#endif //THTML_DISPATCH_H
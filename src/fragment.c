@@ -0,0 +1,285 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "fragment.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The fragments are kept in a hash table by key and in a list from the most to the least
+// recently used one. When the bytes they take go over the bound, the least recently used
+// ones are evicted. A fragment that has expired is dropped when it is looked up.
+
+#define THTML_FRAGMENT_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct thtml_fragment_s {
+    Tcl_HashEntry *entry_ptr;
+    char *bytes;
+    Tcl_Size length;
+    // what the fragment takes in the cache, along with its key and bookkeeping
+    Tcl_WideInt size;
+    // in microseconds, 0 if it does not expire
+    Tcl_WideInt expires;
+    struct thtml_fragment_s *prev;
+    struct thtml_fragment_s *next;
+} thtml_fragment_t;
+
+typedef struct {
+    int initialized;
+    Tcl_HashTable fragments;
+    thtml_fragment_t *head;
+    thtml_fragment_t *tail;
+    Tcl_WideInt bytes;
+    Tcl_WideInt max_bytes;
+    Tcl_WideInt hits;
+    Tcl_WideInt misses;
+    Tcl_WideInt evictions;
+} thtml_fragment_cache_t;
+
+static Tcl_Mutex thtml_FragmentMutex;
+static thtml_fragment_cache_t thtml_FragmentCache;
+
+static Tcl_WideInt thtml_FragmentNow() {
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (Tcl_WideInt) now.sec * 1000000 + now.usec;
+}
+
+// the functions below expect the mutex to be held
+
+static thtml_fragment_cache_t *thtml_FragmentGetCache() {
+    thtml_fragment_cache_t *cache = &thtml_FragmentCache;
+    if (!cache->initialized) {
+        Tcl_InitHashTable(&cache->fragments, TCL_STRING_KEYS);
+        cache->max_bytes = THTML_FRAGMENT_MAX_BYTES;
+        cache->initialized = 1;
+    }
+    return cache;
+}
+
+static void thtml_FragmentUnlink(thtml_fragment_cache_t *cache, thtml_fragment_t *fragment) {
+    if (fragment->prev != NULL) {
+        fragment->prev->next = fragment->next;
+    } else {
+        cache->head = fragment->next;
+    }
+    if (fragment->next != NULL) {
+        fragment->next->prev = fragment->prev;
+    } else {
+        cache->tail = fragment->prev;
+    }
+    fragment->prev = NULL;
+    fragment->next = NULL;
+}
+
+static void thtml_FragmentLinkFirst(thtml_fragment_cache_t *cache, thtml_fragment_t *fragment) {
+    fragment->prev = NULL;
+    fragment->next = cache->head;
+    if (cache->head != NULL) {
+        cache->head->prev = fragment;
+    } else {
+        cache->tail = fragment;
+    }
+    cache->head = fragment;
+}
+
+static void thtml_FragmentDelete(thtml_fragment_cache_t *cache, thtml_fragment_t *fragment) {
+    thtml_FragmentUnlink(cache, fragment);
+    Tcl_DeleteHashEntry(fragment->entry_ptr);
+    cache->bytes -= fragment->size;
+    Tcl_Free(fragment->bytes);
+    Tcl_Free((char *) fragment);
+}
+
+static void thtml_FragmentEvict(thtml_fragment_cache_t *cache) {
+    while (cache->bytes > cache->max_bytes && cache->tail != NULL) {
+        thtml_FragmentDelete(cache, cache->tail);
+        cache->evictions++;
+    }
+}
+
+static int thtml_FragmentGet(const char *key, Tcl_DString *dsPtr) {
+    Tcl_MutexLock(&thtml_FragmentMutex);
+    thtml_fragment_cache_t *cache = thtml_FragmentGetCache();
+
+    thtml_fragment_t *fragment = NULL;
+    Tcl_HashEntry *entry_ptr = Tcl_FindHashEntry(&cache->fragments, key);
+    if (entry_ptr != NULL) {
+        fragment = (thtml_fragment_t *) Tcl_GetHashValue(entry_ptr);
+        if (fragment->expires != 0 && fragment->expires <= thtml_FragmentNow()) {
+            thtml_FragmentDelete(cache, fragment);
+            fragment = NULL;
+        }
+    }
+
+    if (fragment == NULL) {
+        cache->misses++;
+        Tcl_MutexUnlock(&thtml_FragmentMutex);
+        return 0;
+    }
+
+    cache->hits++;
+    thtml_FragmentUnlink(cache, fragment);
+    thtml_FragmentLinkFirst(cache, fragment);
+    // copied while the lock is held, another thread may evict the fragment as soon as it is released
+    Tcl_DStringAppend(dsPtr, fragment->bytes, fragment->length);
+    Tcl_MutexUnlock(&thtml_FragmentMutex);
+    return 1;
+}
+
+static void thtml_FragmentPut(const char *key, const char *bytes, Tcl_Size length, Tcl_WideInt ttl) {
+    Tcl_WideInt size = (Tcl_WideInt) (length + strlen(key) + sizeof(thtml_fragment_t) + sizeof(Tcl_HashEntry));
+    Tcl_WideInt expires = ttl > 0 ? thtml_FragmentNow() + ttl * 1000000 : 0;
+
+    // the copy is made before the lock is taken, the other threads only wait for the bookkeeping
+    char *copy = Tcl_Alloc(length > 0 ? length : 1);
+    memcpy(copy, bytes, length);
+
+    Tcl_MutexLock(&thtml_FragmentMutex);
+    thtml_fragment_cache_t *cache = thtml_FragmentGetCache();
+
+    Tcl_HashEntry *entry_ptr = Tcl_FindHashEntry(&cache->fragments, key);
+    if (entry_ptr != NULL) {
+        thtml_FragmentDelete(cache, (thtml_fragment_t *) Tcl_GetHashValue(entry_ptr));
+    }
+
+    // a fragment bigger than the whole cache would only evict everything else
+    if (size > cache->max_bytes) {
+        Tcl_MutexUnlock(&thtml_FragmentMutex);
+        Tcl_Free(copy);
+        return;
+    }
+
+    thtml_fragment_t *fragment = (thtml_fragment_t *) Tcl_Alloc(sizeof(thtml_fragment_t));
+    int is_new;
+    fragment->entry_ptr = Tcl_CreateHashEntry(&cache->fragments, key, &is_new);
+    fragment->bytes = copy;
+    fragment->length = length;
+    fragment->size = size;
+    fragment->expires = expires;
+    Tcl_SetHashValue(fragment->entry_ptr, fragment);
+    thtml_FragmentLinkFirst(cache, fragment);
+    cache->bytes += size;
+
+    thtml_FragmentEvict(cache);
+    Tcl_MutexUnlock(&thtml_FragmentMutex);
+}
+
+static const __thtml_fragment_cache_t thtml_FragmentFunctions = {thtml_FragmentGet, thtml_FragmentPut};
+
+void thtml_FragmentRegister(Tcl_Interp *interp) {
+    Tcl_SetAssocData(interp, THTML_FRAGMENT_ASSOC_KEY, NULL, (ClientData) &thtml_FragmentFunctions);
+}
+
+int thtml_FragmentGetCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "FragmentGetCmd\n"));
+
+    CheckArgs(3, 3, 1, "key varName");
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    if (!thtml_FragmentGet(Tcl_GetString(objv[1]), &ds)) {
+        Tcl_DStringFree(&ds);
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(0));
+        return TCL_OK;
+    }
+
+    Tcl_Obj *value_ptr = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    if (Tcl_ObjSetVar2(interp, objv[2], NULL, value_ptr, TCL_LEAVE_ERR_MSG) == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(1));
+    return TCL_OK;
+}
+
+int thtml_FragmentPutCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "FragmentPutCmd\n"));
+
+    CheckArgs(4, 4, 1, "key ttl value");
+
+    Tcl_WideInt ttl;
+    if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[2], &ttl)) {
+        return TCL_ERROR;
+    }
+
+    Tcl_Size length;
+    const char *bytes = Tcl_GetStringFromObj(objv[3], &length);
+    thtml_FragmentPut(Tcl_GetString(objv[1]), bytes, length, ttl);
+    return TCL_OK;
+}
+
+int thtml_FragmentMaxBytesCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "FragmentMaxBytesCmd\n"));
+
+    CheckArgs(1, 2, 1, "?max_bytes?");
+
+    Tcl_WideInt max_bytes = -1;
+    if (objc == 2) {
+        if (TCL_OK != Tcl_GetWideIntFromObj(interp, objv[1], &max_bytes)) {
+            return TCL_ERROR;
+        }
+        if (max_bytes < 0) {
+            SetResult("max_bytes must not be negative");
+            return TCL_ERROR;
+        }
+    }
+
+    Tcl_MutexLock(&thtml_FragmentMutex);
+    thtml_fragment_cache_t *cache = thtml_FragmentGetCache();
+    if (max_bytes >= 0) {
+        cache->max_bytes = max_bytes;
+        thtml_FragmentEvict(cache);
+    }
+    max_bytes = cache->max_bytes;
+    Tcl_MutexUnlock(&thtml_FragmentMutex);
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(max_bytes));
+    return TCL_OK;
+}
+
+int thtml_FragmentStatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "FragmentStatsCmd\n"));
+
+    CheckArgs(1, 1, 1, "");
+
+    Tcl_MutexLock(&thtml_FragmentMutex);
+    thtml_fragment_cache_t *cache = thtml_FragmentGetCache();
+    Tcl_WideInt values[] = {cache->fragments.numEntries, cache->bytes, cache->max_bytes,
+                            cache->hits, cache->misses, cache->evictions};
+    Tcl_MutexUnlock(&thtml_FragmentMutex);
+
+    static const char *const names[] = {"entries", "bytes", "max_bytes", "hits", "misses", "evictions"};
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj(names[i], -1), Tcl_NewWideIntObj(values[i]));
+    }
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
+
+// drops all fragments and resets the counters
+int thtml_FragmentClearCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "FragmentClearCmd\n"));
+
+    CheckArgs(1, 1, 1, "");
+
+    Tcl_MutexLock(&thtml_FragmentMutex);
+    thtml_fragment_cache_t *cache = thtml_FragmentGetCache();
+    while (cache->head != NULL) {
+        thtml_FragmentDelete(cache, cache->head);
+    }
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    Tcl_MutexUnlock(&thtml_FragmentMutex);
+    return TCL_OK;
+}
@@ -0,0 +1,21 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef THTML_FRAGMENT_CACHE_H
+#define THTML_FRAGMENT_CACHE_H
+
+#include "common.h"
+#include "thtml_fragment.h"
+
+void thtml_FragmentRegister(Tcl_Interp *interp);
+
+int thtml_FragmentGetCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_FragmentPutCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_FragmentMaxBytesCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_FragmentStatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_FragmentClearCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+
+#endif //THTML_FRAGMENT_CACHE_H
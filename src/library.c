@@ -8,12 +8,22 @@
 #include "library.h"
 #include "compiler_tcl.h"
 #include "compiler_c.h"
+#include "dispatch.h"
+#include "watch.h"
+#include "fragment.h"
+#include "stats.h"
+#include "util.h"
 #include "md5.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
-static int           thtml_ModuleInitialized;
+typedef struct {
+    int initialized;
+} thtml_ThreadData;
+
+static Tcl_ThreadDataKey thtml_DataKey;
 
 static int thtml_Md5Cmd(ClientData  clientData, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[]) {
     UNUSED(clientData);
@@ -21,15 +31,8 @@ static int thtml_Md5Cmd(ClientData  clientData, Tcl_Interp *interp, int objc, Tc
 
     CheckArgs(2,2,1,"text");
 
-    Tcl_Size text_length;
-    char *text = Tcl_GetStringFromObj(objv[1], &text_length);
-
-    unsigned char result[16];
-    md5String(text, result);
     char hex[33];
-    for (int i = 0; i < 16; i++) {
-        sprintf(hex + (i * 2), "%02x", result[i]);
-    }
+    thtml_Md5Hex(Tcl_GetString(objv[1]), hex);
     Tcl_SetObjResult(interp, Tcl_NewStringObj(hex, 32));
     return TCL_OK;
 }
@@ -39,10 +42,12 @@ static void thtml_ExitHandler(ClientData unused) {
 }
 
 
+// the exit handler belongs to the thread, so it is registered once in every thread that loads thtml
 void thtml_InitModule() {
-    if (!thtml_ModuleInitialized) {
+    thtml_ThreadData *tsd_ptr = (thtml_ThreadData *) Tcl_GetThreadData(&thtml_DataKey, sizeof(thtml_ThreadData));
+    if (!tsd_ptr->initialized) {
         Tcl_CreateThreadExitHandler(thtml_ExitHandler, NULL);
-        thtml_ModuleInitialized = 1;
+        tsd_ptr->initialized = 1;
     }
 }
 
@@ -67,6 +72,69 @@ int thtml_EscapeTemplateCmd(ClientData  clientData, Tcl_Interp *interp, int objc
 
 }
 
+// escapes a value for the output context given in clientData, returns the value itself when nothing needs escaping
+static int thtml_EscapeCmd(ClientData  clientData, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[]) {
+    DBG(fprintf(stderr,"EscapeCmd\n"));
+
+    CheckArgs(2,2,1,"value");
+
+    int escape = (int) (intptr_t) clientData;
+
+    Tcl_Size value_length;
+    const char *value = Tcl_GetStringFromObj(objv[1], &value_length);
+
+    if (!__thtml_needs_escape__(value, value_length, escape)) {
+        Tcl_SetObjResult(interp, objv[1]);
+        return TCL_OK;
+    }
+
+    Tcl_DString ds;
+    Tcl_DStringInit(&ds);
+    __thtml_append_escaped__(&ds, value, value_length, escape);
+    Tcl_DStringResult(interp, &ds);
+    return TCL_OK;
+}
+
+// looks up a key of the template data in the layer of the current scope and then
+// in the layers of its parents, innermost first, or returns the default if given
+static int thtml_ScopeGetCmd(ClientData  clientData, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr,"ScopeGetCmd\n"));
+
+    CheckArgs(4,5,1,"data parents key ?default?");
+
+    Tcl_Obj *value_ptr;
+    if (TCL_OK != Tcl_DictObjGet(interp, objv[1], objv[3], &value_ptr)) {
+        return TCL_ERROR;
+    }
+
+    if (value_ptr == NULL) {
+        Tcl_Size num_parents;
+        Tcl_Obj **parents;
+        if (TCL_OK != Tcl_ListObjGetElements(interp, objv[2], &num_parents, &parents)) {
+            return TCL_ERROR;
+        }
+        for (Tcl_Size i = 0; i < num_parents && value_ptr == NULL; i++) {
+            if (TCL_OK != Tcl_DictObjGet(interp, parents[i], objv[3], &value_ptr)) {
+                return TCL_ERROR;
+            }
+        }
+    }
+
+    if (value_ptr == NULL) {
+        if (objc == 5) {
+            Tcl_SetObjResult(interp, objv[4]);
+            return TCL_OK;
+        }
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("key \"%s\" not known in dictionary", Tcl_GetString(objv[3])));
+        Tcl_SetErrorCode(interp, "TCL", "LOOKUP", "DICT", Tcl_GetString(objv[3]), NULL);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, value_ptr);
+    return TCL_OK;
+}
+
 #define MIN_VERSION "9.0"
 
 int Thtml_Init(Tcl_Interp *interp) {
@@ -92,14 +160,50 @@ int Thtml_Init(Tcl_Interp *interp) {
 
     Tcl_CreateObjCommand(interp, "::thtml::compiler::c_transform", thtml_CTransformCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::thtml::compiler::c_compile_expr", thtml_CCompileExprCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::compiler::c_compile_condition", thtml_CCompileConditionCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::thtml::compiler::c_compile_quoted_string", thtml_CCompileQuotedStringCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::thtml::compiler::c_compile_template_text", thtml_CCompileTemplateTextCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::thtml::compiler::c_compile_script", thtml_CCompileScriptCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::thtml::compiler::c_compile_foreach_list", thtml_CCompileForeachListCmd, NULL, NULL);
     Tcl_CreateObjCommand(interp, "::thtml::compiler::c_compile_quoted_arg", thtml_CCompileQuotedArgCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::compiler::c_literal", thtml_CLiteralCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::compiler::c_remap_literals", thtml_CRemapLiteralsCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::thtml::runtime::tcl::escape_text", thtml_EscapeCmd, (ClientData) (intptr_t) THTML_ESCAPE_TEXT, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::runtime::tcl::escape_attr", thtml_EscapeCmd, (ClientData) (intptr_t) THTML_ESCAPE_ATTR, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::runtime::tcl::escape_url", thtml_EscapeCmd, (ClientData) (intptr_t) THTML_ESCAPE_URL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::runtime::tcl::escape_url_start", thtml_EscapeCmd, (ClientData) (intptr_t) THTML_ESCAPE_URL_START, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::runtime::tcl::scope_get", thtml_ScopeGetCmd, NULL, NULL);
+
+    Tcl_CreateObjCommand(interp, "::thtml::cache::dispatch_set", thtml_DispatchSetCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::cache::render", thtml_DispatchRenderCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::cache::renderfile", thtml_DispatchRenderFileCmd, NULL, NULL);
+
+    Tcl_CreateNamespace(interp, "::thtml::watch", NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::watch::watch_start", thtml_WatchStartCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::watch::watch_stop", thtml_WatchStopCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::watch::watch_dir", thtml_WatchDirCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::watch::watch_supported", thtml_WatchSupportedCmd, NULL, NULL);
+
+    Tcl_CreateNamespace(interp, "::thtml::fragment", NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::fragment::get", thtml_FragmentGetCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::fragment::put", thtml_FragmentPutCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::fragment::max_bytes", thtml_FragmentMaxBytesCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::fragment::stats", thtml_FragmentStatsCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::fragment::clear", thtml_FragmentClearCmd, NULL, NULL);
+    thtml_FragmentRegister(interp);
+
+    Tcl_CreateNamespace(interp, "::thtml::stats", NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::stats", thtml_StatsCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::stats::enter", thtml_StatsEnterCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::stats::leave", thtml_StatsLeaveCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::stats::flushed", thtml_StatsFlushedCmd, NULL, NULL);
+    thtml_StatsRegister(interp);
 
     Tcl_CreateNamespace(interp, "::thmtl::util", NULL, NULL);
     Tcl_CreateObjCommand(interp, "::thtml::util::md5", thtml_Md5Cmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::util::find_files", thtml_FindFilesCmd, NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::thtml::util::num_cpus", thtml_NumCpusCmd, NULL, NULL);
 
     return Tcl_PkgProvide(interp, "thtml", XSTR(PROJECT_VERSION));
 }
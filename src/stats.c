@@ -0,0 +1,206 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// The counters of an interp are kept in a hash table by the name of the template or include.
+// The C templates record a call through the functions of __thtml_stats_t, the tcl ones through
+// the ::thtml::stats::enter and ::thtml::stats::leave commands.
+
+typedef struct {
+    Tcl_WideInt calls;
+    Tcl_WideInt total_us;
+    Tcl_WideInt max_us;
+    Tcl_WideInt bytes;
+} thtml_stats_entry_t;
+
+typedef struct {
+    // first, so that the compiled templates see the interp stats as __thtml_stats_t
+    __thtml_stats_t shared;
+    Tcl_HashTable entries;
+} thtml_stats_interp_t;
+
+static Tcl_WideInt thtml_StatsNow() {
+#ifdef _WIN32
+    Tcl_Time now;
+    Tcl_GetTime(&now);
+    return (Tcl_WideInt) now.sec * 1000000 + now.usec;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (Tcl_WideInt) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+static void thtml_StatsRecord(__thtml_stats_t *stats, const char *name, Tcl_WideInt us, Tcl_WideInt bytes) {
+    thtml_stats_interp_t *interp_stats = (thtml_stats_interp_t *) stats;
+    int is_new;
+    Tcl_HashEntry *entry_ptr = Tcl_CreateHashEntry(&interp_stats->entries, name, &is_new);
+    thtml_stats_entry_t *entry;
+    if (is_new) {
+        entry = (thtml_stats_entry_t *) Tcl_Alloc(sizeof(thtml_stats_entry_t));
+        memset(entry, 0, sizeof(thtml_stats_entry_t));
+        Tcl_SetHashValue(entry_ptr, entry);
+    } else {
+        entry = (thtml_stats_entry_t *) Tcl_GetHashValue(entry_ptr);
+    }
+    entry->calls++;
+    entry->total_us += us;
+    if (us > entry->max_us) {
+        entry->max_us = us;
+    }
+    entry->bytes += bytes;
+}
+
+static void thtml_StatsReset(thtml_stats_interp_t *interp_stats) {
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry_ptr = Tcl_FirstHashEntry(&interp_stats->entries, &search);
+         entry_ptr != NULL; entry_ptr = Tcl_NextHashEntry(&search)) {
+        Tcl_Free((char *) Tcl_GetHashValue(entry_ptr));
+    }
+    Tcl_DeleteHashTable(&interp_stats->entries);
+    Tcl_InitHashTable(&interp_stats->entries, TCL_STRING_KEYS);
+}
+
+static void thtml_StatsFree(ClientData clientData, Tcl_Interp *interp) {
+    UNUSED(interp);
+    thtml_stats_interp_t *interp_stats = (thtml_stats_interp_t *) clientData;
+    thtml_StatsReset(interp_stats);
+    Tcl_DeleteHashTable(&interp_stats->entries);
+    Tcl_Free((char *) interp_stats);
+}
+
+void thtml_StatsRegister(Tcl_Interp *interp) {
+    if (Tcl_GetAssocData(interp, THTML_STATS_ASSOC_KEY, NULL) != NULL) {
+        return;
+    }
+    thtml_stats_interp_t *interp_stats = (thtml_stats_interp_t *) Tcl_Alloc(sizeof(thtml_stats_interp_t));
+    interp_stats->shared.flushed = 0;
+    interp_stats->shared.now = thtml_StatsNow;
+    interp_stats->shared.record = thtml_StatsRecord;
+    Tcl_InitHashTable(&interp_stats->entries, TCL_STRING_KEYS);
+    Tcl_SetAssocData(interp, THTML_STATS_ASSOC_KEY, thtml_StatsFree, interp_stats);
+}
+
+static thtml_stats_interp_t *thtml_GetStats(Tcl_Interp *interp) {
+    thtml_StatsRegister(interp);
+    return (thtml_stats_interp_t *) Tcl_GetAssocData(interp, THTML_STATS_ASSOC_KEY, NULL);
+}
+
+// the position in the output of the tcl template that calls the command, that is the bytes
+// written to sinks so far and the ones in its __ds_default__ variable
+static int thtml_StatsPosition(Tcl_Interp *interp, thtml_stats_interp_t *interp_stats, Tcl_WideInt *position) {
+    Tcl_Obj *ds_ptr = Tcl_GetVar2Ex(interp, "__ds_default__", NULL, TCL_LEAVE_ERR_MSG);
+    if (ds_ptr == NULL) {
+        return TCL_ERROR;
+    }
+    Tcl_Size length;
+    Tcl_GetStringFromObj(ds_ptr, &length);
+    *position = interp_stats->shared.flushed + length;
+    return TCL_OK;
+}
+
+// returns a dict of the counters by template and include name, or resets them
+int thtml_StatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "StatsCmd\n"));
+
+    CheckArgs(1, 2, 1, "?reset?");
+
+    thtml_stats_interp_t *interp_stats = thtml_GetStats(interp);
+    if (objc == 2) {
+        if (strcmp(Tcl_GetString(objv[1]), "reset") != 0) {
+            Tcl_SetObjResult(interp, Tcl_ObjPrintf("bad option \"%s\": must be reset", Tcl_GetString(objv[1])));
+            return TCL_ERROR;
+        }
+        thtml_StatsReset(interp_stats);
+        return TCL_OK;
+    }
+
+    static const char *const names[] = {"calls", "total_us", "max_us", "bytes"};
+    Tcl_Obj *dict_ptr = Tcl_NewDictObj();
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry_ptr = Tcl_FirstHashEntry(&interp_stats->entries, &search);
+         entry_ptr != NULL; entry_ptr = Tcl_NextHashEntry(&search)) {
+        thtml_stats_entry_t *entry = (thtml_stats_entry_t *) Tcl_GetHashValue(entry_ptr);
+        Tcl_WideInt values[] = {entry->calls, entry->total_us, entry->max_us, entry->bytes};
+        Tcl_Obj *counters_ptr = Tcl_NewDictObj();
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            Tcl_DictObjPut(interp, counters_ptr, Tcl_NewStringObj(names[i], -1), Tcl_NewWideIntObj(values[i]));
+        }
+        Tcl_DictObjPut(interp, dict_ptr, Tcl_NewStringObj(Tcl_GetHashKey(&interp_stats->entries, entry_ptr), -1), counters_ptr);
+    }
+    Tcl_SetObjResult(interp, dict_ptr);
+    return TCL_OK;
+}
+
+// the start of a call of a tcl template or include, returns what leave takes
+int thtml_StatsEnterCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "StatsEnterCmd\n"));
+
+    CheckArgs(1, 1, 1, "");
+
+    thtml_stats_interp_t *interp_stats = thtml_GetStats(interp);
+    Tcl_WideInt position;
+    if (TCL_OK != thtml_StatsPosition(interp, interp_stats, &position)) {
+        return TCL_ERROR;
+    }
+
+    Tcl_Obj *frame_objv[2] = {
+        Tcl_NewWideIntObj(thtml_StatsNow()),
+        Tcl_NewWideIntObj(position)
+    };
+    Tcl_SetObjResult(interp, Tcl_NewListObj(2, frame_objv));
+    return TCL_OK;
+}
+
+int thtml_StatsLeaveCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "StatsLeaveCmd\n"));
+
+    CheckArgs(3, 3, 1, "name frame");
+
+    Tcl_Size framec;
+    Tcl_Obj **framev;
+    if (TCL_OK != Tcl_ListObjGetElements(interp, objv[2], &framec, &framev)) {
+        return TCL_ERROR;
+    }
+    Tcl_WideInt start, start_position;
+    if (framec != 2
+        || TCL_OK != Tcl_GetWideIntFromObj(interp, framev[0], &start)
+        || TCL_OK != Tcl_GetWideIntFromObj(interp, framev[1], &start_position)) {
+        SetResult("frame is not one returned by ::thtml::stats::enter");
+        return TCL_ERROR;
+    }
+
+    thtml_stats_interp_t *interp_stats = thtml_GetStats(interp);
+    Tcl_WideInt position;
+    if (TCL_OK != thtml_StatsPosition(interp, interp_stats, &position)) {
+        return TCL_ERROR;
+    }
+
+    thtml_StatsRecord(&interp_stats->shared, Tcl_GetString(objv[1]), thtml_StatsNow() - start,
+                      position - start_position);
+    return TCL_OK;
+}
+
+// counts the output that a tcl template writes to its sink
+int thtml_StatsFlushedCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "StatsFlushedCmd\n"));
+
+    CheckArgs(2, 2, 1, "output");
+
+    Tcl_Size length;
+    Tcl_GetStringFromObj(objv[1], &length);
+    thtml_GetStats(interp)->shared.flushed += length;
+    return TCL_OK;
+}
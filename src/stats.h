@@ -0,0 +1,20 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#ifndef THTML_STATS_COUNTERS_H
+#define THTML_STATS_COUNTERS_H
+
+#include "common.h"
+#include "thtml_stats.h"
+
+void thtml_StatsRegister(Tcl_Interp *interp);
+
+int thtml_StatsCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_StatsEnterCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_StatsLeaveCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+int thtml_StatsFlushedCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]);
+
+#endif //THTML_STATS_COUNTERS_H
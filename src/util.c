@@ -0,0 +1,123 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Walks the directory tree with readdir, the type of an entry comes from the directory itself on
+// most filesystems, so unlike a recursive glob -type there is no stat for every file.
+
+static int thtml_FindFiles(Tcl_Interp *interp, Tcl_DString *path_ds_ptr, const char *pattern, Tcl_Obj *files_ptr) {
+    DIR *dir = opendir(Tcl_DStringValue(path_ds_ptr));
+    if (dir == NULL) {
+        // like glob -nocomplain, directories that cannot be read are skipped
+        return TCL_OK;
+    }
+
+    Tcl_Size path_length = Tcl_DStringLength(path_ds_ptr);
+    Tcl_Obj *subdirs_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(subdirs_ptr);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0'))) {
+            continue;
+        }
+
+        Tcl_DStringSetLength(path_ds_ptr, path_length);
+        Tcl_DStringAppend(path_ds_ptr, "/", 1);
+        Tcl_DStringAppend(path_ds_ptr, entry->d_name, -1);
+
+        int is_dir = 0;
+        int is_file = 0;
+#ifdef _DIRENT_HAVE_D_TYPE
+        if (entry->d_type == DT_DIR) {
+            is_dir = 1;
+        } else if (entry->d_type == DT_REG) {
+            is_file = 1;
+        } else if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+#endif
+        {
+            struct stat st;
+            if (stat(Tcl_DStringValue(path_ds_ptr), &st) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+                is_file = S_ISREG(st.st_mode);
+            }
+        }
+
+        if (is_file && Tcl_StringMatch(entry->d_name, pattern) && access(Tcl_DStringValue(path_ds_ptr), R_OK) == 0) {
+            Tcl_ListObjAppendElement(interp, files_ptr,
+                                     Tcl_NewStringObj(Tcl_DStringValue(path_ds_ptr), Tcl_DStringLength(path_ds_ptr)));
+        } else if (is_dir) {
+            Tcl_ListObjAppendElement(interp, subdirs_ptr, Tcl_NewStringObj(entry->d_name, -1));
+        }
+    }
+    closedir(dir);
+
+    // the files of a directory come before the ones of its subdirectories
+    Tcl_Size subdirs_length;
+    Tcl_Obj **subdirs;
+    Tcl_ListObjGetElements(interp, subdirs_ptr, &subdirs_length, &subdirs);
+    for (Tcl_Size i = 0; i < subdirs_length; i++) {
+        Tcl_DStringSetLength(path_ds_ptr, path_length);
+        Tcl_DStringAppend(path_ds_ptr, "/", 1);
+        Tcl_DStringAppend(path_ds_ptr, Tcl_GetString(subdirs[i]), -1);
+        if (TCL_OK != thtml_FindFiles(interp, path_ds_ptr, pattern, files_ptr)) {
+            Tcl_DecrRefCount(subdirs_ptr);
+            return TCL_ERROR;
+        }
+    }
+
+    Tcl_DStringSetLength(path_ds_ptr, path_length);
+    Tcl_DecrRefCount(subdirs_ptr);
+    return TCL_OK;
+}
+
+int thtml_FindFilesCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "FindFilesCmd\n"));
+
+    CheckArgs(3, 3, 1, "basedir pattern");
+
+    Tcl_Obj *basedir_ptr = Tcl_FSGetNormalizedPath(interp, objv[1]);
+    if (basedir_ptr == NULL) {
+        return TCL_ERROR;
+    }
+
+    Tcl_DString path_ds;
+    Tcl_DStringInit(&path_ds);
+    Tcl_DStringAppend(&path_ds, Tcl_GetString(basedir_ptr), -1);
+    if (Tcl_DStringLength(&path_ds) > 1 && Tcl_DStringValue(&path_ds)[Tcl_DStringLength(&path_ds) - 1] == '/') {
+        Tcl_DStringSetLength(&path_ds, Tcl_DStringLength(&path_ds) - 1);
+    }
+
+    Tcl_Obj *files_ptr = Tcl_NewListObj(0, NULL);
+    if (TCL_OK != thtml_FindFiles(interp, &path_ds, Tcl_GetString(objv[2]), files_ptr)) {
+        Tcl_DStringFree(&path_ds);
+        Tcl_DecrRefCount(files_ptr);
+        return TCL_ERROR;
+    }
+    Tcl_DStringFree(&path_ds);
+
+    Tcl_SetObjResult(interp, files_ptr);
+    return TCL_OK;
+}
+
+int thtml_NumCpusCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "NumCpusCmd\n"));
+
+    CheckArgs(1, 1, 1, "");
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(num_cpus > 0 ? (int) num_cpus : 1));
+    return TCL_OK;
+}
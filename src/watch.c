@@ -0,0 +1,283 @@
+/**
+ * Copyright Jerily LTD. All Rights Reserved.
+ * SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+ * SPDX-License-Identifier: MIT.
+ */
+
+#include "watch.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Watches the directories of the files that compiled templates depend on with inotify. The
+// directories are watched rather than the files, so that editors that replace a file by
+// renaming a new one over it are noticed as well. Whenever the inotify descriptor becomes
+// readable, the full paths of the changed files are passed to ::thtml::watch::changed from
+// the event loop, which decides which templates to recompile.
+
+#define THTML_WATCH_ASSOC_KEY "thtml-watch"
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define THTML_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+typedef struct {
+    Tcl_Interp *interp;
+    int fd;
+    // watch descriptor to the list of the names its directory was watched under
+    Tcl_HashTable wds;
+    // directory to watch descriptor
+    Tcl_HashTable dirs;
+} thtml_watch_t;
+
+static void thtml_WatchClose(thtml_watch_t *watch_ptr) {
+    if (watch_ptr->fd < 0) {
+        return;
+    }
+
+    Tcl_DeleteFileHandler(watch_ptr->fd);
+    close(watch_ptr->fd);
+    watch_ptr->fd = -1;
+
+    Tcl_HashSearch search;
+    for (Tcl_HashEntry *entry_ptr = Tcl_FirstHashEntry(&watch_ptr->wds, &search);
+         entry_ptr != NULL; entry_ptr = Tcl_NextHashEntry(&search)) {
+        Tcl_DecrRefCount((Tcl_Obj *) Tcl_GetHashValue(entry_ptr));
+    }
+    Tcl_DeleteHashTable(&watch_ptr->wds);
+    Tcl_DeleteHashTable(&watch_ptr->dirs);
+}
+
+static void thtml_WatchFree(ClientData clientData, Tcl_Interp *interp) {
+    UNUSED(interp);
+    thtml_watch_t *watch_ptr = (thtml_watch_t *) clientData;
+    thtml_WatchClose(watch_ptr);
+    Tcl_Free((char *) watch_ptr);
+}
+
+static thtml_watch_t *thtml_GetWatch(Tcl_Interp *interp) {
+    thtml_watch_t *watch_ptr = (thtml_watch_t *) Tcl_GetAssocData(interp, THTML_WATCH_ASSOC_KEY, NULL);
+    if (watch_ptr == NULL) {
+        watch_ptr = (thtml_watch_t *) Tcl_Alloc(sizeof(thtml_watch_t));
+        watch_ptr->interp = interp;
+        watch_ptr->fd = -1;
+        Tcl_SetAssocData(interp, THTML_WATCH_ASSOC_KEY, thtml_WatchFree, watch_ptr);
+    }
+    return watch_ptr;
+}
+
+static void thtml_WatchForgetDescriptor(thtml_watch_t *watch_ptr, int wd) {
+    Tcl_HashEntry *entry_ptr = Tcl_FindHashEntry(&watch_ptr->wds, (char *) (intptr_t) wd);
+    if (entry_ptr == NULL) {
+        return;
+    }
+    // every name of the directory goes, so that watching it again under any of them adds a new watch
+    Tcl_Obj *dirs_ptr = (Tcl_Obj *) Tcl_GetHashValue(entry_ptr);
+    Tcl_Size num_dirs;
+    Tcl_Obj **dirs;
+    Tcl_ListObjGetElements(NULL, dirs_ptr, &num_dirs, &dirs);
+    for (Tcl_Size i = 0; i < num_dirs; i++) {
+        Tcl_HashEntry *dir_entry_ptr = Tcl_FindHashEntry(&watch_ptr->dirs, Tcl_GetString(dirs[i]));
+        if (dir_entry_ptr != NULL) {
+            Tcl_DeleteHashEntry(dir_entry_ptr);
+        }
+    }
+    Tcl_DecrRefCount(dirs_ptr);
+    Tcl_DeleteHashEntry(entry_ptr);
+}
+
+static void thtml_WatchReadable(ClientData clientData, int mask) {
+    UNUSED(mask);
+    thtml_watch_t *watch_ptr = (thtml_watch_t *) clientData;
+    Tcl_Interp *interp = watch_ptr->interp;
+
+    Tcl_Obj *paths_ptr = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(paths_ptr);
+    int overflow = 0;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(watch_ptr->fd, buf, sizeof(buf));
+        if (len <= 0) {
+            // EAGAIN once the queue is drained
+            break;
+        }
+
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *event = (const struct inotify_event *) p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = 1;
+                continue;
+            }
+
+            if (event->mask & IN_IGNORED) {
+                thtml_WatchForgetDescriptor(watch_ptr, event->wd);
+                continue;
+            }
+
+            Tcl_HashEntry *entry_ptr = Tcl_FindHashEntry(&watch_ptr->wds, (char *) (intptr_t) event->wd);
+            if (entry_ptr == NULL || event->len == 0) {
+                continue;
+            }
+
+            // the file is reported under every name of its directory, as templates may use any of them
+            Tcl_Size num_dirs;
+            Tcl_Obj **dirs;
+            Tcl_ListObjGetElements(NULL, (Tcl_Obj *) Tcl_GetHashValue(entry_ptr), &num_dirs, &dirs);
+            for (Tcl_Size i = 0; i < num_dirs; i++) {
+                Tcl_Obj *path_ptr = Tcl_DuplicateObj(dirs[i]);
+                Tcl_AppendStringsToObj(path_ptr, "/", event->name, NULL);
+                Tcl_ListObjAppendElement(NULL, paths_ptr, path_ptr);
+            }
+        }
+    }
+
+    Tcl_Size paths_length;
+    Tcl_ListObjLength(NULL, paths_ptr, &paths_length);
+    if (paths_length == 0 && !overflow) {
+        Tcl_DecrRefCount(paths_ptr);
+        return;
+    }
+
+    // when events were dropped, everything is reported as changed
+    Tcl_Obj *objv[3] = {Tcl_NewStringObj("::thtml::watch::changed", -1), paths_ptr, Tcl_NewBooleanObj(overflow)};
+    Tcl_IncrRefCount(objv[0]);
+    Tcl_IncrRefCount(objv[2]);
+
+    Tcl_Preserve(interp);
+    int code = Tcl_EvalObjv(interp, 3, objv, TCL_EVAL_GLOBAL);
+    if (code != TCL_OK) {
+        Tcl_BackgroundException(interp, code);
+    }
+    Tcl_Release(interp);
+
+    for (int i = 0; i < 3; i++) {
+        Tcl_DecrRefCount(objv[i]);
+    }
+}
+
+int thtml_WatchStartCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "WatchStartCmd\n"));
+
+    CheckArgs(1, 1, 1, "");
+
+    thtml_watch_t *watch_ptr = thtml_GetWatch(interp);
+    if (watch_ptr->fd >= 0) {
+        return TCL_OK;
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not start watching files: %s", strerror(errno)));
+        return TCL_ERROR;
+    }
+
+    watch_ptr->fd = fd;
+    Tcl_InitHashTable(&watch_ptr->wds, TCL_ONE_WORD_KEYS);
+    Tcl_InitHashTable(&watch_ptr->dirs, TCL_STRING_KEYS);
+    Tcl_CreateFileHandler(fd, TCL_READABLE, thtml_WatchReadable, watch_ptr);
+    return TCL_OK;
+}
+
+int thtml_WatchStopCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "WatchStopCmd\n"));
+
+    CheckArgs(1, 1, 1, "");
+
+    thtml_WatchClose(thtml_GetWatch(interp));
+    return TCL_OK;
+}
+
+int thtml_WatchDirCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    DBG(fprintf(stderr, "WatchDirCmd\n"));
+
+    CheckArgs(2, 2, 1, "dir");
+
+    thtml_watch_t *watch_ptr = thtml_GetWatch(interp);
+    if (watch_ptr->fd < 0) {
+        SetResult("watching files has not been started");
+        return TCL_ERROR;
+    }
+
+    const char *dir = Tcl_GetString(objv[1]);
+    if (Tcl_FindHashEntry(&watch_ptr->dirs, dir) != NULL) {
+        return TCL_OK;
+    }
+
+    int wd = inotify_add_watch(watch_ptr->fd, dir, THTML_WATCH_MASK | IN_ONLYDIR);
+    if (wd < 0) {
+        // the error code is POSIX ENOENT and so on, so that a missing directory can be told apart
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("could not watch \"%s\": %s", dir, Tcl_PosixError(interp)));
+        return TCL_ERROR;
+    }
+
+    int is_new;
+    Tcl_HashEntry *entry_ptr = Tcl_CreateHashEntry(&watch_ptr->wds, (char *) (intptr_t) wd, &is_new);
+    Tcl_Obj *dirs_ptr;
+    if (is_new) {
+        dirs_ptr = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(dirs_ptr);
+        Tcl_SetHashValue(entry_ptr, dirs_ptr);
+    } else {
+        // the same directory under another name, inotify returns the existing descriptor
+        dirs_ptr = (Tcl_Obj *) Tcl_GetHashValue(entry_ptr);
+    }
+    Tcl_ListObjAppendElement(NULL, dirs_ptr, Tcl_DuplicateObj(objv[1]));
+
+    Tcl_HashEntry *dir_entry_ptr = Tcl_CreateHashEntry(&watch_ptr->dirs, dir, &is_new);
+    Tcl_SetHashValue(dir_entry_ptr, (ClientData) (intptr_t) wd);
+    return TCL_OK;
+}
+
+int thtml_WatchSupportedCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    CheckArgs(1, 1, 1, "");
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(1));
+    return TCL_OK;
+}
+
+#else
+
+static int thtml_WatchUnsupported(Tcl_Interp *interp) {
+    SetResult("watching files is only supported on linux");
+    return TCL_ERROR;
+}
+
+int thtml_WatchStartCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    UNUSED(objc);
+    UNUSED(objv);
+    return thtml_WatchUnsupported(interp);
+}
+
+int thtml_WatchStopCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    CheckArgs(1, 1, 1, "");
+    return TCL_OK;
+}
+
+int thtml_WatchDirCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    UNUSED(objc);
+    UNUSED(objv);
+    return thtml_WatchUnsupported(interp);
+}
+
+int thtml_WatchSupportedCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+    UNUSED(clientData);
+    CheckArgs(1, 1, 1, "");
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(0));
+    return TCL_OK;
+}
+
+#endif
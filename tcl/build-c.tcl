@@ -1,74 +1,352 @@
 namespace eval ::thtml::build {}
 
+# The C code of a directory is built without cmake. Every template is a translation unit of its
+# own, with the includes it uses and its literals, next to a runtime unit with the helpers of
+# thtml.h and an init unit with Thtml_Init. The units are compiled in parallel into objects that
+# are named after the hash of their code, the flags and the headers, so a unit that did not change
+# is not compiled again, and the objects are linked once into libthtml-<dirmd5>.
+
 proc ::thtml::build::c_compiledir {dir} {
     variable ::thtml::debug
 
     set target_lang "c"
-    array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 1]
-
-    set files [::thtml::util::find_files $dir "*.thtml"]
-    if { $debug } { puts dir=$dir,files=$files }
-
-    set compiled_cmds {}
-    set compiled_code {}
-    foreach file $files {
-        set filepath [::thtml::resolve_filepath codearr $file]
-        set relative_filepath [string range $filepath [string length [::thtml::get_rootdir]] end]
-        set filemd5 [::thtml::util::md5 $relative_filepath]
-        set proc_name ::thtml::cache::__file__$filemd5
+    array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 1 literals {}]
 
-        append compiled_code "\n" "// $filepath"
-        append compiled_code "\n" "int thtml_${filemd5}Cmd(ClientData  clientData, Tcl_Interp *__interp__, int objc, Tcl_Obj * const objv\[\]) {"
-        append compiled_code [compilefile codearr $file "c"]
-        append compiled_code "\n" "}"
-        append compiled_cmds "\n" "Tcl_CreateObjCommand(interp, \"${proc_name}\", thtml_${filemd5}Cmd, NULL, NULL);"
+    set units {}
+    set filemd5s {}
+    set registered_cmds {}
+    set seen_defs {}
+    foreach artifact [compile_chunks $dir $target_lang] {
+        lassign [lindex [dict get $artifact templates] 0] filepath relative_filepath filemd5
+        lappend units $filemd5 [c_template_unit $artifact]
+        lappend filemd5s $filemd5
+        append registered_cmds "\n" [list ::thtml::cache::register $relative_filepath ::thtml::cache::__file__$filemd5]
 
+        # an include with a .tcl companion is defined once for the directory
+        foreach {lang name code} [dict get $artifact defs] {
+            if { $lang eq {tcl} && ![dict exists $seen_defs $name] } {
+                dict set seen_defs $name 1
+                append codearr(tcl_defs) $code
+            }
+        }
     }
 
     set dirpath [::thtml::resolve_filepath codearr $dir]
     set relative_dirpath [string range $dirpath [string length [::thtml::get_rootdir]] end]
     set dirmd5 [::thtml::util::md5 $relative_dirpath]
 
-    set tcl_code $codearr(tcl_defs)
+    set tcl_code "$codearr(tcl_defs)\n$registered_cmds"
     tcl_build $dirmd5 $tcl_code
 
-    set c_code "\#include \"thtml.h\"\n$codearr(c_defs)\n$compiled_code"
+    # with the stats option, the runtime counts the output written to sinks
+    set runtime_defines "\#define THTML_RUNTIME\n"
+    if { $::thtml::stats } {
+        append runtime_defines "\#define THTML_STATS\n"
+    }
+    lappend units runtime "${runtime_defines}\#include \"thtml.h\"\n"
+    lappend units init-$dirmd5 [c_init_unit $dirmd5 $filemd5s]
+
+    if { $debug } { puts c_units=$units }
+
+    return [c_build $dirmd5 $units]
+}
+
+# returns the string as a C string literal along with its length in bytes, quotes, backslashes
+# and question marks (trigraphs) are escaped, other bytes outside of printable ascii are written
+# in octal, a nul as the two bytes Tcl keeps it as in its strings
+proc ::thtml::build::c_string_literal {str} {
+    binary scan [encoding convertto utf-8 $str] cu* bytes
+    set literal "\""
+    set length 0
+    foreach byte $bytes {
+        if { $byte == 0 } {
+            append literal {\300\200}
+            incr length 2
+            continue
+        }
+        if { $byte == 34 || $byte == 63 || $byte == 92 } {
+            append literal \\ [format %c $byte]
+        } elseif { $byte < 32 || $byte > 126 } {
+            append literal [format {\%03o} $byte]
+        } else {
+            append literal [format %c $byte]
+        }
+        incr length
+    }
+    append literal "\""
+    return [list $literal $length]
+}
+
+# returns the translation unit of the template of the artifact, it does not depend on the other
+# templates of the directory, only the init function of the template is exported
+proc ::thtml::build::c_template_unit {artifact} {
+    variable ::thtml::buffer_size_cap
+    variable ::thtml::stream_chunk_size
+
+    lassign [lindex [dict get $artifact templates] 0] filepath relative_filepath filemd5 compiled_template
+
+    # constant dict keys, command names and expression literals, created once per interp
+    set literal_strings {}
+    set literal_lengths {}
+    foreach literal [dict get $artifact literals] {
+        lassign [c_string_literal $literal] literal_string literal_length
+        lappend literal_strings $literal_string
+        lappend literal_lengths $literal_length
+    }
+    lappend literal_strings NULL
+    lappend literal_lengths 0
+
+    set c_code "\#define THTML_BUFFER_SIZE_CAP ${buffer_size_cap}\n"
+    append c_code "\#define THTML_STREAM_CHUNK_SIZE ${stream_chunk_size}\n"
+    append c_code "\#include \"thtml.h\"\n"
+    append c_code "\n" "static const char *const __literal_strings__\[\] = \{ [join $literal_strings {, }] \};"
+    append c_code "\n" "static const Tcl_Size __literal_lengths__\[\] = \{ [join $literal_lengths {, }] \};"
+    foreach {lang name code} [dict get $artifact defs] {
+        if { $lang eq {c} } {
+            append c_code "\n" $code
+        }
+    }
+
+    append c_code "\n" "// $relative_filepath"
+    append c_code "\n" "static int thtml_${filemd5}Cmd(ClientData  clientData, Tcl_Interp *__interp__, int objc, Tcl_Obj * const objv\[\]) {"
+    append c_code $compiled_template
+    append c_code "\n" "}"
+
+    append c_code "\n" "int thtml_${filemd5}Init(Tcl_Interp *interp, __thtml_template_t *template) {"
+    append c_code "\n" "template->literals = __thtml_new_literals__(interp, \"thtml-$filemd5\", __literal_strings__, __literal_lengths__, [llength [dict get $artifact literals]]);"
+    append c_code "\n" "Tcl_CreateObjCommand(interp, \"::thtml::cache::__file__${filemd5}\", thtml_${filemd5}Cmd, template, NULL);"
+    append c_code "\n" "Tcl_CreateObjCommand(interp, \"::thtml::cache::__size_estimate__${filemd5}\", __thtml_size_estimate_cmd__, template, NULL);"
+    append c_code "\n" "return TCL_OK;"
+    append c_code "\n" "}"
+    return $c_code
+}
+
+proc ::thtml::build::c_init_unit {dirmd5 filemd5s} {
+    set c_code "\#include \"thtml.h\"\n"
+    foreach filemd5 $filemd5s {
+        append c_code "\n" "int thtml_${filemd5}Init(Tcl_Interp *interp, __thtml_template_t *template);"
+    }
 
     set MIN_VERSION "9.0"
     append c_code "\n" "int Thtml_Init(Tcl_Interp *interp) {"
     append c_code "\n" "if (Tcl_InitStubs(interp, \"$MIN_VERSION\", 0) == NULL) { return TCL_ERROR; }"
-    append c_code "\n" $compiled_cmds
+    append c_code "\n" "__thtml_template_t *__templates__ = __thtml_new_templates__(interp, \"thtml-$dirmd5-templates\", [llength $filemd5s]);"
+    set template_index 0
+    foreach filemd5 $filemd5s {
+        append c_code "\n" "if (TCL_OK != thtml_${filemd5}Init(interp, &__templates__\[${template_index}\])) { return TCL_ERROR; }"
+        incr template_index
+    }
     append c_code "\n" "return TCL_OK;"
     append c_code "\n" "}"
+    return $c_code
+}
 
-    if { $debug } { puts c_code=$c_code }
+# compiles the units, given as a dict of name and code, and links them into the library of the
+# directory, returns the path of the library
+proc ::thtml::build::c_build {dirmd5 units} {
+    variable ::thtml::debug
+    variable ::thtml::cmakedir
+
+    set builddir [::thtml::get_builddir]
+    set srcdir [file join $builddir src]
+    set objdir [file join $builddir objects]
+    file mkdir $srcdir $objdir
+
+    set toolchain [c_toolchain]
+    set cc [dict get $toolchain cc]
+    set cflags [dict get $toolchain cflags]
 
-    return [c_build $dirmd5 $c_code]
+    set headers_hash {}
+    foreach header [lsort [glob -directory [file join $cmakedir include] *.h]] {
+        append headers_hash [::thtml::util::md5 [read_file $header]]
+    }
+
+    set objects {}
+    set commands {}
+    dict for {name c_code} $units {
+        # the file is only written when the code changed, it is what the messages of the compiler refer to
+        set srcfile [file join $srcdir $name.c]
+        if { ![file exists $srcfile] || [read_file $srcfile] ne $c_code } {
+            write_file $srcfile $c_code
+        }
+
+        set objfile [file join $objdir [::thtml::util::md5 [list $cc $cflags $headers_hash $c_code]].o]
+        lappend objects $objfile
+        if { ![file exists $objfile] } {
+            lappend commands [list {*}$cc {*}$cflags -c $srcfile -o $objfile.[pid].tmp] $objfile
+        }
+    }
+    if { $debug } { puts "reusing [expr { [llength $objects] - [llength $commands] / 2 }] objects, compiling [expr { [llength $commands] / 2 }]" }
+
+    set messages [run_commands [dict keys $commands]]
+    if { $debug && $messages ne {} } { puts $messages }
+    dict for {command objfile} $commands {
+        file rename -force $objfile.[pid].tmp $objfile
+    }
+
+    # the library is linked again only when the objects it is made of changed
+    set libfile [file join $builddir libthtml-$dirmd5[info sharedlibextension]]
+    set linkfile [file join $builddir libthtml-$dirmd5.link]
+    set link_inputs [list $cc $objects [dict get $toolchain ldflags]]
+    if { ![file exists $libfile] || ![file exists $linkfile] || [read_file $linkfile] ne $link_inputs } {
+        set messages [exec -- {*}$cc -shared -o $libfile.[pid].tmp {*}$objects {*}[dict get $toolchain ldflags] 2>@1]
+        if { $debug && $messages ne {} } { puts $messages }
+        file rename -force $libfile.[pid].tmp $libfile
+        write_file $linkfile $link_inputs
+    }
+
+    # objects no library of the build dir is linked from any more are deleted, the libraries of
+    # the other directories share the objects dir
+    set linked {}
+    foreach other_linkfile [glob -nocomplain -directory $builddir libthtml-*.link] {
+        foreach objfile [lindex [read_file $other_linkfile] 1] {
+            dict set linked $objfile 1
+        }
+    }
+    foreach objfile [glob -nocomplain -directory $objdir *.o] {
+        if { ![dict exists $linked $objfile] } {
+            file delete $objfile
+        }
+    }
+    return $libfile
 }
 
-proc ::thtml::build::c_build {dirmd5 c_code} {
+# The compiler, its flags and where Tcl is are found once and kept in the build dir, later builds
+# take them from there for as long as they run on the same tclsh with the same CC, CFLAGS and
+# LDFLAGS in the environment, e.g. CFLAGS="-g -DDEBUG -fsanitize=address" for a debug build.
+
+proc ::thtml::build::c_toolchain {} {
     variable ::thtml::debug
-    variable ::thtml::cachedir
     variable ::thtml::cmakedir
 
-    if { $debug } { puts cachedir=$cachedir }
+    set env_cc [expr { [info exists ::env(CC)] ? $::env(CC) : {} }]
+    set env_cflags [expr { [info exists ::env(CFLAGS)] ? $::env(CFLAGS) : {} }]
+    set env_ldflags [expr { [info exists ::env(LDFLAGS)] ? $::env(LDFLAGS) : {} }]
+    set key [list [info nameofexecutable] $env_cc $env_cflags $env_ldflags $cmakedir]
 
-    set outfile [file join $cachedir "dir-$dirmd5.c"]
-    set fp [open $outfile w]
-    puts $fp $c_code
-    close $fp
+    set configfile [file join [::thtml::get_builddir] toolchain.config]
+    if { [file exists $configfile] } {
+        set toolchain [read_file $configfile]
+        if { [dict get $toolchain key] eq $key } {
+            return $toolchain
+        }
+    }
 
-    set builddir [::thtml::get_builddir]
-    if { ![file isdirectory $builddir] } {
-        file mkdir $builddir
-    }
-    cd $builddir
-    set tcl_library_dir [file dirname [file dirname [info nameofexecutable]]]/lib
-    set tcl_include_dir [file dirname [file dirname [info nameofexecutable]]]/include
-    puts tcl_library_dir=$tcl_library_dir
-    # set msgs [exec -ignorestderr -- cmake $cmakedir -DCMAKE_BUILD_TYPE=Debug -DADDRESS_SANITIZER=ON -DTHTML_CMAKE_DIR=$cmakedir -DTHTML_PROJECT_NAME=$dirmd5 -DTHTML_PROJECT_CODE=$outfile -DTCL_INCLUDE_DIR=$tcl_include_dir -DTCL_LIBRARY_DIR=$tcl_library_dir]
-    set msgs [exec -ignorestderr -- cmake $cmakedir -DTHTML_CMAKE_DIR=$cmakedir -DTHTML_PROJECT_NAME=$dirmd5 -DTHTML_PROJECT_CODE=$outfile -DTCL_INCLUDE_DIR=$tcl_include_dir -DTCL_LIBRARY_DIR=$tcl_library_dir]
-    if { $debug } { puts $msgs }
-    set msgs [exec -ignorestderr -- make]
-    if { $debug } { puts $msgs }
+    set cc $env_cc
+    if { $cc eq {} } {
+        foreach name {cc gcc clang} {
+            if { [auto_execok $name] ne {} } {
+                set cc $name
+                break
+            }
+        }
+        if { $cc eq {} } {
+            error "no C compiler found, set CC to build the C target"
+        }
+    }
+
+    set tcl_version [info tclversion]
+    set prefix [file dirname [file dirname [info nameofexecutable]]]
+    set libdirs [list $prefix/lib]
+    if { ![catch {::tcl::pkgconfig get libdir,runtime} libdir] } {
+        lappend libdirs $libdir
+    }
+    lappend libdirs /usr/local/lib /usr/lib
+
+    set tcl_include_dir {}
+    foreach dir [list $prefix/include $prefix/include/tcl$tcl_version /usr/local/include /usr/include/tcl$tcl_version /usr/include] {
+        if { [file exists [file join $dir tcl.h]] } {
+            set tcl_include_dir $dir
+            break
+        }
+    }
+    if { $tcl_include_dir eq {} } {
+        error "tcl.h not found, set CFLAGS to -I<dir> of tcl.h to build the C target"
+    }
+
+    # without the Tcl library, its symbols are resolved by the tclsh that loads the library
+    set ldflags {}
+    set names [list tcl$tcl_version tcl[string map {. {}} $tcl_version] tcl${tcl_version}t tcl]
+    foreach dir $libdirs {
+        foreach name $names {
+            if { [file exists [file join $dir lib$name[info sharedlibextension]]] } {
+                set ldflags [list -L$dir -l$name]
+                break
+            }
+        }
+        if { $ldflags ne {} } {
+            break
+        }
+    }
+
+    # NDEBUG to not generate code for assert
+    set cflags [list -std=gnu11 -O2 -fPIC -Wall -Wextra -Wpedantic -DTCL_THREADS -DNDEBUG \
+        -DPROJECT_VERSION=[package present thtml] \
+        -I$tcl_include_dir -I[file join $cmakedir include] {*}$env_cflags]
+    lappend ldflags {*}$env_ldflags
+
+    set toolchain [dict create key $key cc $cc cflags $cflags ldflags $ldflags]
+    if { $debug } { puts toolchain=$toolchain }
+    file mkdir [file dirname $configfile]
+    write_file $configfile $toolchain
+    return $toolchain
+}
+
+# runs the commands, at most build_workers at a time, returns what they wrote, or fails with the
+# messages of the ones that failed once all of them are done
+proc ::thtml::build::run_commands {commands} {
+    variable command_results
+
+    set num_workers [get_num_workers [llength $commands]]
+
+    array unset command_results
+    set next 0
+    set running 0
+    while { $next < [llength $commands] || $running > 0 } {
+        while { $running < $num_workers && $next < [llength $commands] } {
+            set chan [open |[list {*}[lindex $commands $next] 2>@1] r]
+            fconfigure $chan -blocking 0
+            fileevent $chan readable [list [namespace current]::command_readable $chan $next]
+            incr next
+            incr running
+        }
+        set num_results [array size command_results]
+        while { [array size command_results] == $num_results } {
+            vwait [namespace current]::command_results
+        }
+        incr running [expr { $num_results - [array size command_results] }]
+    }
+
+    set messages {}
+    set failed 0
+    for {set i 0} {$i < [llength $commands]} {incr i} {
+        lassign $command_results($i) code output
+        set output [string trimright $output]
+        if { $code } {
+            set failed 1
+            append messages [lindex $commands $i] "\n" $output "\n"
+        } elseif { $output ne {} } {
+            append messages $output "\n"
+        }
+    }
+    array unset command_results
+
+    if { $failed } {
+        error "build failed:\n$messages"
+    }
+    return $messages
+}
+
+proc ::thtml::build::command_readable {chan i} {
+    variable command_output
+
+    append command_output($i) [read $chan]
+    if { ![eof $chan] } {
+        return
+    }
+
+    fconfigure $chan -blocking 1
+    set code [catch {close $chan}]
+    set [namespace current]::command_results($i) [list $code $command_output($i)]
+    unset command_output($i)
 }
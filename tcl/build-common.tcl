@@ -9,6 +9,338 @@ proc ::thtml::build::compiledir {dir target_lang} {
     return [${target_lang}_compiledir $dir]
 }
 
+# Compiling a directory is split across build_workers threads, each with an interp and a codearr
+# of its own. Every worker compiles a contiguous run of the sorted files, so an include shared by
+# the files of a worker is compiled once, and merging the runs in order gives the same code on
+# every build no matter which worker finishes first.
+
+# returns the artifacts of the templates of the directory in the order of the files, the ones
+# of templates whose files did not change since the last build are reused, see merge_chunks
+proc ::thtml::build::compile_chunks {dir target_lang} {
+    variable ::thtml::debug
+
+    set files [lsort [::thtml::util::find_files $dir "*.thtml"]]
+    if { $debug } { puts dir=$dir,files=$files }
+
+    set artifacts {}
+    set stale_files {}
+    foreach file $files {
+        set artifact [load_artifact $target_lang $file]
+        if { $artifact eq {} } {
+            lappend stale_files $file
+        }
+        lappend artifacts $artifact
+    }
+    if { $debug } { puts "reusing [expr { [llength $files] - [llength $stale_files] }] templates, compiling [llength $stale_files]" }
+
+    set compiled {}
+    foreach chunk [compile_files $target_lang $stale_files] {
+        foreach template [dict get $chunk templates] {
+            lappend compiled [save_artifact $target_lang $template $chunk]
+        }
+    }
+
+    set i 0
+    foreach artifact $artifacts {
+        if { $artifact eq {} } {
+            lset artifacts $i [lindex $compiled 0]
+            set compiled [lrange $compiled 1 end]
+        }
+        incr i
+    }
+    return $artifacts
+}
+
+# compiles the files with the workers, returns the compiled chunks in the order of the files
+proc ::thtml::build::compile_files {target_lang files} {
+    variable ::thtml::build_workers
+
+    if { $files eq {} } {
+        return
+    }
+
+    set num_workers [get_num_workers [llength $files]]
+    if { $num_workers > 1 && [catch {package require Thread}] } {
+        set num_workers 1
+    }
+
+    if { $num_workers <= 1 } {
+        return [list [compile_chunk $target_lang $files]]
+    }
+
+    set chunks {}
+    set num_files [llength $files]
+    for {set i 0} {$i < $num_workers} {incr i} {
+        set first [expr { $i * $num_files / $num_workers }]
+        set last [expr { ($i + 1) * $num_files / $num_workers - 1 }]
+        lappend chunks [lrange $files $first $last]
+    }
+    return [compile_chunks_in_threads $target_lang $chunks]
+}
+
+# build_workers, or the number of cpus when it is 0, but no more than there are jobs
+proc ::thtml::build::get_num_workers {num_jobs} {
+    variable ::thtml::build_workers
+
+    set num_workers $build_workers
+    if { $num_workers <= 0 } {
+        set num_workers [::thtml::util::num_cpus]
+    }
+    if { $num_workers > $num_jobs } {
+        set num_workers $num_jobs
+    }
+    return $num_workers
+}
+
+proc ::thtml::build::compile_chunks_in_threads {target_lang chunks} {
+    variable chunk_results
+
+    set options [dict create build 1 cache 1 target_lang $target_lang \
+        rootdir [::thtml::get_rootdir] \
+        debug $::thtml::debug \
+        buffer_size_cap $::thtml::buffer_size_cap \
+        stream_chunk_size $::thtml::stream_chunk_size \
+        stats $::thtml::stats]
+    if { [info exists ::thtml::bundle_outdir] } {
+        dict set options bundle_outdir $::thtml::bundle_outdir
+    }
+    set init_script [list apply {{auto_path options} {
+        set ::auto_path $auto_path
+        package require thtml
+        ::thtml::init $options
+    }} $::auto_path $options]
+
+    array unset chunk_results
+    set workers {}
+    set i 0
+    foreach chunk $chunks {
+        set worker [thread::create]
+        lappend workers $worker
+        thread::send $worker $init_script
+        set script [list apply {{target_lang chunk} {
+            if { [catch { ::thtml::build::compile_chunk $target_lang $chunk } result options] } {
+                return [list 1 $result [dict get $options -errorinfo]]
+            }
+            return [list 0 $result {}]
+        }} $target_lang $chunk]
+        thread::send -async $worker $script [namespace current]::chunk_results($i)
+        incr i
+    }
+
+    while { [array size chunk_results] < [llength $chunks] } {
+        vwait [namespace current]::chunk_results
+    }
+
+    foreach worker $workers {
+        thread::release $worker
+    }
+
+    set results {}
+    for {set i 0} {$i < [llength $chunks]} {incr i} {
+        lassign $chunk_results($i) code result errorinfo
+        if { $code == 1 } {
+            array unset chunk_results
+            return -code error -errorinfo $errorinfo $result
+        }
+        lappend results $result
+    }
+    array unset chunk_results
+    return $results
+}
+
+# compiles the files in a single codearr and returns the compiled templates, with the files and
+# includes each one uses, along with the definitions of the includes and the literals of the C target
+proc ::thtml::build::compile_chunk {target_lang files} {
+    array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 1 literals {} defs {}]
+
+    set templates {}
+    foreach file $files {
+        set codearr(dependencies) {}
+        set codearr(used) {}
+        set filepath [::thtml::resolve_filepath codearr $file]
+        set relative_filepath [string range $filepath [string length [::thtml::get_rootdir]] end]
+        set filemd5 [::thtml::util::md5 $relative_filepath]
+        set compiled_template [compilefile codearr $file $target_lang]
+        lappend templates [list $filepath $relative_filepath $filemd5 $compiled_template $codearr(dependencies) $codearr(used)]
+    }
+
+    return [list templates $templates defs $codearr(defs) literals $codearr(literals)]
+}
+
+# Every template compiled by compiledir leaves an artifact and a manifest in cachedir/templates.
+# The artifact is a chunk of its own, with the compiled template, the definitions of the includes
+# it uses and its literals. The manifest keeps the hash of the template and of every include and
+# .tcl companion it pulled in, so a later build takes the artifact of a template whose files did
+# not change instead of compiling it again.
+
+proc ::thtml::build::get_manifest_basename {target_lang filepath} {
+    set relative_filepath [string range $filepath [string length [::thtml::get_rootdir]] end]
+    return [file join [::thtml::get_cachedir] templates [::thtml::util::md5 $relative_filepath]-$target_lang]
+}
+
+proc ::thtml::build::read_file {filepath} {
+    set fp [open $filepath]
+    set content [read $fp]
+    close $fp
+    return $content
+}
+
+proc ::thtml::build::write_file {filepath content} {
+    set fp [open $filepath w]
+    puts -nonewline $fp $content
+    close $fp
+}
+
+# returns the mtime and the hash of the file, files that do not exist have an mtime of -1
+proc ::thtml::build::get_file_state {filepath} {
+    if { [catch {file mtime $filepath} mtime] } {
+        return [list -1 {}]
+    }
+    return [list $mtime [::thtml::util::md5 [read_file $filepath]]]
+}
+
+# a file whose mtime changed is compared by its hash, touching a file does not rebuild it
+proc ::thtml::build::is_file_unchanged {filepath file_state} {
+    lassign $file_state mtime hash
+    if { [catch {file mtime $filepath} current_mtime] } {
+        return [expr { $mtime == -1 }]
+    }
+    if { $current_mtime == $mtime } {
+        return 1
+    }
+    return [expr { $mtime != -1 && [::thtml::util::md5 [read_file $filepath]] eq $hash }]
+}
+
+# returns the artifact of the template if none of its files changed, or the empty string
+proc ::thtml::build::load_artifact {target_lang filepath} {
+    set basename [get_manifest_basename $target_lang $filepath]
+    if { ![file exists $basename.manifest] || ![file exists $basename.artifact] } {
+        return
+    }
+
+    set manifest [read_file $basename.manifest]
+    if { [dict get $manifest version] ne [package present thtml] } {
+        return
+    }
+    # the stats option changes the compiled code
+    if { ![dict exists $manifest stats] || [dict get $manifest stats] != $::thtml::stats } {
+        return
+    }
+    # so does the stream_chunk_size option, that the tcl target compiles into its output checks
+    if { ![dict exists $manifest stream_chunk_size] || [dict get $manifest stream_chunk_size] != $::thtml::stream_chunk_size } {
+        return
+    }
+    dict for {dependency file_state} [dict get $manifest files] {
+        if { ![is_file_unchanged $dependency $file_state] } {
+            return
+        }
+    }
+    return [read_file $basename.artifact]
+}
+
+# takes the template out of its compiled chunk into an artifact of its own and saves it along
+# with its manifest, returns the artifact
+proc ::thtml::build::save_artifact {target_lang template chunk} {
+    lassign $template filepath relative_filepath filemd5 compiled_template dependencies used
+
+    set defs {}
+    foreach {lang name code} [dict get $chunk defs] {
+        if { [dict exists $used $name] } {
+            lappend defs $lang $name $code
+        }
+    }
+
+    # the literals of the chunk are renumbered to the ones the template uses
+    set literals {}
+    if { $target_lang eq {c} } {
+        set chunk_literals [dict get $chunk literals]
+        set indices [lrepeat [llength $chunk_literals] 0]
+        set seen_indices {}
+        foreach {match index} [regexp -all -inline {__literals__\[(\d+)\]} "$compiled_template [join $defs]"] {
+            if { ![dict exists $seen_indices $index] } {
+                dict set seen_indices $index 1
+                lset indices $index [llength $literals]
+                lappend literals [lindex $chunk_literals $index]
+            }
+        }
+        set compiled_template [::thtml::compiler::c_remap_literals $compiled_template $indices]
+        set remapped_defs {}
+        foreach {lang name code} $defs {
+            if { $lang eq {c} } {
+                set code [::thtml::compiler::c_remap_literals $code $indices]
+            }
+            lappend remapped_defs $lang $name $code
+        }
+        set defs $remapped_defs
+    }
+
+    set artifact [list templates [list [list $filepath $relative_filepath $filemd5 $compiled_template]] defs $defs literals $literals]
+
+    set files [dict create $filepath [get_file_state $filepath]]
+    foreach dependency [dict keys $dependencies] {
+        dict set files $dependency [get_file_state $dependency]
+    }
+
+    set basename [get_manifest_basename $target_lang $filepath]
+    file mkdir [file dirname $basename]
+    write_file $basename.artifact $artifact
+    write_file $basename.manifest [dict create \
+        version [package present thtml] \
+        target_lang $target_lang \
+        stats $::thtml::stats \
+        stream_chunk_size $::thtml::stream_chunk_size \
+        filepath $filepath \
+        hash [lindex [dict get $files $filepath] 1] \
+        files $files \
+        includes [dict keys $used] \
+        artifact $basename.artifact]
+
+    return $artifact
+}
+
+# merges the compiled chunks in order into codearr, an include compiled by more than one worker
+# is kept once and the literals are collected in a single table, returns the compiled templates
+proc ::thtml::build::merge_chunks {codearrVar target_lang chunks} {
+    upvar $codearrVar codearr
+
+    set codearr(literals) {}
+    set templates {}
+    set seen_defs {}
+    set literal_indices {}
+    foreach chunk $chunks {
+
+        set indices {}
+        if { $target_lang eq {c} } {
+            foreach literal [dict get $chunk literals] {
+                if { ![dict exists $literal_indices $literal] } {
+                    dict set literal_indices $literal [llength $codearr(literals)]
+                    lappend codearr(literals) $literal
+                }
+                lappend indices [dict get $literal_indices $literal]
+            }
+        }
+
+        foreach {lang name code} [dict get $chunk defs] {
+            if { [dict exists $seen_defs $lang,$name] } {
+                continue
+            }
+            dict set seen_defs $lang,$name 1
+            if { $lang eq {c} } {
+                set code [::thtml::compiler::c_remap_literals $code $indices]
+            }
+            append codearr(${lang}_defs) $code
+        }
+
+        foreach template [dict get $chunk templates] {
+            if { $target_lang eq {c} } {
+                lset template 3 [::thtml::compiler::c_remap_literals [lindex $template 3] $indices]
+            }
+            lappend templates $template
+        }
+    }
+    return $templates
+}
+
 proc ::thtml::build::compilefile {codearrVar filename target_lang} {
     variable ::thtml::debug
     upvar $codearrVar codearr
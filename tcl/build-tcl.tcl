@@ -6,22 +6,18 @@ proc ::thtml::build::tcl_compiledir {dir} {
     set target_lang "tcl"
     array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 1]
 
-    if { $debug } { puts dir=$dir }
-    set files [::thtml::util::find_files $dir "*.thtml"]
-    if { $debug } { puts files=$files }
+    set templates [merge_chunks codearr $target_lang [compile_chunks $dir $target_lang]]
 
-    set compiled_cmds {}
     set compiled_code {}
-    foreach file $files {
-        set filepath [::thtml::resolve_filepath codearr $file]
-        set relative_filepath [string range $filepath [string length [::thtml::get_rootdir]] end]
-        set filemd5 [::thtml::util::md5 $relative_filepath]
+    foreach template $templates {
+        lassign $template filepath relative_filepath filemd5 compiled_template
         set proc_name ::thtml::cache::__file__$filemd5
 
         append compiled_code "\n" "# $filepath"
-        append compiled_code "\n" "proc ${proc_name} {__data__} {"
-        append compiled_code [compilefile codearr $file "tcl"]
+        append compiled_code "\n" "proc ${proc_name} {__data__ {__doctype__ 1} {__sink__ {}}} {"
+        append compiled_code $compiled_template
         append compiled_code "\n" "}"
+        append compiled_code "\n" [list ::thtml::cache::register $relative_filepath $proc_name]
 
     }
 
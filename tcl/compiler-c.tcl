@@ -18,6 +18,9 @@ proc ::thtml::compiler::garbage_collection {codearrVar} {
             dstring {
                 append compiled_gc "Tcl_DStringFree(${name});"
             }
+            scope {
+                append compiled_gc "__thtml_scope_free__(${name});"
+            }
         }
     }
 
@@ -30,23 +33,40 @@ proc ::thtml::compiler::garbage_collection {codearrVar} {
 proc ::thtml::compiler::c_compile_root {codearrVar root} {
     upvar $codearrVar codearr
 
-    append compiled_template "\n" "Tcl_Obj *__data__ = Tcl_DuplicateObj(objv\[1\]);"
-    append compiled_template "\n" "Tcl_IncrRefCount(__data__);"
-    append compiled_template "\n" "Tcl_DString __ds_default_base__;" "\n"
-    append compiled_template "\n" "Tcl_DString *__ds_default__ = &__ds_default_base__;" "\n"
-    append compiled_template "\n" "Tcl_DStringInit(__ds_default__);" "\n"
-
-    push_gc_list codearr obj __data__ dstring __ds_default__
+    append compiled_template "\n" "__thtml_template_t *__template__ = (__thtml_template_t *) clientData;"
+    append compiled_template "\n" "Tcl_Obj **__literals__ = __template__->literals;"
+    append compiled_template "\n" "int __doctype__ = 1;"
+    append compiled_template "\n" "if (objc > 2 && TCL_OK != Tcl_GetBooleanFromObj(__interp__, objv\[2\], &__doctype__)) { return TCL_ERROR; }"
+    # the output is streamed to the sink if one is given after the doctype flag
+    append compiled_template "\n" "__thtml_output_t __output__;"
+    append compiled_template "\n" "if (TCL_OK != __thtml_output_init__(__interp__, &__output__, objc > 3 ? objv\[3\] : NULL)) { return TCL_ERROR; }"
+    append compiled_template "\n" "__thtml_scope_t __scope_base__;"
+    append compiled_template "\n" "__thtml_scope_t *__scope__ = &__scope_base__;"
+    append compiled_template "\n" "__thtml_scope_init__(__scope__, NULL, objv\[1\]);"
+    append compiled_template "\n" "Tcl_DString *__ds_default__ = &__output__.ds;"
+    append compiled_template [c_stats_enter codearr] "\n"
+    append compiled_template "\n" "if (__output__.sink == NULL) { __thtml_presize__(__ds_default__, __template__); }" "\n"
+    append compiled_template "\n" "if (__doctype__) { Tcl_DStringAppend(__ds_default__, \"<!doctype html>\", 15); }" "\n"
+
+    push_gc_list codearr scope __scope__ dstring __ds_default__
 
     foreach child [$root childNodes] {
         append compiled_template [c_transform \x02[compile_helper codearr $child]\x03]
     }
 
+    append compiled_template [c_stats_leave codearr]
+    append compiled_template "\n" "if (__output__.sink != NULL) \{"
+    append compiled_template "\n" "if (TCL_OK != __thtml_output_flush__(__interp__, __ds_default__, 1)) { [garbage_collection codearr] return TCL_ERROR; }"
+    append compiled_template "\n" "Tcl_ResetResult(__interp__);"
+    append compiled_template "\n" "\} else \{"
+    append compiled_template "\n" "__thtml_update_size_estimate__(__template__, Tcl_DStringLength(__ds_default__));"
+    append compiled_template "\n" "Tcl_DStringResult(__interp__, __ds_default__);"
+    append compiled_template "\n" "\}" "\n"
+
     pop_gc_list codearr
 
-    append compiled_template "\n" "Tcl_DStringResult(__interp__, __ds_default__);" "\n"
     append compiled_template "\n" "Tcl_DStringFree(__ds_default__);" "\n"
-    append compiled_template "\n" "Tcl_DecrRefCount(__data__);"
+    append compiled_template "\n" "__thtml_scope_free__(__scope__);"
     append compiled_template "\n" "return TCL_OK;" "\n"
     return $compiled_template
 }
@@ -67,24 +87,12 @@ proc ::thtml::compiler::c_compile_statement_val {codearrVar node} {
     append compiled_statement "\n" ${compiled_script}
 
     set key_objs {}
-    for {set i 0} {$i < [llength $chain_of_keys]} {incr i} {
-        set key [lindex $chain_of_keys $i]
-        set key_objname "__val${val_num}_key_${key}__"
-        append compiled_statement "\n" "Tcl_Obj *${key_objname} = Tcl_NewStringObj(\"${key}\", -1);"
-        append compiled_statement "\n" "Tcl_IncrRefCount(${key_objname});"
-        lappend key_objs $key_objname
-
-        lappend_gc_list codearr obj $key_objname
+    foreach key $chain_of_keys {
+        lappend key_objs [c_literal codearr $key]
     }
     append compiled_statement "\n" "Tcl_Obj *__val${val_num}_keyv__\[\] = \{ [join $key_objs {,}] \};"
 
-    # todo: decr ref count when it errs
-    append compiled_statement "\n" "if (TCL_OK != Tcl_DictObjPutKeyList(__interp__, __data__, [llength $chain_of_keys], __val${val_num}_keyv__, Tcl_GetObjResult(__interp__))) { [garbage_collection codearr] return TCL_ERROR;}"
-
-    for {set i 0} {$i < [llength $chain_of_keys]} {incr i} {
-        set key [lindex $chain_of_keys $i]
-        append compiled_statement "\n" "Tcl_DecrRefCount(__val${val_num}_key_${key}__);"
-    }
+    append compiled_statement "\n" "if (TCL_OK != __thtml_scope_set__(__interp__, __scope__, [llength $chain_of_keys], __val${val_num}_keyv__, Tcl_GetObjResult(__interp__))) { [garbage_collection codearr] return TCL_ERROR;}"
 
 #    append compiled_statement "\n" "fprintf(stderr, \"val${val_num} = %s\\n\", Tcl_GetString(Tcl_GetObjResult(__interp__)));"
     append compiled_statement "\n" "Tcl_ResetResult(__interp__);"
@@ -100,15 +108,12 @@ proc ::thtml::compiler::c_compile_statement_if {codearrVar node} {
 
     set conditional [$node @if]
     #puts conditional=$conditional
-    set compiled_conditional [c_compile_expr codearr $conditional "flag${conditional_num}"]
-
-    append compiled_conditional "\n" "int __flag${conditional_num}_bool__;"
-    append compiled_conditional "\n" "if (Tcl_GetBooleanFromObj(__interp__, __flag${conditional_num}__, &__flag${conditional_num}_bool__) != TCL_OK) {return TCL_ERROR;}"
-    append compiled_conditional "\n" "Tcl_DecrRefCount(__flag${conditional_num}__);"
+    # int __flag1__ = ...;
+    set compiled_conditional [c_compile_condition codearr $conditional "flag${conditional_num}"]
 
     set compiled_statement ""
     append compiled_statement "\x03" "\n" $compiled_conditional "\x02"
-    append compiled_statement "\x03" "\n" "if ( __flag${conditional_num}_bool__ ) \{ " "\x02"
+    append compiled_statement "\x03" "\n" "if ( __flag${conditional_num}__ ) \{ " "\x02"
     append compiled_statement [compile_children codearr $node]
     append compiled_statement "\x03" "\n" "\} " "\x02"
     return $compiled_statement
@@ -126,13 +131,12 @@ proc ::thtml::compiler::c_compile_statement_foreach {codearrVar node} {
     append compiled_statement "\x03" "\{"
 
     set varnames $foreach_varnames
+    set box_indexvar 0
     if { $foreach_indexvar ne "" } {
+        # the loop index is a plain integer, it is boxed in a Tcl_Obj only if the body refers to it
         append compiled_statement "\n" "Tcl_Size __indexvar_${foreach_indexvar}__ = 0;"
-        append compiled_statement "\n" "Tcl_Obj *${foreach_indexvar} = Tcl_NewIntObj(__indexvar_${foreach_indexvar}__);"
-        append compiled_statement "\n" "Tcl_IncrRefCount(${foreach_indexvar});" "\n"
         lappend varnames $foreach_indexvar
-
-        lappend_gc_list codearr obj ${foreach_indexvar}
+        set box_indexvar [uses_variable $node $foreach_indexvar]
     }
 
     set compiled_foreach_list [c_compile_foreach_list codearr \"$foreach_list\" "list${foreach_num}"]
@@ -143,24 +147,30 @@ proc ::thtml::compiler::c_compile_statement_foreach {codearrVar node} {
 
     lappend_gc_list codearr obj __list${foreach_num}__
 
+    # the elements are fetched once, the list is only referenced here so it cannot change type while we walk it
     append compiled_statement "\n" "Tcl_Size __list${foreach_num}_len__;"
-    append compiled_statement "\n" "if (TCL_OK != Tcl_ListObjLength(__interp__, __list${foreach_num}__, &__list${foreach_num}_len__)) { [garbage_collection codearr] return TCL_ERROR; }"
+    append compiled_statement "\n" "Tcl_Obj **__list${foreach_num}_elems__;"
+    append compiled_statement "\n" "if (TCL_OK != Tcl_ListObjGetElements(__interp__, __list${foreach_num}__, &__list${foreach_num}_len__, &__list${foreach_num}_elems__)) { [garbage_collection codearr] return TCL_ERROR; }"
 #    append compiled_statement "\n" "fprintf(stderr, \"list${foreach_num}_len = %d\\n\", __list${foreach_num}_len__);"
-    append compiled_statement "\n" "for (int __i${foreach_num}__ = 0; __i${foreach_num}__ < __list${foreach_num}_len__; __i${foreach_num}__ += [llength $foreach_varnames])  \{"
+    append compiled_statement "\n" "for (Tcl_Size __i${foreach_num}__ = 0; __i${foreach_num}__ < __list${foreach_num}_len__; __i${foreach_num}__ += [llength $foreach_varnames])  \{"
+    append compiled_statement "\n" "Tcl_Obj **__elem${foreach_num}__ = __list${foreach_num}_elems__ + __i${foreach_num}__;"
     set foreach_varname_i 0
     foreach foreach_varname $foreach_varnames {
-        append compiled_statement "\n" "Tcl_Obj *${foreach_varname};"
-        append compiled_statement "\n" "if (TCL_OK != Tcl_ListObjIndex(__interp__, __list${foreach_num}__, ${foreach_varname_i} + __i${foreach_num}__, &${foreach_varname})) { [garbage_collection codearr] return TCL_ERROR;}"
+        if { $foreach_varname_i == 0 } {
+            append compiled_statement "\n" "Tcl_Obj *${foreach_varname} = __elem${foreach_num}__\[0\];"
+        } else {
+            # like foreach, missing elements at the end of the list are empty
+            append compiled_statement "\n" "Tcl_Obj *${foreach_varname} = __i${foreach_num}__ + ${foreach_varname_i} < __list${foreach_num}_len__ ? __elem${foreach_num}__\[${foreach_varname_i}\] : [c_literal codearr {}];"
+        }
         incr foreach_varname_i
-
-        lappend_gc_list codearr obj ${foreach_varname}
     }
 
-    foreach foreach_varname $foreach_varnames {
-        lremove_gc_list codearr $foreach_varname
+    if { $box_indexvar } {
+        append compiled_statement "\n" "Tcl_Obj *${foreach_indexvar} = Tcl_NewWideIntObj(__indexvar_${foreach_indexvar}__);"
+        append compiled_statement "\n" "Tcl_IncrRefCount(${foreach_indexvar});"
+        lappend_gc_list codearr obj ${foreach_indexvar}
     }
 
-
     append compiled_statement "\x02"
 
     push_block codearr [list varnames $varnames]
@@ -168,20 +178,89 @@ proc ::thtml::compiler::c_compile_statement_foreach {codearrVar node} {
     pop_block codearr
 
     append compiled_statement "\x03"
+    append compiled_statement [c_output_check codearr]
+    if { $box_indexvar } {
+        append compiled_statement "\n" "Tcl_DecrRefCount(${foreach_indexvar});"
+        lremove_gc_list codearr $foreach_indexvar
+    }
     if { $foreach_indexvar ne "" } {
         append compiled_statement "\n" "__indexvar_${foreach_indexvar}__++;" "\n"
-        append compiled_statement "\n" "Tcl_SetIntObj(${foreach_indexvar}, __indexvar_${foreach_indexvar}__);"
     }
     append compiled_statement "\n" "\} "
 
     append compiled_statement "\n" "Tcl_DecrRefCount(__list${foreach_num}__);" "\n"
     lremove_gc_list codearr __list${foreach_num}__
 
-    if { $foreach_indexvar ne "" } {
-        append compiled_statement "\n" "Tcl_DecrRefCount(${foreach_indexvar});" "\n"
-        lremove_gc_list codearr $foreach_indexvar
+    append compiled_statement "\n" "\}" "\x02"
+    return $compiled_statement
+}
+
+# with the stats option, a template or include records its calls, see __thtml_stats_frame_t in thtml.h
+proc ::thtml::compiler::c_stats_enter {codearrVar} {
+    variable ::thtml::stats
+    if { !$stats } {
+        return
+    }
+    return "\n__thtml_stats_frame_t __stats__;\n__thtml_stats_enter__(__interp__, &__stats__, __ds_default__);"
+}
+
+proc ::thtml::compiler::c_stats_leave {codearrVar} {
+    upvar $codearrVar codearr
+    variable ::thtml::stats
+    if { !$stats } {
+        return
+    }
+    set name [string map {\\ \\\\ \" \\\"} [stats_name codearr]]
+    return "\n__thtml_stats_leave__(&__stats__, \"${name}\", __ds_default__);"
+}
+
+# a streaming render writes its output to the sink once there is enough of it, at the end of
+# every iteration of a foreach and after every include
+proc ::thtml::compiler::c_output_check {codearrVar} {
+    upvar $codearrVar codearr
+    return "\nif (TCL_OK != __thtml_output_check__(__interp__, __ds_default__)) { [garbage_collection codearr] return TCL_ERROR; }"
+}
+
+proc ::thtml::compiler::c_compile_statement_flush {codearrVar node} {
+    upvar $codearrVar codearr
+    return "\x03\nif (TCL_OK != __thtml_output_flush__(__interp__, __ds_default__, 1)) { [garbage_collection codearr] return TCL_ERROR; }\x02"
+}
+
+proc ::thtml::compiler::c_compile_statement_cache {codearrVar node} {
+    upvar $codearrVar codearr
+
+    set cache_num [incr codearr(cache_count)]
+    set ttl [$node @ttl 0]
+    if { ![string is wide -strict $ttl] } {
+        error "ttl of cache must be a number of seconds, got \"${ttl}\""
     }
+    set fragment_id [fragment_id codearr $node]
 
+    set compiled_statement ""
+    append compiled_statement "\x03" "\{"
+    append compiled_statement "\n" [c_compile_quoted_arg codearr \"[$node @cache]\" cache${cache_num}_keyobj]
+    append compiled_statement "\n" "Tcl_IncrRefCount(__cache${cache_num}_keyobj__);"
+    append compiled_statement "\n" "Tcl_DString __cache${cache_num}_key__;"
+    append compiled_statement "\n" "Tcl_DStringInit(&__cache${cache_num}_key__);"
+    append compiled_statement "\n" "Tcl_DStringAppend(&__cache${cache_num}_key__, \"${fragment_id}:\", [expr { [string length $fragment_id] + 1 }]);"
+    append compiled_statement "\n" "Tcl_DStringAppend(&__cache${cache_num}_key__, Tcl_GetString(__cache${cache_num}_keyobj__), -1);"
+    append compiled_statement "\n" "Tcl_DecrRefCount(__cache${cache_num}_keyobj__);"
+    lappend_gc_list codearr dstring &__cache${cache_num}_key__
+
+    append compiled_statement "\n" "if (!__thtml_fragment_get__(__interp__, Tcl_DStringValue(&__cache${cache_num}_key__), __ds_default__)) \{"
+    # the block is rendered at the end of the output, a streaming render writes it to the sink after it is done
+    append compiled_statement "\n" "Tcl_Size __cache${cache_num}_start__ = Tcl_DStringLength(__ds_default__);"
+    append compiled_statement "\n" "Tcl_Obj *__cache${cache_num}_sink__ = __thtml_output_pause__(__ds_default__);"
+    append compiled_statement "\x02"
+    append compiled_statement [compile_children codearr $node]
+    append compiled_statement "\x03"
+    append compiled_statement "\n" "__thtml_output_resume__(__ds_default__, __cache${cache_num}_sink__);"
+    append compiled_statement "\n" "__thtml_fragment_put__(__interp__, Tcl_DStringValue(&__cache${cache_num}_key__), Tcl_DStringValue(__ds_default__) + __cache${cache_num}_start__, Tcl_DStringLength(__ds_default__) - __cache${cache_num}_start__, ${ttl});"
+    append compiled_statement "\n" "\}"
+
+    append compiled_statement "\n" "Tcl_DStringFree(&__cache${cache_num}_key__);"
+    lremove_gc_list codearr &__cache${cache_num}_key__
+    append compiled_statement [c_output_check codearr]
     append compiled_statement "\n" "\}" "\x02"
     return $compiled_statement
 }
@@ -205,10 +284,12 @@ proc ::thtml::compiler::c_compile_statement_include {codearrVar node} {
         }
     }
 
-    push_component codearr [list md5 $filepath_md5 dir [file dirname $filepath] component_num [incr codearr(component_count)]]
+    push_component codearr [list md5 $filepath_md5 dir [file dirname $filepath] component_num [incr codearr(component_count)] name $filepath_from_rootdir]
 
     set tcl_code ""
     set tcl_filepath "[file rootname $filepath].tcl"
+    add_dependency codearr $filepath
+    add_dependency codearr $tcl_filepath
     if { [file exists $tcl_filepath] } {
         set fp [open $tcl_filepath]
         set tcl_code [read $fp]
@@ -260,30 +341,39 @@ proc ::thtml::compiler::c_compile_statement_include {codearrVar node} {
 
     set seen [get_seen codearr $proc_name]
     if { !$seen } {
+        begin_include codearr
 
         if { $tcl_code ne {} } {
             append compiled_include_proc "\n" "proc ${tcl_proc_name} {__data__} \{"
             append compiled_include_proc "\n" $tcl_code
             append compiled_include_proc "\n" "\}"
-            append codearr(tcl_defs) $compiled_include_proc
+            add_def codearr tcl $proc_name $compiled_include_proc
         }
 
         push_gc_list codearr
 
         append compiled_include_func "\n" "// " $filepath_from_rootdir
-        append compiled_include_func "\n" "int ${proc_name} (Tcl_Interp *__interp__, Tcl_DString *__ds_default__, Tcl_Obj *__data__) \{"
+        append compiled_include_func "\n" "static int ${proc_name} (Tcl_Interp *__interp__, Tcl_Obj **__literals__, Tcl_DString *__ds_default__, __thtml_scope_t *__scope__) \{"
+        append compiled_include_func [c_stats_enter codearr]
         foreach child [$root childNodes] {
             append compiled_include_func [c_transform \x02[compile_helper codearr $child]\x03]
         }
+        append compiled_include_func [c_stats_leave codearr]
         append compiled_include_func "\n" "return TCL_OK;"
         append compiled_include_func "\n" "\}"
-        append codearr(c_defs) $compiled_include_func
+        add_def codearr c $proc_name $compiled_include_func
 
         pop_gc_list codearr
 
+        end_include codearr $proc_name
+    } else {
+        use_include codearr $proc_name
     }
     set_seen codearr $proc_name
 
+    # the arguments are computed in the scope of the caller, e.g. with the variables of a foreach
+    pop_block codearr
+
     push_gc_list codearr
 
     set argnum 1
@@ -300,35 +390,33 @@ proc ::thtml::compiler::c_compile_statement_include {codearrVar node} {
 
     #puts argvalues=$argvalues
 
-    set list_objname "__list_include${include_num}__"
-    append compiled_include "\n" "Tcl_Obj *${list_objname} = Tcl_NewListObj(0, NULL);"
-    append compiled_include "\n" "Tcl_IncrRefCount(${list_objname});"
-    lappend_gc_list codearr obj $list_objname
+    # the arguments go in a layer of their own on top of the data of the caller
+    set scope_name "__scope_include${include_num}__"
+    append compiled_include "\n" "__thtml_scope_t ${scope_name};"
+    if { $argnames ne {} } {
+        append compiled_include "\n" "__thtml_scope_init__(&${scope_name}, __scope__, Tcl_NewDictObj());"
+    } else {
+        append compiled_include "\n" "__thtml_scope_init__(&${scope_name}, __scope__, NULL);"
+    }
+    lappend_gc_list codearr scope &${scope_name}
 
     foreach argname $argnames argvalue $argvalues {
-        append compiled_include "\n" "Tcl_ListObjAppendElement(__interp__, ${list_objname}, Tcl_NewStringObj(\"$argname\", -1));"
-        append compiled_include "\n" "Tcl_ListObjAppendElement(__interp__, ${list_objname}, $argvalue);"
+        append compiled_include "\n" "Tcl_DictObjPut(__interp__, ${scope_name}.dict, [c_literal codearr $argname], $argvalue);"
     }
 
-    set data_objname "__data_include${include_num}__"
-    append compiled_include "\n" "Tcl_Obj *${data_objname} = Tcl_DuplicateObj(__data__);"
-    append compiled_include "\n" "Tcl_IncrRefCount(${data_objname});"
-    lappend_gc_list codearr obj ${data_objname}
-
-    append compiled_include "\n" "if (TCL_OK != __thtml_dict_merge__(__interp__, ${data_objname}, ${list_objname})) { [garbage_collection codearr] return TCL_ERROR; }"
     if { $tcl_code ne {} } {
 
-        # call the tcl code
-        set proc_objname "__tcl_proc${include_num}__"
-        append compiled_include "\n" "Tcl_Obj *${proc_objname} = Tcl_NewStringObj(\"${tcl_proc_name}\", -1);"
-        append compiled_include "\n" "Tcl_IncrRefCount(${proc_objname});"
-        lappend_gc_list codearr obj ${proc_objname}
+        # call the tcl code with the data flattened into a single dict
+        set flat_objname "__data_include${include_num}__"
+        append compiled_include "\n" "Tcl_Obj *${flat_objname} = __thtml_scope_flatten__(__interp__, &${scope_name});"
+        append compiled_include "\n" "if (!${flat_objname}) { [garbage_collection codearr] return TCL_ERROR; }"
+        lappend_gc_list codearr obj ${flat_objname}
 
-        append compiled_include "\n" "Tcl_Obj *__eval_include${include_num}_objv__\[\] = \{ ${proc_objname}, ${data_objname}, NULL \};"
+        append compiled_include "\n" "Tcl_Obj *__eval_include${include_num}_objv__\[\] = \{ [c_literal codearr $tcl_proc_name], ${flat_objname}, NULL \};"
         append compiled_include "\n" "if (TCL_OK != Tcl_EvalObjv(__interp__, 2, __eval_include${include_num}_objv__, TCL_EVAL_DIRECT)) { [garbage_collection codearr] return TCL_ERROR; }"
 
-        append compiled_include "\n" "Tcl_DecrRefCount(${proc_objname});"
-        lremove_gc_list codearr ${proc_objname}
+        append compiled_include "\n" "Tcl_DecrRefCount(${flat_objname});"
+        lremove_gc_list codearr ${flat_objname}
 
         set res_objname "__res_tcl${include_num}__"
         append compiled_include "\n" "Tcl_Obj *${res_objname} = Tcl_GetObjResult(__interp__);"
@@ -337,14 +425,15 @@ proc ::thtml::compiler::c_compile_statement_include {codearrVar node} {
 
         append compiled_include "\n" "Tcl_ResetResult(__interp__);"
 
-        # merge the result of the tcl code with the include data
+        # the result of the tcl code goes in the layer of the arguments
 
-        append compiled_include "\n" "if (TCL_OK != __thtml_dict_merge__(__interp__, ${data_objname}, ${res_objname})) { [garbage_collection codearr] return TCL_ERROR; }"
+        append compiled_include "\n" "if (TCL_OK != __thtml_scope_merge__(__interp__, &${scope_name}, ${res_objname})) { [garbage_collection codearr] return TCL_ERROR; }"
         append compiled_include "\n" "Tcl_DecrRefCount(${res_objname});"
         lremove_gc_list codearr ${res_objname}
     }
 
-    append compiled_include "\n" "if (TCL_OK != ${proc_name}(__interp__, __ds_default__, ${data_objname})) { [garbage_collection codearr] return TCL_ERROR; }" "\n"
+    append compiled_include "\n" "if (TCL_OK != ${proc_name}(__interp__, __literals__, __ds_default__, &${scope_name})) { [garbage_collection codearr] return TCL_ERROR; }" "\n"
+    append compiled_include [c_output_check codearr]
     set argnum 1
     foreach attname [$node attributes] {
         if { $attname eq {include} } { continue }
@@ -354,16 +443,12 @@ proc ::thtml::compiler::c_compile_statement_include {codearrVar node} {
         incr argnum
     }
 
-    append compiled_include "\n" "Tcl_DecrRefCount(${list_objname});" "\n"
-    lremove_gc_list codearr ${list_objname}
-
-    append compiled_include "\n" "Tcl_DecrRefCount(${data_objname});" "\n"
-    lremove_gc_list codearr ${data_objname}
+    append compiled_include "\n" "__thtml_scope_free__(&${scope_name});" "\n"
+    lremove_gc_list codearr &${scope_name}
 
     append compiled_include "\x02"
 
     pop_gc_list codearr
-    pop_block codearr
     pop_component codearr
 
     return $compiled_include
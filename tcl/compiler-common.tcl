@@ -7,6 +7,10 @@ namespace eval ::thtml::compiler {
         area base basefont br col frame
         hr img input isindex link meta param
     }
+    variable URL_ATTRIBUTES_IN_HTML {
+        action background cite codebase data formaction
+        href longdesc manifest poster src usemap
+    }
 }
 
 proc ::thtml::compiler::compile_helper {codearrVar node} {
@@ -15,7 +19,7 @@ proc ::thtml::compiler::compile_helper {codearrVar node} {
 
     set node_type [$node nodeType]
     if { $node_type eq {TEXT_NODE} } {
-        return [${target_lang}_compile_template_text codearr \"[$node nodeValue]\"]
+        return [${target_lang}_compile_template_text codearr \"[$node nodeValue]\" text]
     } elseif { $node_type eq {ELEMENT_NODE} } {
         set tag [$node tagName]
         if { $tag in {tpl js css bundle_js bundle_css} } {
@@ -31,12 +35,14 @@ proc ::thtml::compiler::compile_element {codearrVar node} {
     set target_lang $codearr(target_lang)
 
     variable EMPTY_ELEMENTS_IN_HTML
+    variable URL_ATTRIBUTES_IN_HTML
 
     set tag [$node tagName]
     set compiled_element "<${tag}"
     foreach attname [$node attributes] {
         set attvalue [$node @$attname]
-        set compiled_attvalue [${target_lang}_compile_template_text codearr \"$attvalue\"]
+        set context [expr { [string tolower $attname] in $URL_ATTRIBUTES_IN_HTML ? "url" : "attr" }]
+        set compiled_attvalue [${target_lang}_compile_template_text codearr \"$attvalue\" $context]
         append compiled_element " ${attname}=\\\"${compiled_attvalue}\\\""
     }
 
@@ -65,6 +71,10 @@ proc ::thtml::compiler::compile_statement {codearrVar node} {
         return [${target_lang}_compile_statement_include codearr $node]
     } elseif { [$node hasAttribute "val"] } {
         return [${target_lang}_compile_statement_val codearr $node]
+    } elseif { [$node hasAttribute "flush"] } {
+        return [${target_lang}_compile_statement_flush codearr $node]
+    } elseif { [$node hasAttribute "cache"] } {
+        return [${target_lang}_compile_statement_cache codearr $node]
     } elseif { [$node tagName] eq {js} } {
         return [compile_statement_js codearr $node]
     } elseif { [$node tagName] eq {bundle_js} } {
@@ -77,6 +87,16 @@ proc ::thtml::compiler::compile_statement {codearrVar node} {
 }
 
 
+# The output of a <tpl cache="key"> block is kept in the fragment cache of the process under
+# its id and the value of the key. The id tells the block apart from the others by what it
+# contains and the directory that its includes are resolved from.
+proc ::thtml::compiler::fragment_id {codearrVar node} {
+    upvar $codearrVar codearr
+    set top_component [top_component codearr]
+    set dir [expr { [dict exists $top_component dir] ? [dict get $top_component dir] : {} }]
+    return [::thtml::util::md5 [list $dir [$node asXML]]]
+}
+
 proc ::thtml::compiler::compile_children {codearrVar node} {
     upvar $codearrVar codearr
 
@@ -87,6 +107,17 @@ proc ::thtml::compiler::compile_children {codearrVar node} {
     return $compiled_children
 }
 
+# a value without substitutions is written as it is, so that it joins the text around it
+proc ::thtml::compiler::compile_quoted_text {codearrVar text} {
+    upvar $codearrVar codearr
+    set target_lang $codearr(target_lang)
+
+    if { ![regexp {[$\[\\"]} $text] } {
+        return $text
+    }
+    return "\x03[${target_lang}_compile_quoted_string codearr \"$text\"]\x02"
+}
+
 ### js/css
 
 
@@ -102,7 +133,7 @@ proc ::thtml::compiler::compile_statement_bundle_css {codearrVar node} {
     set urlpath "${md5}/bundle_${md5}.css"
 
     append compiled_script "<link rel=\\\"stylesheet\\\" href=\\\""
-    append compiled_script "\x03" [${target_lang}_compile_quoted_string codearr "\"[$node @url_prefix]\""] "\x02"
+    append compiled_script [compile_quoted_text codearr [$node @url_prefix]]
     append compiled_script "/${urlpath}\\\" />"
     return $compiled_script
 }
@@ -124,7 +155,7 @@ proc ::thtml::compiler::compile_statement_bundle_js {codearrVar node} {
     set urlpath "${md5}/entry.js"
 
     append compiled_script "<script src=\\\""
-    append compiled_script "\x03" [${target_lang}_compile_quoted_string codearr "\"[$node @url_prefix]\""] "\x02"
+    append compiled_script [compile_quoted_text codearr [$node @url_prefix]]
     append compiled_script "/${urlpath}\\\"></script>"
     return $compiled_script
 }
@@ -170,7 +201,7 @@ proc ::thtml::compiler::compile_statement_js {codearrVar node} {
         } else {
             append compiled_script ","
         }
-        append compiled_script "\x03" [${target_lang}_compile_quoted_string codearr "\"$value\""] "\x02"
+        append compiled_script [compile_quoted_text codearr $value]
     }
     append compiled_script "\\\]);"
     append compiled_script "</script>"
@@ -180,6 +211,19 @@ proc ::thtml::compiler::compile_statement_js {codearrVar node} {
 
 }
 
+# returns 1 if the children of the node might refer to the variable, i.e. "$name" or "${name"
+# appears in their text or attributes, a false positive only costs some work at runtime
+proc ::thtml::compiler::uses_variable {node varname} {
+    set pattern {\$(\{!?)?}
+    append pattern [regsub -all {\W} $varname {\\&}] {\M}
+    foreach child [$node childNodes] {
+        if { [regexp $pattern [$child asXML]] } {
+            return 1
+        }
+    }
+    return 0
+}
+
 ### codearr manipulation
 
 proc ::thtml::compiler::push_block {codearrVar block} {
@@ -197,6 +241,63 @@ proc ::thtml::compiler::top_block {codearrVar} {
     return [lindex $codearr(blocks) 0]
 }
 
+# records a file the compiled code depends on with its mtime at the time it is read,
+# files that do not exist (yet) are recorded too, with an mtime of -1
+proc ::thtml::compiler::add_dependency {codearrVar filepath} {
+    upvar $codearrVar codearr
+    if { [catch {file mtime $filepath} mtime] } {
+        set mtime -1
+    }
+    dict set codearr(dependencies) $filepath $mtime
+}
+
+# adds the definition of an include to tcl_defs or c_defs, compiledir keeps them by name as well
+# to merge the definitions of its workers, see ::thtml::build::merge_chunks
+proc ::thtml::compiler::add_def {codearrVar lang name code} {
+    upvar $codearrVar codearr
+    append codearr(${lang}_defs) $code
+    if { [info exists codearr(defs)] } {
+        lappend codearr(defs) $lang $name $code
+    }
+}
+
+# The files an include depends on and the includes it uses are kept with it, so a template that
+# uses an include compiled before for another template in the same codearr records them as
+# well, see ::thtml::build::compile_chunk
+
+proc ::thtml::compiler::begin_include {codearrVar} {
+    upvar $codearrVar codearr
+    foreach key {dependencies used} {
+        if { ![info exists codearr($key)] } {
+            set codearr($key) {}
+        }
+    }
+    lappend codearr(include_stack) [list $codearr(dependencies) $codearr(used)]
+    set codearr(dependencies) {}
+    set codearr(used) {}
+}
+
+proc ::thtml::compiler::end_include {codearrVar name} {
+    upvar $codearrVar codearr
+    dict set codearr(used) $name 1
+    set codearr(include,$name) [list $codearr(dependencies) $codearr(used)]
+
+    lassign [lindex $codearr(include_stack) end] dependencies used
+    set codearr(include_stack) [lrange $codearr(include_stack) 0 end-1]
+    set codearr(dependencies) [dict merge $dependencies $codearr(dependencies)]
+    set codearr(used) [dict merge $used $codearr(used)]
+}
+
+proc ::thtml::compiler::use_include {codearrVar name} {
+    upvar $codearrVar codearr
+    dict set codearr(used) $name 1
+    if { [info exists codearr(include,$name)] } {
+        lassign $codearr(include,$name) dependencies used
+        set codearr(dependencies) [dict merge $codearr(dependencies) $dependencies]
+        set codearr(used) [dict merge $codearr(used) $used]
+    }
+}
+
 proc ::thtml::compiler::get_seen {codearrVar what} {
     upvar $codearrVar codearr
     return [dict exists $codearr(seen) $what]
@@ -222,6 +323,17 @@ proc ::thtml::compiler::top_component {codearrVar} {
     return [lindex $codearr(components) 0]
 }
 
+# the name that the calls of the template or include being compiled are recorded under when
+# the stats option is on, see ::thtml::stats
+proc ::thtml::compiler::stats_name {codearrVar} {
+    upvar $codearrVar codearr
+    set top_component [top_component codearr]
+    if { [dict exists $top_component name] } {
+        return [dict get $top_component name]
+    }
+    return template
+}
+
 proc ::thtml::compiler::push_gc_list {codearrVar args} {
     upvar $codearrVar codearr
     set codearr(gc_lists) [linsert $codearr(gc_lists) 0 $args]
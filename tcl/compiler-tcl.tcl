@@ -11,14 +11,85 @@ proc ::thtml::compiler::tcl_compile_root {codearrVar root} {
     upvar $codearrVar codearr
 
     set compiled_template ""
-    append compiled_template "\n" "set __ds_default__ \"\"" "\n"
+    append compiled_template "\n" "set __parent__ \{\}"
+    append compiled_template "\n" "set __ds_default__ \"\""
+    append compiled_template "\n" "if \{ \$__sink__ ne {} \} \{ set __sink__ \[::thtml::runtime::tcl::sink \$__sink__\] \}" "\n"
+    append compiled_template [tcl_stats_enter codearr]
+    append compiled_template "\n" "if \{ \$__doctype__ \} \{ append __ds_default__ \"<!doctype html>\" \}" "\n"
     foreach child [$root childNodes] {
         append compiled_template [tcl_transform \x02[compile_helper codearr $child]\x03]
     }
+    append compiled_template [tcl_stats_leave codearr]
+    # the output is streamed to the sink if one is given after the doctype flag
+    append compiled_template "\n" "if \{ \$__sink__ ne {} \} \{ ::thtml::runtime::tcl::flush __ds_default__ \$__sink__; return \}"
     append compiled_template "\n" "set __ds_default__" "\n"
     return $compiled_template
 }
 
+# with the stats option, a template or include records its calls, see ::thtml::stats
+proc ::thtml::compiler::tcl_stats_enter {codearrVar} {
+    variable ::thtml::stats
+    if { !$stats } {
+        return
+    }
+    return "\nset __stats__ \[::thtml::stats::enter\]"
+}
+
+proc ::thtml::compiler::tcl_stats_leave {codearrVar} {
+    upvar $codearrVar codearr
+    variable ::thtml::stats
+    if { !$stats } {
+        return
+    }
+    return "\n::thtml::stats::leave [list [stats_name codearr]] \$__stats__"
+}
+
+# a streaming render writes its output to the sink once there is enough of it, at the end of
+# every iteration of a foreach and after every include
+proc ::thtml::compiler::tcl_output_check {codearrVar} {
+    variable ::thtml::stream_chunk_size
+    return "\nif \{ \$__sink__ ne {} && \[string length \$__ds_default__\] >= ${stream_chunk_size} \} \{ ::thtml::runtime::tcl::flush __ds_default__ \$__sink__ 0 \}"
+}
+
+proc ::thtml::compiler::tcl_compile_statement_flush {codearrVar node} {
+    return "\x03\nif \{ \$__sink__ ne {} \} \{ ::thtml::runtime::tcl::flush __ds_default__ \$__sink__ \}\x02"
+}
+
+proc ::thtml::compiler::tcl_compile_statement_cache {codearrVar node} {
+    upvar $codearrVar codearr
+
+    set cache_num [incr codearr(cache_count)]
+    set ttl [$node @ttl 0]
+    if { ![string is wide -strict $ttl] } {
+        error "ttl of cache must be a number of seconds, got \"${ttl}\""
+    }
+
+    set compiled_statement ""
+    append compiled_statement "\x03"
+    append compiled_statement "\n" [tcl_compile_quoted_string codearr \"[$node @cache]\" cache${cache_num}_key]
+    append compiled_statement "\n" "set __cache${cache_num}_key__ [fragment_id codearr $node]:\$__ds_cache${cache_num}_key__"
+    append compiled_statement "\n" "if \{ !\[::thtml::fragment::get \$__cache${cache_num}_key__ __cache${cache_num}__\] \} \{"
+    # the block is rendered on its own, a streaming render writes it to the sink after it is done
+    append compiled_statement "\n" "set __cache${cache_num}_saved__ \$__ds_default__"
+    append compiled_statement "\n" "set __cache${cache_num}_sink__ \$__sink__"
+    append compiled_statement "\n" "set __ds_default__ \"\""
+    append compiled_statement "\n" "set __sink__ {}"
+    append compiled_statement "\x02"
+    append compiled_statement [compile_children codearr $node]
+    append compiled_statement "\x03"
+    append compiled_statement "\n" "set __cache${cache_num}__ \$__ds_default__"
+    append compiled_statement "\n" "set __ds_default__ \$__cache${cache_num}_saved__"
+    append compiled_statement "\n" "set __sink__ \$__cache${cache_num}_sink__"
+    # the output is not shared with the saved copy anymore, appending to it does not copy it
+    append compiled_statement "\n" "unset __cache${cache_num}_saved__"
+    append compiled_statement "\n" "::thtml::fragment::put \$__cache${cache_num}_key__ ${ttl} \$__cache${cache_num}__"
+    append compiled_statement "\n" "\}"
+    append compiled_statement "\n" "append __ds_default__ \$__cache${cache_num}__"
+    append compiled_statement [tcl_output_check codearr]
+    append compiled_statement "\x02"
+    return $compiled_statement
+}
+
 proc ::thtml::compiler::tcl_compile_statement_val {codearrVar node} {
     upvar $codearrVar codearr
 
@@ -33,9 +104,13 @@ proc ::thtml::compiler::tcl_compile_statement_val {codearrVar node} {
     set compiled_statement ""
     append compiled_statement "\x03"
     append compiled_statement $compiled_script
-    # using evaluate_script so that a return statement in a val command
-    # will return from the procedure, not from the whole script
-    append compiled_statement "\n" "dict set __data__ {*}${chain_of_keys} \[::thtml::runtime::tcl::evaluate_script \$__ds_val${val_num}__\]" "\x02"
+    # a nested write into a dict of an outer layer starts from a copy of it in this layer
+    if { [llength $chain_of_keys] > 1 } {
+        set first_key [list [lindex $chain_of_keys 0]]
+        append compiled_statement "\n" "dict set __data__ ${first_key} \[::thtml::runtime::tcl::scope_get \$__data__ \$__parent__ ${first_key} \{\}\]"
+    }
+    # a return statement anywhere in the script gives the value, see thtml_TclCompileScriptCmd
+    append compiled_statement "\n" "dict set __data__ {*}${chain_of_keys} \$__val${val_num}__" "\x02"
     return $compiled_statement
 }
 
@@ -70,8 +145,7 @@ proc ::thtml::compiler::tcl_compile_statement_foreach {codearrVar node} {
 
     set varnames $foreach_varnames
     if { $foreach_indexvar ne "" } {
-        append compiled_statement "\n" "set __indexvar_${foreach_indexvar}__ 0"
-        append compiled_statement "\n" "set ${foreach_indexvar} \$__indexvar_${foreach_indexvar}__"
+        append compiled_statement "\n" "set ${foreach_indexvar} 0"
         lappend varnames $foreach_indexvar
     }
 
@@ -79,16 +153,7 @@ proc ::thtml::compiler::tcl_compile_statement_foreach {codearrVar node} {
 
     append compiled_statement "\n" ${compiled_foreach_list}
 #    append compiled_statement "\n" "puts list${foreach_num}=\$__list${foreach_num}__"
-    append compiled_statement "\n" "set __list${foreach_num}_len__ \[llength \$__list${foreach_num}__\]"
-    append compiled_statement "\n" "for \{ set __i${foreach_num}__ 0 \} \{ \$__i${foreach_num}__ < \$__list${foreach_num}_len__ \} \{ incr __i${foreach_num}__ [llength $foreach_varnames] \}  \{"
-#    append compiled_statement "\n" "set __elem${foreach_num}__ \[lindex \$__list${foreach_num}__ \$__i${foreach_num}__\]"
-    set foreach_varname_i 0
-    foreach foreach_varname $foreach_varnames {
-        append compiled_statement "\n" "set ${foreach_varname} \[lindex \$__list${foreach_num}__ \[expr \{ ${foreach_varname_i} + \$__i${foreach_num}__ \}\]\]"
-#        append compiled_statement "\n" "puts ${foreach_varname}=\$${foreach_varname}"
-        incr foreach_varname_i
-    }
-
+    append compiled_statement "\n" "foreach [list $foreach_varnames] \$__list${foreach_num}__ \{"
 
     append compiled_statement "\x02"
 
@@ -97,9 +162,9 @@ proc ::thtml::compiler::tcl_compile_statement_foreach {codearrVar node} {
     pop_block codearr
 
     append compiled_statement "\x03"
+    append compiled_statement [tcl_output_check codearr]
     if { $foreach_indexvar ne "" } {
-        append compiled_statement "\n" "incr __indexvar_${foreach_indexvar}__" "\n"
-        append compiled_statement "\n" "set ${foreach_indexvar} \$__indexvar_${foreach_indexvar}__"
+        append compiled_statement "\n" "incr ${foreach_indexvar}" "\n"
     }
     append compiled_statement "\n" "\} "
     append compiled_statement "\n" "\x02"
@@ -124,10 +189,12 @@ proc ::thtml::compiler::tcl_compile_statement_include {codearrVar node} {
         }
     }
 
-    push_component codearr [list md5 $filepath_md5 dir [file dirname $filepath] component_num [incr codearr(component_count)]]
+    push_component codearr [list md5 $filepath_md5 dir [file dirname $filepath] component_num [incr codearr(component_count)] name $filepath_from_rootdir]
 
     set tcl_code ""
     set tcl_filepath "[file rootname $filepath].tcl"
+    add_dependency codearr $filepath
+    add_dependency codearr $tcl_filepath
     if { [file exists $tcl_filepath] } {
         set fp [open $tcl_filepath]
         set tcl_code [read $fp]
@@ -191,6 +258,7 @@ proc ::thtml::compiler::tcl_compile_statement_include {codearrVar node} {
 
     set seen [get_seen codearr $proc_name]
     if { !$seen } {
+        begin_include codearr
 
         if { $tcl_code ne {} } {
             append compiled_include_proc "\n" "proc ${tcl_proc_name} {__data__} \{"
@@ -198,14 +266,20 @@ proc ::thtml::compiler::tcl_compile_statement_include {codearrVar node} {
             append compiled_include_proc "\n" "\}"
         }
 
-        append compiled_include_proc "\n" "proc ${proc_name} {__data__} \{"
-        append compiled_include_proc "\n" "set __ds_default__ \"\"" "\n"
+        # the include appends to the output of its caller, so that a streaming render writes it in order
+        append compiled_include_proc "\n" "proc ${proc_name} {__data__ __parent__} \{"
+        append compiled_include_proc "\n" "upvar 1 __ds_default__ __ds_default__ __sink__ __sink__"
+        append compiled_include_proc [tcl_stats_enter codearr] "\n"
         foreach child [$root childNodes] {
             append compiled_include_proc [tcl_transform \x02[compile_helper codearr $child]\x03]
         }
-        append compiled_include_proc "\n" "return \$__ds_default__"
+        append compiled_include_proc [tcl_stats_leave codearr]
+        append compiled_include_proc "\n" "return"
         append compiled_include_proc "\n" "\}"
-        append codearr(tcl_defs) $compiled_include_proc
+        add_def codearr tcl $proc_name $compiled_include_proc
+        end_include codearr $proc_name
+    } else {
+        use_include codearr $proc_name
     }
     set_seen codearr $proc_name
 
@@ -215,13 +289,17 @@ proc ::thtml::compiler::tcl_compile_statement_include {codearrVar node} {
     foreach argname $argnames argvalue $argvalues {
         append compiled_include "\n" "lappend __list_include${include_num}__ $argname $argvalue"
     }
-    set argdata_code "\[dict merge \$__data__ \$__list_include${include_num}__\]"
+    # the arguments go in a layer of their own on top of the data of the caller
+    set argdata_code "\$__list_include${include_num}__ \[list \$__data__ {*}\$__parent__\]"
     if { $tcl_code ne {} } {
-        set argdata_code "\[${tcl_proc_name} \[dict merge \$__data__ \$__list_include${include_num}__\]\]"
+        # the tcl code gets the data flattened into a single dict, its result goes in the layer of the arguments
+        set flat_code "\[::thtml::runtime::tcl::scope_flatten \$__list_include${include_num}__ \[list \$__data__ {*}\$__parent__\]\]"
+        set argdata_code "\[dict merge \$__list_include${include_num}__ \[${tcl_proc_name} ${flat_code}\]\] \[list \$__data__ {*}\$__parent__\]"
     }
     #append compiled_include "\n" "set __data_include${include_num}__ \[dict merge $argdata_code \$__list_include${include_num}__\]"
     #append compiled_include "\n" "puts \$__data_include${include_num}__"
-    append compiled_include "\n" "append __ds_default__ \[${proc_name} $argdata_code\]" "\n"
+    append compiled_include "\n" "${proc_name} $argdata_code" "\n"
+    append compiled_include [tcl_output_check codearr]
     append compiled_include "\n" "unset __list_include${include_num}__"
     append compiled_include "\x02"
 
@@ -5,6 +5,7 @@
 set dir [file dirname [info script]]
 
 source [file join $dir thtml.tcl]
+source [file join $dir watch.tcl]
 source [file join $dir compiler-common.tcl]
 source [file join $dir compiler-tcl.tcl]
 source [file join $dir compiler-c.tcl]
@@ -4,8 +4,35 @@
 
 namespace eval ::thtml::runtime::tcl {}
 
-proc ::thtml::runtime::tcl::evaluate_script {script} {
-    #puts script=$script
-    return [uplevel 1 $script]
+# merges the layers of the template data into a single dict, for the tcl code of an include
+proc ::thtml::runtime::tcl::scope_flatten {data parents} {
+    return [dict merge {*}[lreverse $parents] $data]
 }
 
+# returns the sink of a streaming render along with its kind, a channel if there is one by that
+# name or else a command prefix that gets the output as its last argument, it is looked up once
+# when the render starts and not on every flush
+proc ::thtml::runtime::tcl::sink {sink} {
+    if { $sink in [chan names] } {
+        return [list channel $sink]
+    }
+    return [list command $sink]
+}
+
+# writes the output of a streaming render to its sink, as returned by sink, and empties it
+proc ::thtml::runtime::tcl::flush {dsVar sink {flush_channel 1}} {
+    upvar $dsVar ds
+    if { $::thtml::stats } {
+        ::thtml::stats::flushed $ds
+    }
+    lassign $sink kind target
+    if { $kind eq {channel} } {
+        puts -nonewline $target $ds
+        if { $flush_channel } {
+            ::flush $target
+        }
+    } elseif { $ds ne {} } {
+        uplevel #0 [list {*}$target $ds]
+    }
+    set ds ""
+}
@@ -15,6 +15,13 @@ namespace eval ::thtml {
     variable target_lang tcl
     variable debug 0
     variable build 0
+    variable buffer_size_cap 4194304
+    variable stream_chunk_size 16384
+    variable compiled_cache_size 128
+    variable compiled_cache {}
+    variable watch 0
+    variable build_workers 0
+    variable stats 0
 }
 namespace eval ::thtml::cache {}
 
@@ -27,6 +34,12 @@ proc ::thtml::init {option_dict} {
     variable target_lang
     variable debug
     variable build
+    variable buffer_size_cap
+    variable stream_chunk_size
+    variable compiled_cache_size
+    variable watch
+    variable build_workers
+    variable stats
 
     if { [dict exists $option_dict rootdir] } {
         set rootdir [file normalize [dict get $option_dict rootdir]]
@@ -56,6 +69,46 @@ proc ::thtml::init {option_dict} {
         set build [dict get $option_dict build]
     }
 
+    if { [dict exists $option_dict buffer_size_cap] } {
+        set buffer_size_cap [dict get $option_dict buffer_size_cap]
+    }
+
+    # bytes that a streaming render collects before it writes them to its sink, applied as templates are compiled
+    if { [dict exists $option_dict stream_chunk_size] } {
+        set stream_chunk_size [dict get $option_dict stream_chunk_size]
+    }
+
+    # number of threads that compile a directory, 0 for one per cpu
+    if { [dict exists $option_dict build_workers] } {
+        set build_workers [dict get $option_dict build_workers]
+    }
+
+    # bytes that the output of <tpl cache> blocks may take, shared by all the threads of the process
+    if { [dict exists $option_dict fragment_cache_size] } {
+        ::thtml::fragment::max_bytes [dict get $option_dict fragment_cache_size]
+    }
+
+    # templates compiled from now on record their calls, see ::thtml::stats
+    if { [dict exists $option_dict stats] } {
+        set stats [dict get $option_dict stats]
+    }
+
+    if { [dict exists $option_dict compiled_cache_size] } {
+        set compiled_cache_size [dict get $option_dict compiled_cache_size]
+    }
+    forget_compiled
+
+    if { [dict exists $option_dict watch] } {
+        set watch [dict get $option_dict watch]
+    }
+
+    # the watcher keeps the templates compiled in uncached mode up to date
+    if { $watch && !$cache } {
+        ::thtml::watch::start
+    } else {
+        ::thtml::watch::stop
+    }
+
     if { ![file isdirectory $cachedir] } {
         file mkdir $cachedir
     }
@@ -129,47 +182,209 @@ proc ::thtml::load_compiled_templates {} {
     }
 }
 
-proc ::thtml::render {template __data__} {
+# renders the template with the given data, the doctype prefix is written unless __doctype__ is false (for fragments),
+# the output is returned, or streamed if a sink is given, a channel or a command prefix that gets every chunk as its last
+# argument, see __thtml_output_t in thtml.h
+proc ::thtml::render {template __data__ {__doctype__ 1} {__sink__ {}}} {
     variable cache
     variable rootdir
     variable target_lang
     variable debug
 
+    # the template keeps its compiled command as its internal rep, see ::thtml::cache::render
+    if { $cache } {
+        if { $__sink__ ne {} } {
+            return [::thtml::cache::render $template $__data__ $__doctype__ $__sink__]
+        }
+        return [::thtml::cache::render $template $__data__ $__doctype__]
+    }
+
     if { $debug } { puts target_lang=$target_lang }
-    array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 0]
 
     set md5 [::thtml::util::md5 $template]
 
-    if { $cache } {
-        set proc_name ::thtml::cache::__template__$md5
-        return "<!doctype html>[$proc_name $__data__]"
+    set proc_name [get_compiled template,$md5]
+    if { $proc_name ne {} } {
+        return [$proc_name $__data__ $__doctype__ $__sink__]
     }
-    set compiled_template [compile codearr $template tcl]
+
+    set compiled_template [compile_source codearr template $template]
     #puts compiled_template=$compiled_template
-    eval $codearr(tcl_defs)
-    return "<!doctype html>[eval $compiled_template]"
+    set proc_name [set_compiled codearr template,$md5 [list template $template] $compiled_template]
+    if { $proc_name ne {} } {
+        return [$proc_name $__data__ $__doctype__ $__sink__]
+    }
+    return [eval $compiled_template]
 }
 
-proc ::thtml::renderfile {filename __data__} {
+proc ::thtml::renderfile {filename __data__ {__doctype__ 1} {__sink__ {}}} {
     variable cache
     variable rootdir
     variable target_lang
 
+    # a single lookup in the dispatch table, see ::thtml::cache::register
+    if { $cache } {
+        if { $__sink__ ne {} } {
+            return [::thtml::cache::renderfile $filename $__data__ $__doctype__ $__sink__]
+        }
+        return [::thtml::cache::renderfile $filename $__data__ $__doctype__]
+    }
+
+    set proc_name [get_compiled file,$filename]
+    if { $proc_name ne {} } {
+        return [$proc_name $__data__ $__doctype__ $__sink__]
+    }
+
+    set compiled_template [compile_source codearr file $filename]
+    #puts $codearr(tcl_defs)\ncompiled_template=$compiled_template
+    set proc_name [set_compiled codearr file,$filename [list file $filename] $compiled_template]
+    if { $proc_name ne {} } {
+        return [$proc_name $__data__ $__doctype__ $__sink__]
+    }
+    return [eval $compiled_template]
+}
+
+# compiles a template given as text ("template") or by its filename ("file") to tcl,
+# the procs of its includes are defined right away
+proc ::thtml::compile_source {codearrVar kind value} {
+    upvar $codearrVar codearr
+    variable target_lang
+
+    array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 0]
+
+    if { $kind eq {file} } {
+        set filepath [::thtml::resolve_filepath codearr $value]
+        set relative_filepath [string range $filepath [string length [::thtml::get_rootdir]] end]
+        set md5 [::thtml::util::md5 $relative_filepath]
+        set compiled_template [compilefile codearr $md5 $filepath tcl]
+    } else {
+        set compiled_template [compile codearr $value tcl]
+    }
+
+    eval $codearr(tcl_defs)
+    return $compiled_template
+}
+
+# In uncached mode the compiled templates are kept in memory as procs, keyed by the filename
+# given to renderfile or the md5 of the template given to render. An entry is dropped when
+# one of the files it was compiled from changes, and the least recently used entries are
+# evicted once there are more than compiled_cache_size of them. While the watcher runs, the
+# files are not checked on every render, changed templates are recompiled in the background
+# instead, see watch.tcl. The files of a template whose directories could not all be watched
+# are still checked.
+
+# returns the proc of a compiled template that is still up to date, or the empty string
+proc ::thtml::get_compiled {key} {
+    variable compiled_cache
+
+    if { ![dict exists $compiled_cache $key] } {
+        return
+    }
+
+    set entry [dict get $compiled_cache $key]
+    if { !$::thtml::watch::running || [dict get $entry check_files] } {
+        dict for {filepath mtime} [dict get $entry dependencies] {
+            if { [catch {file mtime $filepath} current_mtime] } {
+                set current_mtime -1
+            }
+            if { $current_mtime != $mtime } {
+                forget_compiled $key
+                return
+            }
+        }
+    }
+
+    # the least recently used entries are at the front
+    dict unset compiled_cache $key
+    dict set compiled_cache $key $entry
+    return [dict get $entry proc_name]
+}
+
+# defines a proc for the compiled template and keeps it along with what it was compiled from,
+# returns the empty string if the cache is disabled
+proc ::thtml::set_compiled {codearrVar key source compiled_template} {
+    upvar $codearrVar codearr
+    variable compiled_cache
+    variable compiled_cache_size
+
+    if { $compiled_cache_size <= 0 } {
+        return
+    }
+
+    set dependencies {}
+    if { [info exists codearr(dependencies)] } {
+        set dependencies $codearr(dependencies)
+    }
+
+    forget_compiled $key
+    while { [dict size $compiled_cache] >= $compiled_cache_size } {
+        forget_compiled [lindex [dict keys $compiled_cache] 0]
+    }
+
+    set proc_name ::thtml::__compiled__[::thtml::util::md5 $key]
+    proc $proc_name {__data__ {__doctype__ 1} {__sink__ {}}} $compiled_template
+    set check_files [expr { ![::thtml::watch::track $dependencies] }]
+    dict set compiled_cache $key [list proc_name $proc_name source $source dependencies $dependencies check_files $check_files]
+    return $proc_name
+}
+
+# drops one compiled template, or all of them if no key is given
+proc ::thtml::forget_compiled {{key ""}} {
+    variable compiled_cache
+
+    if { $key eq {} } {
+        set keys [dict keys $compiled_cache]
+    } else {
+        set keys [list $key]
+    }
+
+    foreach key $keys {
+        if { [dict exists $compiled_cache $key] } {
+            rename [dict get $compiled_cache $key proc_name] {}
+            dict unset compiled_cache $key
+        }
+    }
+}
+
+# adds a compiled template to the dispatch table of renderfile, called from the compiled
+# code as it is loaded, under the filenames that resolve to it by default
+proc ::thtml::cache::register {relative_filepath cmd_name} {
+    set rootdir [::thtml::get_rootdir]
+    ::thtml::cache::dispatch_set $relative_filepath $cmd_name
+    ::thtml::cache::dispatch_set ${rootdir}${relative_filepath} $cmd_name
+    set wwwdir "[file separator]www[file separator]"
+    if { [::thtml::util::starts_with $relative_filepath $wwwdir] } {
+        ::thtml::cache::dispatch_set [string range $relative_filepath [string length $wwwdir] end] $cmd_name
+    }
+}
+
+# returns the command of the compiled template for a filename not in the dispatch table yet
+proc ::thtml::cache::resolve {filename} {
+    variable ::thtml::target_lang
+
     array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 0]
 
     set filepath [::thtml::resolve_filepath codearr $filename]
     set relative_filepath [string range $filepath [string length [::thtml::get_rootdir]] end]
-    set md5 [::thtml::util::md5 $relative_filepath]
+    return ::thtml::cache::__file__[::thtml::util::md5 $relative_filepath]
+}
 
-    if { $cache } {
-        set proc_name ::thtml::cache::__file__$md5
-        return "<!doctype html>[$proc_name $__data__]"
+# returns the running output size estimate that a compiled C template uses to presize its output buffer
+proc ::thtml::buffer_size_estimate {filename} {
+    variable cache
+    variable target_lang
+
+    if { !$cache || $target_lang ne {c} } {
+        error "buffer size estimates are only kept for cached C templates"
     }
 
-    set compiled_template [compilefile codearr $md5 $filepath tcl]
-    #puts $codearr(tcl_defs)\ncompiled_template=$compiled_template
-    eval $codearr(tcl_defs)
-    return "<!doctype html>[eval $compiled_template]"
+    array set codearr [list blocks {} components {} target_lang $target_lang gc_lists {} tcl_defs {} c_defs {} seen {} load_packages 0]
+
+    set filepath [::thtml::resolve_filepath codearr $filename]
+    set relative_filepath [string range $filepath [string length [::thtml::get_rootdir]] end]
+    set md5 [::thtml::util::md5 $relative_filepath]
+
+    return [::thtml::cache::__size_estimate__$md5]
 }
 
 proc ::thtml::compile {codearrVar template target_lang} {
@@ -189,12 +404,14 @@ proc ::thtml::compilefile {codearrVar md5 filepath target_lang} {
     upvar $codearrVar codearr
 
     set mtime [file mtime $filepath]
+    ::thtml::compiler::add_dependency codearr $filepath
 
     set fp [open $filepath]
     set template [read $fp]
     close $fp
 
-    ::thtml::compiler::push_component codearr [list md5 $md5 dir [file dirname $filepath] component_num [incr codearr(component_count)]]
+    set name [string range $filepath [string length [::thtml::get_rootdir]] end]
+    ::thtml::compiler::push_component codearr [list md5 $md5 dir [file dirname $filepath] component_num [incr codearr(component_count)] name $name]
 
     set result [compile codearr $template $target_lang]
     ::thtml::bundle::process_bundle codearr $mtime
@@ -0,0 +1,128 @@
+# Copyright Jerily LTD. All Rights Reserved.
+# SPDX-FileCopyrightText: 2024 Neofytos Dimitriou (neo@jerily.cy)
+# SPDX-License-Identifier: MIT.
+
+# Keeps the templates compiled in uncached mode up to date without checking their files on
+# every render. The directories of the files a template was compiled from (its includes,
+# their .tcl companions and files of @package paths alike) are watched, and a change
+# recompiles only the templates that depend on the changed file, from the event loop.
+
+namespace eval ::thtml::watch {
+    variable running 0
+    variable pending {}
+    variable recompiled 0
+}
+
+# starts watching the files of the templates compiled so far and of every one compiled later
+proc ::thtml::watch::start {} {
+    variable running
+
+    watch_start
+    set running 1
+
+    dict for {key entry} $::thtml::compiled_cache {
+        dict set ::thtml::compiled_cache $key check_files [expr { ![track [dict get $entry dependencies]] }]
+    }
+}
+
+proc ::thtml::watch::stop {} {
+    variable running
+    variable pending
+
+    watch_stop
+    set running 0
+    set pending {}
+    after cancel ::thtml::watch::recompile
+}
+
+# watches the directories of the given dependencies, a dict of filepath to mtime, returns 0 if
+# one of them could not be watched, the files of the template are then checked on every render
+proc ::thtml::watch::track {dependencies} {
+    variable running
+
+    if { !$running } {
+        return 1
+    }
+
+    set watched 1
+    foreach filepath [dict keys $dependencies] {
+        set dir [file dirname $filepath]
+        try {
+            watch_dir $dir
+        } trap {POSIX ENOENT} {} - trap {POSIX ENOTDIR} {} {
+            # a directory that does not exist cannot be watched, nothing in it is used either
+        } on error {message} {
+            # e.g. out of inotify watches
+            puts stderr "thtml: $message, the files in it are checked on every render"
+            set watched 0
+        }
+    }
+    return $watched
+}
+
+# called with the paths of the changed files, or with overflow set if events were lost
+proc ::thtml::watch::changed {paths overflow} {
+    variable pending
+
+    set keys {}
+    dict for {key entry} $::thtml::compiled_cache {
+        if { $overflow } {
+            lappend keys $key
+            continue
+        }
+        foreach filepath $paths {
+            if { [dict exists $entry dependencies $filepath] } {
+                lappend keys $key
+                break
+            }
+        }
+    }
+
+    if { $keys eq {} } {
+        return
+    }
+
+    # editors write a file in several steps, those all end up in one recompile
+    if { $pending eq {} } {
+        after idle ::thtml::watch::recompile
+    }
+    foreach key $keys {
+        if { $key ni $pending } {
+            lappend pending $key
+        }
+    }
+}
+
+# recompiles the pending templates, each new version replaces the proc of the previous one
+# in a single step, so renders never see a template that is half way through recompiling
+proc ::thtml::watch::recompile {} {
+    variable pending
+    variable recompiled
+
+    set keys $pending
+    set pending {}
+
+    foreach key $keys {
+        if { ![dict exists $::thtml::compiled_cache $key] } {
+            continue
+        }
+
+        set entry [dict get $::thtml::compiled_cache $key]
+        unset -nocomplain codearr
+        if { [catch { ::thtml::compile_source codearr {*}[dict get $entry source] } compiled_template] } {
+            # the next render compiles it again and reports the error
+            ::thtml::forget_compiled $key
+            continue
+        }
+
+        set dependencies {}
+        if { [info exists codearr(dependencies)] } {
+            set dependencies $codearr(dependencies)
+        }
+
+        proc [dict get $entry proc_name] {__data__ {__doctype__ 1} {__sink__ {}}} $compiled_template
+        dict set ::thtml::compiled_cache $key dependencies $dependencies
+        dict set ::thtml::compiled_cache $key check_files [expr { ![track $dependencies] }]
+        incr recompiled
+    }
+}
@@ -0,0 +1 @@
+return [list greeting "hello [dict get $__data__ name]"]